@@ -6,45 +6,131 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <strings.h>
 #include <errno.h>
 #include <ctype.h>
 
 #include <unistd.h>
 #include <fcntl.h>
 
-#include <sys/ioctl.h>
-#include <linux/sockios.h>
-#include <alloca.h>
+#include <sys/uio.h>
 
 #include "client.h"
 #include "ebml_writer.h"
 #include "ebml_reader.h"
 #include "base64.h"
+#include "worker.h"
+#include "pool.h"
 
 
-static ssize_t local_buffer_required_size          (buffer_p local_buffer, client_p client, int client_fd);
-static ssize_t local_buffer_recv                   (buffer_p local_buffer, client_p client, int client_fd);
-static void    local_buffer_backup_to_client_buffer(buffer_p local_buffer, client_p client);
-static ssize_t first_line_length                   (buffer_p local_buffer);
+// Response header for viewers, the start of each join bundle
+#define STREAM_RESPONSE_HEADER       \
+	"HTTP/1.1 200 OK\r\n"             \
+	"Server: smeb v1.0.0\r\n"         \
+	"Transfer-Encoding: chunked\r\n"  \
+	"Cache-Control: no-cache\r\n"     \
+	"Content-Type: video/webm\r\n"    \
+	"\r\n"
 
+// Ends the response of a viewer that switches to another stream. Each join bundle has room
+// for it in front of the response header.
+#define STREAM_LAST_CHUNK "0\r\n\r\n"
+
+// Buffers a viewer writes at once while sending the join bundle and the intro
+#define STREAM_VIEWER_MAX_IOVECS 64
+
+
+static int   http_request_read           (client_p client, int client_fd);
 static void  http_request_handle_headline(client_p client, char* verb, char* resource, char* version);
 static void  http_request_handle_header  (client_p client, int client_fd, char* name, char* value);
+static void  http_request_next           (client_p client);
+static void  http_request_free           (client_p client);
+static char* http_request_decoded_path   (const char* resource);
+static const char* http_connection_header(client_p client);
+static const char* http_pending_last_chunk(client_p client);
 static void* http_request_dispatch       (client_p client, int client_fd, server_p server,
-	void* enter_send_buffer_and_disconnect,
+	void* enter_send_buffer,
 	void* enter_receive_stream,
 	void* enter_send_stream,
-	void* enter_status_info
+	void* enter_status_info,
+	void* enter_metrics
 );
 
-static ssize_t streamer_try_to_extract_mkv_header(void* buffer_ptr, size_t buffer_size);
-static ssize_t streamer_try_to_extract_mkv_cluster(void* buffer_ptr, size_t buffer_size);
+// What streamer_inspect_cluster() found out about a cluster. keyframe_tail_size is the
+// number of bytes from the last video keyframe block to the end of the cluster, 0 if
+// there is none.
+typedef struct {
+	uint64_t timecode;
+	size_t keyframe_tail_size;
+	bool starts_with_keyframe;
+} streamer_cluster_info_t;
+
 static size_t streamer_calculate_http_encapsulated_size(size_t payload_size);
-static bool streamer_inspect_cluster(void* buffer_ptr, size_t buffer_size, stream_p stream, char** patched_buffer_ptr, size_t* patched_buffer_size, server_p server);
+static streamer_cluster_info_t streamer_inspect_cluster(void* buffer_ptr, size_t buffer_size, stream_p stream, server_p server);
+static streamer_cluster_info_t streamer_inspect_block(char* block_ptr, size_t block_size, uint64_t cluster_timecode, stream_p stream);
+static void streamer_update_intro(server_p server, stream_p stream, shared_buffer_p cluster, uint64_t cluster_seq, streamer_cluster_info_t info);
+static char* streamer_new_cluster_chunk(char* buffered_ptr, size_t buffered_size, size_t cluster_size);
+static shared_buffer_p streamer_new_fragment_cluster(uint64_t timecode, char* block_ptr, size_t block_size, size_t refcount, stream_p stream, size_t* capacity);
+static void  streamer_append_block(client_p client, char* block_ptr, size_t block_size, server_p server);
+static void  streamer_close_fragment(client_p client, server_p server);
+static void  streamer_buffer_remove(buffer_p buffer, size_t size);
+static void  streamer_publish_cluster(char* chunk_ptr, size_t chunk_size, stream_p stream, server_p server);
+static void  streamer_count_ingest(stream_p stream, size_t cluster_size, streamer_cluster_info_t info, usec_t received_at);
+static void  streamer_publish_open_cluster(client_p client, server_p server);
+static char* streamer_patch_cluster(char* chunk_ptr, size_t* chunk_size, uint64_t timecode_offset);
+static void  streamer_write_uint(uint8_t* ptr, uint64_t value, size_t bytes);
+static char* streamer_reduce_cluster(char* cluster_ptr, size_t cluster_size, size_t* chunk_size);
+
+static size_t streamer_http_encapsulate(char* dest, char* content_ptr, size_t content_size);
+
+static void stream_buffer_new(stream_buffer_p stream_buffer, shared_buffer_p shared);
+static void stream_feed_release_oldest(server_p server, stream_feed_p feed);
+static void stream_feed_release_unneeded(server_p server, stream_feed_p feed);
+static void stream_feed_update_fragment(server_p server, stream_feed_p feed);
+static void stream_feed_unstall_viewers(server_p server, stream_p stream, stream_feed_p feed);
+static stream_buffer_p stream_feed_buffer(stream_feed_p feed, uint64_t seq);
+
+static size_t stream_budget_usage(stream_p stream, size_t buffered_bytes);
+static bool stream_over_budget(server_p server, stream_p stream);
+static bool global_over_budget(server_p server);
+static bool stream_should_evict(server_p server, stream_p stream);
+static bool stream_pause_source(server_p server, stream_p stream, int client_fd, client_p client);
+
+static size_t stream_intro_prefix(stream_p stream, char* dest);
+static void   stream_release_intro_clusters(server_p server, stream_p stream);
+static void   stream_release_join_bundle(server_p server, stream_p stream);
+static shared_buffer_p stream_join_bundle(stream_p stream);
+static bool   stream_viewer_start_intro(server_p server, client_p client, bool join);
+static struct iovec stream_viewer_intro_iovec(client_p client, size_t index);
+static bool   stream_viewer_next_intro_buffer(server_p server, client_p client);
+static size_t stream_viewer_iovecs(client_p client, struct iovec* iov, size_t iov_capacity);
+static void   stream_viewer_finish_buffer(server_p server, client_p client);
+static bool   stream_viewer_caught_up(stream_feed_p feed, client_p client);
+static void   stream_viewer_advance(server_p server, client_p client, size_t bytes_written);
+static void   stream_viewer_release_intro(server_p server, client_p client);
+static void   stream_viewer_hold_cluster(server_p server, client_p client, shared_buffer_p cluster);
+static bool   stream_viewer_at_chunk_boundary(client_p client);
+static void   stream_viewer_leave(server_p server, client_p client);
+static void   stream_viewer_record_join(stream_feed_p feed, client_p client);
 
-static void stream_buffer_new(stream_buffer_p stream_buffer, char* content_ptr, size_t content_size, uint32_t flags);
-static void stream_buffer_new_http_encapsulated(stream_buffer_p stream_buffer, char* content_ptr, size_t content_size, uint32_t flags);
-static void stream_buffer_ref(stream_buffer_p stream_buffer);
-static bool stream_buffer_unref(stream_buffer_p stream_buffer);
+static void stream_add_viewer           (server_p server, stream_p stream, int client_fd, client_p client);
+static void stream_remove_viewer        (server_p server, stream_p stream, client_p client);
+static void stream_add_stalled_viewer   (server_p server, stream_p stream, int client_fd, client_p client);
+static void stream_remove_stalled_viewer(server_p server, stream_p stream, client_p client);
+
+static shared_buffer_p shared_buffer_new(char* allocation, char* ptr, size_t size, size_t refcount, stream_p stream);
+static shared_buffer_p shared_buffer_new_http_chunk(char* chunk_ptr, size_t chunk_size, size_t refcount, stream_p stream);
+static shared_buffer_p shared_buffer_reduced(server_p server, shared_buffer_p cluster);
+static void shared_buffer_grow(shared_buffer_p shared, size_t bytes);
+
+static status_json_p status_json_current(server_p server);
+static status_json_p status_json_build(server_p server, usec_t now);
+static void status_json_ref(status_json_p status_json);
+static void status_json_unref(status_json_p status_json);
+
+static char* metrics_build(server_p server, size_t* size);
+static void  record_latency(histogram_p histogram, usec_t start, usec_t end);
 
 static void urldecode(const char *src, char *dst);
 static void json_escape(const char *src, char* dest, size_t dest_size);
@@ -57,184 +143,154 @@ int client_handlers_init() {
 
 int client_handler(int client_fd, client_p client, server_p server, int flags) {
 	
-	// A small macro used by many states. Allocates a local buffer using alloca() (thats
-	// the reason it's a macro) and copies the client and reveive buffer into it.
-#	define FILL_LOCAL_BUFFER(buffer) \
-		buffer.size = local_buffer_required_size(&buffer, client, client_fd);  \
-		buffer.ptr  = alloca(buffer.size);                                     \
-		if ( local_buffer_recv(&buffer, client, client_fd) == -1 )             \
-			goto free_client_buffer_and_disconnect;
-	
-	// Temporary variables used by several states
-	buffer_t local_buffer = { NULL, 0, 0 };
-	ssize_t  line_length  = 0;
-	
-	// Jump to the current state
+	// Jump to the current state. Clients waiting for a request don't have one, just their
+	// request buffer.
 	if (client->state != NULL)
 		goto *client->state;
+	else if (client->request.ptr != NULL)
+		goto http_request;
 	else
-		goto enter_http_request_headline;
+		goto enter_http_request;
 	
 	
 	
-	// State parses first line of the HTTP request.
+	// State reads the HTTP request line and headers and parses them as they arrive. Keep-alive
+	// clients come back here after their response was sent. client->state is NULL in this
+	// state, see the jump above.
 	// Client state used:
-	//   client->buffer (to store incomplete rest of a line until next packet is received)
+	//   client->request (fixed size buffer with the request data received so far)
+	//   client->http_parser (how far the request has been parsed)
 	
-	enter_http_request_headline:
+	enter_http_request:
+		http_request_next(client);
 		client->flags |= CLIENT_POLL_FOR_READ;
-		client->state = &&http_request_headline;
-		goto return_to_server_to_poll_for_io;
-		
-	http_request_headline:
+		client->flags &= ~CLIENT_POLL_FOR_WRITE;
+		client->state = NULL;
+		// A keep-alive client might have sent its next request along with the previous one
+		if (client->request.filled == 0)
+			goto return_to_server_to_poll_for_io;
+	
+	http_request:
 		if (flags & CLIENT_CON_CLEANUP)
-			goto free_client_buffer_and_disconnect;
-		FILL_LOCAL_BUFFER(local_buffer);
+			goto disconnect;
 		
-		if ( (line_length = first_line_length(&local_buffer)) != -1 ) {
-			char verb[line_length], resource[line_length], version[line_length];
-			
-			int matched_items = sscanf(local_buffer.ptr, " %s %s %s", verb, resource, version);
-			if (matched_items != 3) {
-				// error on reading initial HTTP header line, disconnect client for now
-				warn("[client %d] error while parsing HTTP headline: %.*s", client_fd, (int)line_length, local_buffer.ptr);
-				goto free_client_buffer_and_disconnect;
-			}
-			
-			http_request_handle_headline(client, verb, resource, version);
-			goto leave_http_request_headline;
+		switch ( http_request_read(client, client_fd) ) {
+			case -1: goto disconnect;
+			case  0: goto return_to_server_to_poll_for_io;
 		}
-		
-		// No whole line in buffer, maybe next time we receive the missing data
-		local_buffer_backup_to_client_buffer(&local_buffer, client);
-		goto return_to_server_to_poll_for_io;
-		
-	leave_http_request_headline:
-		client->flags |= CLIENT_POLL_FOR_READ;
-		client->state = &&http_request_headers;
-		goto http_request_headers_buffer_filled;
 	
+	dispatch_request:
+		// Decide what to do with the request
+		goto *http_request_dispatch(client, client_fd, server,
+			&&enter_send_buffer,
+			&&enter_receive_stream,
+			&&enter_send_stream,
+			&&enter_status_info,
+			&&enter_metrics
+		);
 	
 	
-	// State parses all HTTP request headers.
+	// State to send status information as JSON. The body is cached and shared by all
+	// clients (see status_json_current()), only the headers are generated per request.
 	// Client state used:
-	//   client->buffer (to store incomplete rest of a line until next packet is received)
+	//   client->buffer (response headers), client->buffer_to_free (free the headers when sent)
+	//   client->status_json (reference to the cached body), client->status_json_offset (bytes of the body already sent)
+	enter_status_info: {
+		client->status_json = status_json_current(server);
+		client->status_json_offset = 0;
+		
+		// The JSON object only contains streams, so the memory used by all of them is
+		// reported in the header. The Content-Length lets keep-alive clients reuse the
+		// connection for their next request.
+		int headers_size = asprintf(&client->buffer.ptr, ""
+			"%s"
+			"HTTP/1.1 200 OK\r\n"
+			"Server: smeb v1.0.0\r\n"
+			"Content-Type: application/json\r\n"
+			"Access-Control-Allow-Origin: *\r\n"
+			"X-Buffered-Bytes: %zu\r\n"
+			"X-Budget-Bytes: %zu\r\n"
+			"Content-Length: %zu\r\n"
+			"%s"
+			"\r\n",
+			http_pending_last_chunk(client),
+			__atomic_load_n(&stream_bytes_allocated, __ATOMIC_RELAXED), server->global_budget,
+			client->status_json->size, http_connection_header(client)
+		);
+		if (headers_size == -1)
+			goto release_status_json_and_disconnect;
+		
+		client->buffer.size = headers_size;
+		client->buffer_to_free = client->buffer.ptr;
+		
+		client->state = &&send_status_info;
+		client->flags |= CLIENT_POLL_FOR_WRITE;
+		client->flags &= ~CLIENT_POLL_FOR_READ;
+	}
 	
-	http_request_headers:
+	send_status_info:
 		if (flags & CLIENT_CON_CLEANUP)
-			goto free_client_buffer_and_disconnect;
-		FILL_LOCAL_BUFFER(local_buffer);
-		
-	http_request_headers_buffer_filled:
-		while ( (line_length = first_line_length(&local_buffer)) != -1 ) {
-			// See if we got an empty line that signals the end of the HTTP headers (last char is always '\n')
-			if ( line_length == 1 || (line_length == 2 && local_buffer.ptr[0] == '\r') ) {
-				// All headers read, consume the empty line and leave this state
-				local_buffer.ptr  += line_length;
-				local_buffer.size -= line_length;
-				goto leave_http_request_headers;
-			}
-			
-			// normal header line
-			char name[line_length], value[line_length];
-			int matched_items = sscanf(local_buffer.ptr, " %[^: \t\n\r] : %[^\r\n]", name, value);
-			
-			// Only process correct header lines, skip incorrect ones
-			if (matched_items == 2) {
-				http_request_handle_header(client, client_fd, name, value);
+			goto release_status_json_and_disconnect;
+		
+		while (client->buffer.size > 0 || client->status_json_offset < client->status_json->size) {
+			struct iovec iov[2] = {
+				{ client->buffer.ptr, client->buffer.size },
+				{ client->status_json->body + client->status_json_offset, client->status_json->size - client->status_json_offset }
+			};
+			ssize_t bytes_written = writev(client_fd, iov, 2);
+			if (bytes_written >= 0) {
+				size_t header_bytes = ((size_t)bytes_written < client->buffer.size) ? (size_t)bytes_written : client->buffer.size;
+				client->buffer.ptr  += header_bytes;
+				client->buffer.size -= header_bytes;
+				client->status_json_offset += bytes_written - header_bytes;
+			} else {
+				if (errno == EAGAIN) {
+					break;
+				} else {
+					warn("[client %d] write error: %s", client_fd, strerror(errno));
+					goto release_status_json_and_disconnect;
+				}
 			}
-			
-			local_buffer.ptr  += line_length;
-			local_buffer.size -= line_length;
 		}
 		
-		// No more whole lines in buffer left, store the rest for next time
-		local_buffer_backup_to_client_buffer(&local_buffer, client);
-		goto return_to_server_to_poll_for_io;
+		if (client->buffer.size > 0 || client->status_json_offset < client->status_json->size)
+			goto return_to_server_to_poll_for_io;
 		
-	leave_http_request_headers:
-		// First off free the client buffer since it might have been allocated
-		// to store incomplete lines.
-		free(client->buffer.ptr);
-		client->buffer.ptr  = NULL;
-		client->buffer.size = 0;
+		status_json_unref(client->status_json);
+		client->status_json = NULL;
+		free(client->buffer_to_free);
+		client->buffer_to_free = NULL;
 		
-		// Decide what to do with the request
-		goto *http_request_dispatch(client, client_fd, server,
-			&&enter_send_buffer_and_disconnect,
-			&&enter_receive_stream,
-			&&enter_send_stream,
-			&&enter_status_info
-		);
+		if ( !(client->flags & CLIENT_KEEP_ALIVE) )
+			goto disconnect;
+		goto enter_http_request;
 	
 	
-	// State to generate status information as JSON
+	// State to send the counters of all streams in the Prometheus text format
 	// Client state used:
-	//   client->buffer (JSON data to send to the client), client->buffer_to_free (free the JSON buffer when sent)
-	enter_status_info: {
-		// We don't need those
-		free(client->method);
-		client->method = NULL;
-		free(client->resource);
-		client->resource = NULL;
-		
-		FILE* json = open_memstream(&client->buffer.ptr, &client->buffer.size);
-			void add(char* text) { fwrite(text, strlen(text), 1, json); }
-			
-			add("HTTP/1.0 200 OK\r\n"
-				"Server: smeb v1.0.0\r\n"
-				"Content-Type: application/json\r\n"
-				"Access-Control-Allow-Origin: *\r\n"
-				"\r\n");
-			add("{\n");
-			
-			bool first1 = true;
-			for(dict_elem_t e = dict_start(server->streams); e != NULL; e = dict_next(server->streams, e)) {
-				if (first1) {
-					first1 = false;
-				} else {
-					add(",\n");
-				}
-				
-				const char* path = dict_key(e);
-				stream_p stream = dict_value(e, stream_p);
-				
-				char buffer[512], buffer_key[512], buffer_value[512];
-				json_escape(path, buffer_key, sizeof(buffer_key));
-				snprintf(buffer, sizeof(buffer), "\t\"%s\": {\n", buffer_key);
-				add(buffer);
-				
-				// Sum up how many clients are watching this stream
-				uint32_t watch_count = 0;
-				for(hash_elem_t ce = hash_start(server->clients); ce != NULL; ce = hash_next(server->clients, ce)) {
-					client_p iteration_client = hash_value_ptr(ce);
-					if (iteration_client->stream == stream && !(iteration_client->flags & CLIENT_IS_POST_REQUEST))
-						watch_count++;
-				}
-				snprintf(buffer, sizeof(buffer), "\t\t\"viewers\": \"%u\"", watch_count);
-				add(buffer);
-				
-				//bool first2 = true;
-				for(dict_elem_t e = dict_start(stream->params); e != NULL; e = dict_next(stream->params, e)) {
-					//if (first2)
-					//	first2 = false;
-					//else
-						add(",\n");
-					
-					json_escape(dict_key(e), buffer_key, sizeof(buffer_key));
-					json_escape(dict_value(e, char*), buffer_value, sizeof(buffer_value));
-					snprintf(buffer, sizeof(buffer), "\t\t\"%s\": \"%s\"", buffer_key, buffer_value);
-					add(buffer);
-				}
-				
-				add("\n\t}");
-			}
-			
-			add("\n}");
-		fclose(json);
+	//   client->buffer (response to send), client->buffer_to_free (free the response when sent)
+	enter_metrics: {
+		size_t body_size = 0;
+		char* body = metrics_build(server, &body_size);
+		
+		int response_size = asprintf(&client->buffer.ptr, ""
+			"%s"
+			"HTTP/1.1 200 OK\r\n"
+			"Server: smeb v1.0.0\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n"
+			"%s"
+			"\r\n"
+			"%s",
+			http_pending_last_chunk(client), body_size, http_connection_header(client), body
+		);
+		free(body);
+		if (response_size == -1)
+			goto disconnect;
 		
+		client->buffer.size = response_size;
 		client->buffer_to_free = client->buffer.ptr;
-		goto enter_send_buffer_and_disconnect;
+		goto enter_send_buffer;
 	}
 	
 	
@@ -247,17 +303,31 @@ int client_handler(int client_fd, client_p client, server_p server, int flags) {
 		char* path = strndup(client->resource, path_len);
 		char* params = client->resource + path_len;
 		
+		// Look the stream up again while we hold the streams lock. The stream found by
+		// http_request_dispatch() might have been deleted in the meantime.
+		pthread_mutex_lock(server->streams_lock);
+		client->stream = dict_contains(server->streams, path) ? dict_get(server->streams, path, stream_p) : NULL;
+		
 		if (!client->stream) {
-			client->stream = malloc(sizeof(stream_t));
-			memset(client->stream, 0, sizeof(stream_t));
+			size_t stream_size = sizeof(stream_t) + server->worker_count * sizeof(stream_feed_t);
+			client->stream = malloc(stream_size);
+			memset(client->stream, 0, stream_size);
+			pthread_mutex_init(&client->stream->lock, NULL);
+			client->stream->refcount = 1;
 			dict_put(server->streams, path, stream_p, client->stream);
 			
-			client->stream->stream_buffers = list_of(stream_buffer_t);
-			client->stream->intro_stream = open_memstream(&client->stream->intro_buffer.ptr, &client->stream->intro_buffer.size);
+			for(size_t i = 0; i < server->worker_count; i++) {
+				client->stream->feeds[i].first_seq = 1;
+				client->stream->feeds[i].next_seq = 1;
+				client->stream->feeds[i].viewers = array_of(int);
+				client->stream->feeds[i].stalled_viewers = array_of(int);
+			}
+			client->stream->intro_clusters = array_of(shared_buffer_p);
 			client->stream->params = dict_of(char*);
 			
 			if ( fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL, NULL) | O_NONBLOCK) == -1 ) {
-				warn("[client %d] failed to set connection to non-blocking, fcntl: ", client_fd, strerror(errno));
+				warn("[client %d] failed to set connection to non-blocking, fcntl: %s", client_fd, strerror(errno));
+				pthread_mutex_unlock(server->streams_lock);
 				// TODO: free all stream state
 				goto disconnect;
 			}
@@ -272,229 +342,325 @@ int client_handler(int client_fd, client_p client, server_p server, int flags) {
 		
 		client->stream->name = path;
 		
-		// First extract any URL parameters
+		// First extract any URL parameters. Those without a value (e.g. a bare ?low_latency)
+		// are stored with an empty one.
 		{
-			
 			char* p = params;
-			while (*p != '\0') {
-				char* name = p + 1;  // jump over ? or &
-				size_t name_len = strcspn(name, "=&");
-				p = name + name_len;
+			http_slice_t name, value;
+			while ( http_next_param(&p, &name, &value) ) {
+				char* decoded_name = strndup(name.ptr, name.size);
+				urldecode(decoded_name, decoded_name);
+				char* decoded_value = strndup(value.ptr, value.size);
+				urldecode(decoded_value, decoded_value);
 				
-				if (*p == '=') {
-					// Value follows
-					char* value = p + 1;
-					size_t value_len = strcspn(value, "&");
-					p = value + value_len;
-					
-					char* decoded_name = strndup(name, name_len);
-					urldecode(decoded_name, decoded_name);
-					char* decoded_value = strndup(value, value_len);
-					urldecode(decoded_value, decoded_value);
-					
-					dict_put(client->stream->params, decoded_name, char*, decoded_value);
-				} else {
-					// Only name, no value
-					char* decoded_name = strndup(name, name_len);
-					urldecode(decoded_name, decoded_name);
-					
-					dict_put(client->stream->params, decoded_name, char*, NULL);
-				}
+				dict_put(client->stream->params, decoded_name, char*, decoded_value);
 			}
+			
+			// Seconds a viewer can lag behind before it skips ahead
+			char* max_lag = dict_contains(client->stream->params, "max_lag") ? dict_get(client->stream->params, "max_lag", char*) : NULL;
+			double max_lag_sec = (max_lag) ? strtod(max_lag, NULL) : 0;
+			usec_t max_lag_usec = (max_lag_sec > 0) ? max_lag_sec * 1000000 : STREAM_DEFAULT_MAX_LAG;
+			__atomic_store_n(&client->stream->max_lag, max_lag_usec, __ATOMIC_RELAXED);
+			
+			// Forward blocks as they arrive instead of whole clusters. A bare ?low_latency (empty
+			// value) turns it on as well.
+			char* low_latency = dict_contains(client->stream->params, "low_latency") ? dict_get(client->stream->params, "low_latency", char*) : "0";
+			client->stream->low_latency = (strcmp(low_latency, "0") != 0);
+			if (client->stream->low_latency)
+				info("[stream %s] low latency mode, forwarding blocks as they arrive", path);
 		}
 		
+		// The stream is new or got new params, the status JSON has to show them
+		streams_version++;
+		pthread_mutex_unlock(server->streams_lock);
+		
 		client->state = &&receive_stream_header;
 		client->flags |= CLIENT_POLL_FOR_READ;
 		
-		client->buffer.size = 64 * 1024;
-		if (local_buffer.size > client->buffer.size)
-			client->buffer.size = local_buffer.size;
-		client->buffer.filled = 0;
+		// Take over the data that followed the request headers. The request buffer is
+		// smaller than the client buffer so it always fits.
+		size_t body_size = client->request.filled - client->http_parser.pos;
+		client->buffer.size = STREAMER_BUFFER_SIZE;
+		client->buffer.filled = body_size;
 		client->buffer.ptr = malloc(client->buffer.size);
+		memcpy(client->buffer.ptr, client->request.ptr + client->http_parser.pos, body_size);
+		ebml_parser_init(&client->parser);
+		http_request_free(client);
 		
-		// Process any data left in the local buffer, otherwise let the server poll for more
-		if (local_buffer.size > 0) {
-			memcpy(client->buffer.ptr, local_buffer.ptr, local_buffer.size);
-			client->buffer.filled = local_buffer.size;
+		// Process any data we already received, otherwise let the server poll for more
+		if (client->buffer.filled > 0) {
 			goto receive_stream_header_buffer_filled;
 		} else {
 			goto return_to_server_to_poll_for_io;
 		}
 	}
-		
+	
 	receive_stream_header:
 		if (flags & CLIENT_CON_CLEANUP)
 			goto leave_receive_stream;
 		
-		// Read incomming data into client buffer
-		ssize_t bytes_read = read(client_fd, client->buffer.ptr + client->buffer.filled, client->buffer.size - client->buffer.filled);
-		debug("[client %d] header: reading %zd bytes, %zu bytes left in buffer", client_fd, bytes_read, client->buffer.size - client->buffer.filled);
-		if (bytes_read < 1) {
-			if (bytes_read == -1)
-				perror("read");
-			else if (bytes_read == 0)
-				debug("[client %d] header: read returned 0", client_fd);
+		// Read incomming data into client buffer. The server polls edge-triggered so read
+		// until the socket is empty, otherwise we won't get notified about the rest.
+		while(true) {
+			if (client->buffer.filled == client->buffer.size) {
+				client->buffer.size *= 2;
+				client->buffer.ptr = realloc(client->buffer.ptr, client->buffer.size);
+				debug("[client %d] header: increased client buffer to %zu bytes", client_fd, client->buffer.size);
+			}
 			
-			goto leave_receive_stream;
+			ssize_t bytes_read = read(client_fd, client->buffer.ptr + client->buffer.filled, client->buffer.size - client->buffer.filled);
+			if (bytes_read > 0) {
+				client->buffer.filled += bytes_read;
+				debug("[client %d] header: reading %zd bytes, %zu bytes left in buffer", client_fd, bytes_read, client->buffer.size - client->buffer.filled);
+			} else if (bytes_read == -1 && errno == EWOULDBLOCK) {
+				break;
+			} else {
+				if (bytes_read == -1)
+					perror("read");
+				else if (bytes_read == 0)
+					debug("[client %d] header: read returned 0", client_fd);
+				
+				goto leave_receive_stream;
+			}
 		}
 		
-		client->buffer.filled += bytes_read;
 		goto receive_stream_header_buffer_filled;
-		
+	
 	receive_stream_header_buffer_filled: {
-		ssize_t header_size;
-		if ( (header_size = streamer_try_to_extract_mkv_header(client->buffer.ptr, client->buffer.filled)) > 0 ) {
-			debug("[stream %s] got complete MKV header (%zd bytes)", client->stream->name, header_size);
-			
-			// Got the complete header in the buffer, calculate size for HTTP chunked encoding encapsulation
-			size_t http_encapsulated_size = streamer_calculate_http_encapsulated_size(header_size);
+		// Parse the elements until the tracks element is complete. Everything up to it is
+		// the header viewers need before any cluster.
+		ebml_event_t event;
+		do {
+			event = ebml_parser_next(&client->parser, client->buffer.ptr, client->buffer.filled);
+			if (event.type == EBML_NEED_MORE_DATA) {
+				// Header not yet complete, need more data
+				goto return_to_server_to_poll_for_io;
+			}
 			
-			// Store the header and add HTTP chunked encapsulation around it
+			if (event.type == EBML_ELEMENT_BEGIN && event.id == MKV_Segment) {
+				debug("  <Segment 0x%08lX bytes>, patching to unknown size, entering", event.data_size);
+				// Add a leading 0 bit for each addidional size byte, then convert to big endian so
+				// we can directly copy it over the old size.
+				size_t size_bytes = event.header_size - (4 - __builtin_clz(event.id) / 8);
+				uint64_t unknown_size = __builtin_bswap64(0xffffffffffffffff >> (size_bytes - 1));
+				memcpy(client->buffer.ptr + event.offset + event.header_size - size_bytes, &unknown_size, size_bytes);
+				ebml_parser_enter(&client->parser);
+			} else if (event.type == EBML_ELEMENT_COMPLETE) {
+				debug("  <0x%08X %zu bytes>", event.id, event.data_size);
+			}
+		} while ( !(event.type == EBML_ELEMENT_COMPLETE && event.id == MKV_Tracks) );
+		
+		size_t header_size = client->parser.pos;
+		debug("[stream %s] got complete MKV header (%zu bytes)", client->stream->name, header_size);
+		
+		// Got the complete header in the buffer, store it with HTTP chunked encoding encapsulation
+		size_t http_encapsulated_size = streamer_calculate_http_encapsulated_size(header_size);
+		char* header_ptr = malloc(http_encapsulated_size);
+		streamer_http_encapsulate(header_ptr, client->buffer.ptr, header_size);
+		
+		// Viewers joining on other workers read the header, so swap it while holding the lock.
+		// Viewers only use the header via the join bundle, so nobody uses the old one any more.
+		// The bundle is rebuilt with the new header when the next viewer joins.
+		pthread_mutex_lock(&client->stream->lock);
+			free(client->stream->header.ptr);
 			client->stream->header.size = http_encapsulated_size;
-			client->stream->header.ptr = malloc(http_encapsulated_size);
-			
-			int enc_bytes = snprintf(client->stream->header.ptr, http_encapsulated_size, "%zx\r\n", header_size);
-			//debug("enc_bytes: %d, payload: %zu, http enc: %zu, diff: %zu\n",
-			//	enc_bytes, header_size, http_encapsulated_size, http_encapsulated_size - header_size);
-			//memset(client->stream->header.ptr + enc_bytes, 0, header_size);
-			memcpy(client->stream->header.ptr + enc_bytes, client->buffer.ptr, header_size);
-			client->stream->header.ptr[enc_bytes + header_size + 0] = '\r';
-			client->stream->header.ptr[enc_bytes + header_size + 1] = '\n';
-			
-			// Remove the header from the buffer
-			memmove(client->buffer.ptr, client->buffer.ptr + header_size, client->buffer.filled - header_size);
-			client->buffer.filled -= header_size;
-			
-			client->state = &&receive_stream;
-			client->flags |= CLIENT_POLL_FOR_READ;
-			
-			if (client->buffer.filled > 0)
-				goto receive_stream_buffer_filled;
-			else
-				goto return_to_server_to_poll_for_io;
-		} else {
-			// Header not yet complete, need more data
+			client->stream->header.ptr = header_ptr;
+			stream_release_join_bundle(server, client->stream);
+		pthread_mutex_unlock(&client->stream->lock);
+		
+		// Remove the header from the buffer
+		memmove(client->buffer.ptr, client->buffer.ptr + header_size, client->buffer.filled - header_size);
+		client->buffer.filled -= header_size;
+		ebml_parser_consume(&client->parser, header_size);
+		
+		client->state = &&receive_stream;
+		client->flags |= CLIENT_POLL_FOR_READ;
+		
+		if (client->buffer.filled > 0)
+			goto receive_stream_buffer_filled;
+		else
 			goto return_to_server_to_poll_for_io;
-		}
 	}
-		
+	
 	receive_stream: {
 		if (flags & CLIENT_CON_CLEANUP)
 			goto leave_receive_stream;
 		
-		// Read incomming data into client buffer
-		ssize_t bytes_read = 0;
+		// Read until the socket is empty. The data of a cluster is read directly into its
+		// chunk buffer once we know its size. Everything else (e.g. the start of the next
+		// cluster) is read into the client buffer in small pieces and parsed there.
 		while(true) {
-			// First increase buffer space if the buffer is full
-			if (client->buffer.filled == client->buffer.size) {
-				client->buffer.size *= 2;
-				client->buffer.ptr = realloc(client->buffer.ptr, client->buffer.size);
-				debug("[client %d] increased client buffer to %zu bytes", client_fd, client->buffer.size);
+			// Stop reading while the stream is over its budget. The server continues with this
+			// state when the viewers caught up (see stream_resume_source()).
+			if ( server->budget_policy == BUDGET_POLICY_PAUSE_SOURCE && stream_pause_source(server, client->stream, client_fd, client) )
+				goto return_to_server_to_poll_for_io;
+			
+			char*  read_ptr = NULL;
+			size_t read_size = 0;
+			if (client->cluster.ptr) {
+				read_ptr = client->cluster.ptr + client->cluster.filled;
+				read_size = client->cluster.size - client->cluster.filled;
+			} else {
+				// Increase buffer space if an element doesn't fit, e.g. large tags
+				if (client->buffer.filled == client->buffer.size) {
+					client->buffer.size *= 2;
+					client->buffer.ptr = realloc(client->buffer.ptr, client->buffer.size);
+					debug("[client %d] increased client buffer to %zu bytes", client_fd, client->buffer.size);
+				}
+				read_ptr = client->buffer.ptr + client->buffer.filled;
+				read_size = client->buffer.size - client->buffer.filled;
+				if (read_size > STREAMER_READ_SIZE)
+					read_size = STREAMER_READ_SIZE;
 			}
 			
-			bytes_read = read(client_fd, client->buffer.ptr + client->buffer.filled, client->buffer.size - client->buffer.filled);
-			if (bytes_read > 0) {
-				client->buffer.filled += bytes_read;
-				debug("[client %d] reading %zd cluster bytes, %zu bytes left in buffer", client_fd, bytes_read, client->buffer.size - client->buffer.filled);
-			} else if (bytes_read == -1 && errno == EWOULDBLOCK) {
+			ssize_t bytes_read = read(client_fd, read_ptr, read_size);
+			if (bytes_read == -1 && errno == EWOULDBLOCK) {
 				// No more data in this sockets receive buffer
-				break;
+				goto return_to_server_to_poll_for_io;
 			} else if (bytes_read == 0) {
 				debug("[client %d] read returned 0, disconnecting", client_fd);
 				goto leave_receive_stream;
-			} else {
+			} else if (bytes_read == -1) {
 				debug("[client %d] read error: %s", client_fd, strerror(errno));
 				goto leave_receive_stream;
 			}
-		}
-		/*
-		ssize_t bytes_read = read(client_fd, client->buffer.ptr + client->buffer.filled, client->buffer.size - client->buffer.filled);
-		fprintf(stderr, "[client %d]: reading %zd cluster bytes, %zu bytes left in buffer\n", client_fd, bytes_read, client->buffer.size - client->buffer.filled);
-		if (bytes_read < 1) {
-			if (bytes_read == -1)
-				perror("read");
-			else if (bytes_read == 0)
-				fprintf(stderr, "[client %d]: read returned 0, disconnecting\n", client_fd);
 			
-			goto leave_receive_stream;
+			if (client->cluster.ptr) {
+				client->cluster.filled += bytes_read;
+				if (client->cluster.filled == client->cluster.size) {
+					streamer_publish_cluster(client->cluster.ptr, client->cluster.size + 2, client->stream, server);
+					client->cluster = (buffer_t){ NULL, 0, 0 };
+				}
+			} else {
+				client->buffer.filled += bytes_read;
+				goto receive_stream_buffer_filled;
+			}
 		}
-		
-		client->buffer.filled += bytes_read;
-		*/
-		goto receive_stream_buffer_filled;
 	}
-		
+	
 	receive_stream_buffer_filled: {
-		// Look for any complete cluster elements and put each one into one buffer
-		ssize_t cluster_size;
-		while ( (cluster_size = streamer_try_to_extract_mkv_cluster(client->buffer.ptr, client->buffer.filled)) != -1 ) {
-			
-			char*  patched_buffer_ptr = NULL;
-			size_t patched_buffer_size = 0;
-			streamer_inspect_cluster(client->buffer.ptr, cluster_size, client->stream, &patched_buffer_ptr, &patched_buffer_size, server);
-			debug("[stream %s] received new cluster (%zd bytes)", client->stream->name, cluster_size);
-			
-			stream_buffer_p stream_buffer = list_append_ptr(client->stream->stream_buffers);
-			stream_buffer_new_http_encapsulated(stream_buffer, patched_buffer_ptr, patched_buffer_size, 0);
-			
-			client->stream->latest_cluster_received_at = time_now();
-			
-			// Free the patched buffer
-			free(patched_buffer_ptr);
-			
-			// Remove the cluster from the client buffer
-			memmove(client->buffer.ptr, client->buffer.ptr + cluster_size, client->buffer.filled - cluster_size);
-			client->buffer.filled -= cluster_size;
-			
-			// Update all clients of this stream that already ran out of data
-			for(hash_elem_t e = hash_start(server->clients); e != NULL; e = hash_next(server->clients, e)) {
-				client_p iteration_client = hash_value_ptr(e);
-				if (iteration_client->stream == client->stream && iteration_client != client) {
-					// Make sure the buffer is referenced by all clients watching this stream (and not by our self again)
-					stream_buffer_ref(stream_buffer);
-					
-					if (iteration_client->insert_next_received_cluster_buffer) {
-						*iteration_client->insert_next_received_cluster_buffer = client->stream->stream_buffers->last;
-						iteration_client->insert_next_received_cluster_buffer = NULL;
+		// Look for any cluster elements. The parser continues where it stopped the last time,
+		// so we don't look at any data twice.
+		ebml_event_t event;
+		while ( (event = ebml_parser_next(&client->parser, client->buffer.ptr, client->buffer.filled)).type != EBML_NEED_MORE_DATA ) {
+			// In low latency mode enter each cluster and forward its blocks as soon as they're
+			// complete. They're appended to a fragment cluster the viewers send as it grows.
+			// Everything else in the segment isn't needed.
+			if (client->stream->low_latency) {
+				if (event.type == EBML_ELEMENT_BEGIN) {
+					if (event.id == MKV_Cluster && client->parser.depth == 1) {
+						streamer_close_fragment(client, server);
+						client->cluster_timecode = 0;
+						ebml_parser_enter(&client->parser);
+					} else if (event.data_size != EBML_UNKNOWN_SIZE && event.data_size > STREAMER_MAX_CLUSTER_SIZE) {
+						warn("[stream %s] element with %lu bytes is to large, disconnecting source", client->stream->name, event.data_size);
+						goto leave_receive_stream;
 					}
 					
-					if (iteration_client->flags & CLIENT_STALLED) {
-						iteration_client->current_stream_buffer = client->stream->stream_buffers->last;
-						iteration_client->buffer.ptr = stream_buffer->ptr;
-						iteration_client->buffer.size = stream_buffer->size;
-						iteration_client->flags |= CLIENT_POLL_FOR_WRITE;
-						iteration_client->flags &= ~CLIENT_STALLED;
-						debug("[stream %s] unstalled client %d", client->stream->name, (int)hash_key(e));
+					// Wait until the element is complete before removing anything from the buffer
+					if (client->parser.element_pending)
+						continue;
+				} else if (event.type == EBML_ELEMENT_COMPLETE && client->parser.depth == 2) {
+					if (event.id == MKV_Timecode) {
+						client->cluster_timecode = ebml_read_uint(client->buffer.ptr + event.offset + event.header_size, event.data_size);
+					} else if (event.id == MKV_SimpleBlock || event.id == MKV_BlockGroup) {
+						streamer_append_block(client, client->buffer.ptr + event.offset, event.header_size + event.data_size, server);
 					}
 				}
+				
+				size_t parsed_size = client->parser.pos;
+				streamer_buffer_remove(&client->buffer, parsed_size);
+				ebml_parser_consume(&client->parser, parsed_size);
+				continue;
+			}
+			
+			// Only look at elements directly in the segment, e.g. not at the blocks of an entered
+			// cluster with unknown size. Such a cluster is collected in the client buffer until
+			// the next one begins, so don't let it grow without bound.
+			if (client->parser.depth > 1) {
+				if (client->parser.pos - client->parser.stack[1].offset > STREAMER_MAX_CLUSTER_SIZE) {
+					warn("[stream %s] cluster of unknown size grew beyond %d bytes, disconnecting source", client->stream->name, STREAMER_MAX_CLUSTER_SIZE);
+					goto leave_receive_stream;
+				}
+				continue;
 			}
 			
-			// We're no longer interested in the buffer, only the clients need it now, so unref it
-			if ( stream_buffer_unref(stream_buffer) == true )
-				list_remove_last(client->stream->stream_buffers);
+			if (event.type == EBML_ELEMENT_BEGIN && event.id == MKV_Cluster && event.data_size != EBML_UNKNOWN_SIZE) {
+				size_t cluster_size = event.header_size + event.data_size;
+				if (cluster_size > STREAMER_MAX_CLUSTER_SIZE) {
+					warn("[stream %s] cluster with %zu bytes is to large, disconnecting source", client->stream->name, cluster_size);
+					goto leave_receive_stream;
+				}
+				
+				// Take the cluster out of the client buffer and put it into its own chunk buffer.
+				// The rest of it is read directly into the chunk buffer, so we tell the parser it's
+				// done with all of it.
+				size_t buffered_size = client->buffer.filled - event.offset;
+				if (buffered_size > cluster_size)
+					buffered_size = cluster_size;
+				client->cluster.ptr = streamer_new_cluster_chunk(client->buffer.ptr + event.offset, buffered_size, cluster_size);
+				client->cluster.filled = HTTP_CHUNK_HEADROOM + buffered_size;
+				client->cluster.size = HTTP_CHUNK_HEADROOM + cluster_size;
+				
+				ebml_parser_skip(&client->parser);
+				streamer_buffer_remove(&client->buffer, event.offset + buffered_size);
+				ebml_parser_consume(&client->parser, event.offset + cluster_size);
+				
+				if (client->cluster.filled == client->cluster.size) {
+					streamer_publish_cluster(client->cluster.ptr, client->cluster.size + 2, client->stream, server);
+					client->cluster = (buffer_t){ NULL, 0, 0 };
+				} else {
+					// Read the rest of the cluster
+					goto receive_stream;
+				}
+			} else if (event.type == EBML_ELEMENT_COMPLETE) {
+				// A cluster of unknown size (completed by the next one) or some other element
+				if (event.id == MKV_Cluster) {
+					size_t cluster_size = event.header_size + event.data_size;
+					char* chunk_ptr = streamer_new_cluster_chunk(client->buffer.ptr + event.offset, cluster_size, cluster_size);
+					streamer_publish_cluster(chunk_ptr, HTTP_CHUNK_HEADROOM + cluster_size + 2, client->stream, server);
+				} else {
+					debug("[stream %s] skipped <0x%08X %zu bytes>", client->stream->name, event.id, event.data_size);
+				}
+				
+				size_t parsed_size = client->parser.pos;
+				streamer_buffer_remove(&client->buffer, parsed_size);
+				ebml_parser_consume(&client->parser, parsed_size);
+			}
 		}
 		
-		// No more complete cluster elments, wait for more data
-		goto return_to_server_to_poll_for_io;
+		// No more complete elements, read more data
+		goto receive_stream;
 	}
 	
 	
 	leave_receive_stream:
+		// The end of the stream also ends a cluster of unknown size
+		if (client->buffer.ptr)
+			streamer_publish_open_cluster(client, server);
+		streamer_close_fragment(client, server);
+		
 		if (flags & CLIENT_CON_CLEANUP) {
 			// Update the prev source offset so we properly patch the cluster timecodes
 			// as soon as the source reconnects and sends us new clusters.
-			client->stream->prev_sources_offset += client->stream->last_observed_timecode;
+			pthread_mutex_lock(&client->stream->lock);
+				client->stream->prev_sources_offset += client->stream->last_observed_timecode;
+			pthread_mutex_unlock(&client->stream->lock);
 			debug("[stream %s] source died, last observed timecode: %lu, new stream timecode offset: %lu",
 				client->stream->name, client->stream->last_observed_timecode, client->stream->prev_sources_offset);
 			
 			// Remember when the last data arrived so we know how old the stream is
-			client->stream->last_disconnect_at = time_now();
+			pthread_mutex_lock(server->streams_lock);
+				client->stream->last_disconnect_at = time_now();
+			pthread_mutex_unlock(server->streams_lock);
 			
 			// Free malloced stuff
-			free(client->method);
-			client->method = NULL;
-			free(client->resource);
-			client->resource = NULL;
+			pool_free(client->cluster.ptr);
+			client->cluster = (buffer_t){ NULL, 0, 0 };
+			
+			// A new source shouldn't wait for clusters of this one to be freed
+			if (client->flags & CLIENT_SOURCE_PAUSED)
+				__atomic_store_n(&client->stream->source_paused, 0, __ATOMIC_RELEASE);
 		}
 		goto free_client_buffer_and_disconnect;
 	
@@ -507,63 +673,80 @@ int client_handler(int client_fd, client_p client, server_p server, int flags) {
 	enter_send_stream: {
 		client->state = &&send_stream;
 		client->flags |= CLIENT_POLL_FOR_WRITE;
-		client->flags &= ~CLIENT_POLL_FOR_READ;
 		
+		// Keep-alive viewers can switch to another stream by requesting it on the same
+		// connection, so we keep polling them. All others don't need the request any more.
+		if (client->flags & CLIENT_KEEP_ALIVE) {
+			http_request_next(client);
+			client->flags |= CLIENT_POLL_FOR_READ;
+		} else {
+			http_request_free(client);
+			client->flags &= ~CLIENT_POLL_FOR_READ;
+		}
 		
-		// Create new stream buffer nodes for the initial stuff the clients needs
-		// to receive. This is:
-		// - The HTTP response header
-		// - The WebM video header
-		// - The "intro" cluster with blocks from all tracks, starting with the
-		//   last known keyframe
-		// After the client has received these stream buffers we let him stall
-		// (next == NULL) so he picks up the next incomming stream buffer.
-		list_node_p http_header_node = list_new_node(client->stream->stream_buffers);
-		list_node_p video_header_node = list_new_node(client->stream->stream_buffers);
-		list_node_p intro_cluster_node = list_new_node(client->stream->stream_buffers);
-		
-		// Wire the stream buffers up into a neat list
-		http_header_node->prev   = NULL;
-		http_header_node->next   = video_header_node;
-		video_header_node->prev  = http_header_node;
-		video_header_node->next  = intro_cluster_node;
-		intro_cluster_node->prev = video_header_node;
-		intro_cluster_node->next = NULL;
-		
-		// Make sure we get a pointer to the next cluster buffer when one
-		// arives before we're stalled.
-		client->insert_next_received_cluster_buffer = &intro_cluster_node->next;
-		
-		stream_buffer_p http_header_buffer = list_value_ptr(http_header_node);
-		char* http_response_header_text = ""
-			"HTTP/1.1 200 OK\r\n"
-			"Server: smeb v1.0.0\r\n"
-			"Transfer-Encoding: chunked\r\n"
-			"Connection: close\r\n"
-			"Cache-Control: no-cache\r\n"
-			"Content-Type: video/webm\r\n"
-			"\r\n";
-		stream_buffer_new(http_header_buffer, http_response_header_text, strlen(http_response_header_text), STREAM_BUFFER_DONT_FREE_CONTENT | STREAM_BUFFER_CLIENT_PRIVATE);
-		
-		stream_buffer_p video_header_buffer = list_value_ptr(video_header_node);
-		stream_buffer_new(video_header_buffer, client->stream->header.ptr, client->stream->header.size, STREAM_BUFFER_DONT_FREE_CONTENT | STREAM_BUFFER_CLIENT_PRIVATE);		
-		
-		stream_buffer_p intro_cluster_buffer = list_value_ptr(intro_cluster_node);
-		stream_buffer_new_http_encapsulated(intro_cluster_buffer, client->stream->intro_buffer.ptr, client->stream->intro_buffer.size, STREAM_BUFFER_CLIENT_PRIVATE);
-		
-		client->current_stream_buffer = http_header_node;
-		client->buffer.ptr  = http_header_buffer->ptr;
-		client->buffer.size = http_header_buffer->size;
-	}
+		// The initial stuff the clients needs to receive is:
+		// - The join bundle of the stream: The HTTP response header and the WebM video header
+		//   in one buffer shared by all viewers joining until the next keyframe.
+		// - The "intro", the clusters since the last keyframe. They're sent straight from
+		//   the shared cluster buffers (see stream_viewer_start_intro()).
+		// All of it usually goes out with one writev(). After that the client continues with
+		// the clusters in the stream buffer ring, starting with the first one not part of
+		// the intro.
+		client->joined_at = time_now();
+		stream_viewer_start_intro(server, client, true);
+		stream_add_viewer(server, client->stream, client_fd, client);
 		
+		// A viewer that watched another stream on this connection ends that response with
+		// the last chunk in front of the join bundle
+		if (client->flags & CLIENT_LAST_CHUNK_PENDING) {
+			client->flags &= ~CLIENT_LAST_CHUNK_PENDING;
+			client->buffer.ptr  -= strlen(STREAM_LAST_CHUNK);
+			client->buffer.size += strlen(STREAM_LAST_CHUNK);
+		}
+	}
+	
 	send_stream:
 		if (flags & CLIENT_CON_CLEANUP)
 			goto leave_send_stream;
 		
+		// A request of a keep-alive viewer, usually for another stream (channel zapping). It's
+		// handled after the cluster we're currently sending, stalled viewers are already
+		// between two clusters and handle it right away. Until then we don't read the next
+		// request. Other viewers don't have a request buffer and ignore what they get.
+		if ( (flags & CLIENT_CON_READABLE) && client->request.ptr != NULL ) {
+			if ( !(client->flags & CLIENT_SWITCH_PENDING) ) {
+				int result = http_request_read(client, client_fd);
+				if (result == -1)
+					goto leave_send_stream;
+				else if (result == 1)
+					client->flags |= CLIENT_SWITCH_PENDING;
+			}
+			
+			if ( (client->flags & CLIENT_SWITCH_PENDING) && (client->flags & CLIENT_STALLED) )
+				goto leave_stream_for_next_request;
+			goto return_to_server_to_poll_for_io;
+		}
+		
+		// Viewers far behind might have lots of data to send. Only write CLIENT_WRITE_BUDGET
+		// bytes at once so sources and other viewers don't have to wait for them.
+		size_t bytes_written_in_total = 0;
 		while(true) {
-			// Write this buffer as far as possible
+			stream_feed_p feed = &client->stream->feeds[server->worker_index];
+			
+			// Write this buffer as far as possible. While sending the intro the intro clusters
+			// after it are written with the same writev(). The ring might have released the
+			// cluster we're sending in the meantime, client->cursor_buffer keeps it around.
 			while(client->buffer.size > 0) {
-				ssize_t bytes_written = write(client_fd, client->buffer.ptr, client->buffer.size);
+				if (bytes_written_in_total >= CLIENT_WRITE_BUDGET) {
+					client->flags |= CLIENT_WRITE_YIELDED;
+					array_append(server->yielded_clients, int, client_fd);
+					debug("[client %d] used up write budget, yielding", client_fd);
+					goto return_to_server_to_poll_for_io;
+				}
+				
+				struct iovec iov[STREAM_VIEWER_MAX_IOVECS];
+				size_t iov_count = stream_viewer_iovecs(client, iov, STREAM_VIEWER_MAX_IOVECS);
+				ssize_t bytes_written = writev(client_fd, iov, iov_count);
 				if (bytes_written == -1) {
 					if (errno == EAGAIN) {
 						goto return_to_server_to_poll_for_io;
@@ -573,84 +756,110 @@ int client_handler(int client_fd, client_p client, server_p server, int flags) {
 					}
 				}
 				
-				client->buffer.ptr += bytes_written;
-				client->buffer.size -= bytes_written;
+				stream_viewer_advance(server, client, bytes_written);
+				bytes_written_in_total += bytes_written;
 			}
 			
 			// We finished writing this buffer (otherwise we would've returned on an EAGAIN).
-			// Unref the finished buffer and free the list node of it when the unref freed the buffer.
-			debug("[client %d] finished buffer %p, next %p", client_fd,
-				list_value_ptr(client->current_stream_buffer), list_value_ptr(client->current_stream_buffer->next));
-			list_node_p next_stream_buffer_node = client->current_stream_buffer->next;
+			// Either it was the join bundle, an intro cluster or the cluster at our cursor.
+			stream_viewer_finish_buffer(server, client);
 			
-			stream_buffer_p finished_stream_buffer = list_value_ptr(client->current_stream_buffer);
-			if ( stream_buffer_unref(finished_stream_buffer) == true ) {
-				if (finished_stream_buffer->flags & STREAM_BUFFER_CLIENT_PRIVATE)
-					free(client->current_stream_buffer);
-				else
-					list_remove(client->stream->stream_buffers, client->current_stream_buffer);
-			}
+			if ( (client->flags & CLIENT_SWITCH_PENDING) && stream_viewer_at_chunk_boundary(client) )
+				goto leave_stream_for_next_request;
 			
-			if (next_stream_buffer_node) {
-				stream_buffer_p next_stream_buffer = list_value_ptr(next_stream_buffer_node);
-				//debug("btc: %ld, lctc: %ld\n", next_stream_buffer->timecode, client->stream->latest_cluster_received_at);
-				
-				if (next_stream_buffer->timecode + 30 * 1000000LL < client->stream->latest_cluster_received_at) {
-					info("[client %d] client to far behind, disconnecting", client_fd);
-					client->current_stream_buffer = next_stream_buffer_node;
-					goto disconnect;
-					/*
-					// Client is to far behind, try to bring him up to date again by throwing all
-					// the buffers away and continuing with a new intro cluster.
-					
-					for(list_node_p n = next_stream_buffer_node; n != NULL; n = n->next) {
-						stream_buffer_p stream_buffer = list_value_ptr(n);
-						if ( stream_buffer_unref(stream_buffer) == true ) {
-							if (stream_buffer->flags & STREAM_BUFFER_CLIENT_PRIVATE)
-								free(n);
-							else
-								list_remove(client->stream->stream_buffers, n);
-						}
-					}
-					
-					list_node_p intro_cluster_node = list_new_node(client->stream->stream_buffers);
-					stream_buffer_p intro_cluster_buffer = list_value_ptr(intro_cluster_node);
-					stream_buffer_new_http_encapsulated(intro_cluster_buffer, client->stream->intro_buffer.ptr, client->stream->intro_buffer.size, STREAM_BUFFER_CLIENT_PRIVATE);
-					
-					next_stream_buffer_node = intro_cluster_node;
-					*/
+			// The intro clusters come before the ones in the ring
+			if ( stream_viewer_next_intro_buffer(server, client) )
+				continue;
+			debug("[client %d] finished buffer, next cluster %lu, %lu clusters behind", client_fd,
+				client->cursor, feed->next_seq - client->cursor);
+			
+			// Viewers that fall behind skip ahead instead of being disconnected. Either to the
+			// newest cluster that starts with a keyframe or to a fresh intro cluster. The output
+			// stays a valid WebM stream, it just jumps forward in time. If the ring wrapped
+			// around us and there is neither we continue with the oldest cluster left. The
+			// picture might be broken until the next keyframe but the viewer stays.
+			usec_t max_lag = __atomic_load_n(&client->stream->max_lag, __ATOMIC_RELAXED);
+			bool reclaimed = client->cursor < feed->first_seq;
+			if ( reclaimed || (client->cursor < feed->next_seq && stream_feed_buffer(feed, client->cursor)->timecode + max_lag < feed->latest_cluster_received_at) ) {
+				if (feed->keyframe_seq > client->cursor && feed->keyframe_seq >= feed->first_seq) {
+					info("[client %d] lagging behind, skipping %lu clusters to the newest keyframe", client_fd, feed->keyframe_seq - client->cursor);
+					client->cursor = feed->keyframe_seq;
+					client->cursor_offset = 0;
+					metric_add(&feed->viewer_lag_skips, 1);
+				} else if ( stream_viewer_start_intro(server, client, false) ) {
+					info("[client %d] lagging behind, skipping to the intro", client_fd);
+					metric_add(&feed->viewer_lag_skips, 1);
+					continue;
+				} else if (reclaimed) {
+					info("[client %d] lagging behind, skipping %lu clusters to the oldest one left", client_fd, feed->first_seq - client->cursor);
+					client->cursor = feed->first_seq;
+					client->cursor_offset = 0;
+					metric_add(&feed->viewer_lag_skips, 1);
 				}
 			}
 			
-			// Wire up the next buffer or stall
-			client->current_stream_buffer = next_stream_buffer_node;
-			if (client->current_stream_buffer) {
-				stream_buffer_p stream_buffer = list_value_ptr(client->current_stream_buffer);
-				client->buffer.ptr  = stream_buffer->ptr;
-				client->buffer.size = stream_buffer->size;
-			} else {
-				client->flags |= CLIENT_STALLED;
+			// Stall when we've send all clusters (or all blocks of a fragment cluster the source
+			// still appends to), we continue when more arrive
+			if ( stream_viewer_caught_up(feed, client) ) {
+				stream_add_stalled_viewer(server, client->stream, client_fd, client);
 				client->flags &= ~CLIENT_POLL_FOR_WRITE;
-				client->insert_next_received_cluster_buffer = NULL;
 				debug("[client %d] stalled", client_fd);
+				// Free the clusters right away if we were the last one sending them. A paused
+				// source might wait for that.
+				stream_feed_release_unneeded(server, feed);
 				goto return_to_server_to_poll_for_io;
 			}
-		}
-		
-	leave_send_stream:
-		// Unref all buffers that this client would have received
-		for(list_node_p node = client->current_stream_buffer, next = NULL; node != NULL; node = next) {
-			next = node->next;
 			
-			stream_buffer_p stream_buffer = list_value_ptr(node);
-			if ( stream_buffer_unref(stream_buffer) == true ) {
-				if (stream_buffer->flags & STREAM_BUFFER_CLIENT_PRIVATE)
-					free(node);
-				else
-					list_remove(client->stream->stream_buffers, node);
+			stream_buffer_p stream_buffer = stream_feed_buffer(feed, client->cursor);
+			
+			// Viewers with a long send queue get the cluster without its discardable video
+			// frames. They keep the audio and a lower frame rate instead of stalling.
+			shared_buffer_p cluster = stream_buffer->shared;
+			if (stream_buffer->timecode + max_lag / 2 < feed->latest_cluster_received_at)
+				cluster = shared_buffer_reduced(server, cluster);
+			
+			if (cluster == stream_buffer->shared) {
+				client->buffer.ptr  = stream_buffer->ptr + client->cursor_offset;
+				client->buffer.size = stream_buffer->size - client->cursor_offset;
+			} else {
+				client->buffer.ptr  = cluster->ptr;
+				client->buffer.size = cluster->size;
 			}
+			client->cursor_offset = stream_buffer->size;
+			stream_viewer_hold_cluster(server, client, stream_buffer->shared);
+			stream_viewer_record_join(feed, client);
+		}
+	
+	// A keep-alive viewer sent its next request, so it leaves its stream. The request is
+	// handled like any other one, the response just starts with the last chunk of the
+	// stream response (see http_pending_last_chunk()). Sources need a connection of their
+	// own.
+	leave_stream_for_next_request:
+		info("[client %d] leaving stream %s for %s %s", client_fd, client->stream->name, client->method, client->resource);
+		client->flags &= ~CLIENT_SWITCH_PENDING;
+		stream_viewer_leave(server, client);
+		client->state = NULL;
+		
+		if (client->flags & CLIENT_IS_POST_REQUEST) {
+			info("[client %d] can't send a stream over the connection of a viewer, disconnecting", client_fd);
+			goto disconnect;
 		}
 		
+		client->flags |= CLIENT_LAST_CHUNK_PENDING;
+		goto dispatch_request;
+	
+	leave_send_stream:
+		// Release the join bundle, the intro and the cluster we're sending in case we didn't
+		// send all of it. The clusters belong to the stream feed, so we just have to leave
+		// the viewer arrays.
+		stream_viewer_release_intro(server, client);
+		stream_viewer_hold_cluster(server, client, NULL);
+		
+		if (flags & CLIENT_CON_CLEANUP) {
+			stream_remove_stalled_viewer(server, client->stream, client);
+			stream_remove_viewer(server, client->stream, client);
+			stream_feed_release_unneeded(server, &client->stream->feeds[server->worker_index]);
+		}
 		goto disconnect;
 	
 	
@@ -662,21 +871,26 @@ int client_handler(int client_fd, client_p client, server_p server, int flags) {
 	
 	
 	
-	// State writes the client buffer to the connection and disconnects afterwards. If the buffer
-	// was dynamically allocated store the original malloc pointer in client->buffer_to_free. It
-	// will be freed once the buffer was send.
+	// State writes the client buffer to the connection. Afterwards keep-alive clients continue
+	// with their next request, all others are disconnected. If the buffer was dynamically
+	// allocated store the original malloc pointer in client->buffer_to_free. It will be
+	// freed once the buffer was send.
 	// 
 	// Client state used:
 	//   client->buffer (store the buffer you want to send in there)
 	//   client->buffer_to_free (this pointer will be passed to free() when the buffer was send)
 	
-	enter_send_buffer_and_disconnect:
-		client->state = &&send_buffer_and_disconnect;
+	enter_send_buffer:
+		client->state = &&send_buffer;
 		client->flags |= CLIENT_POLL_FOR_WRITE;
 		client->flags &= ~CLIENT_POLL_FOR_READ;
-		goto return_to_server_to_poll_for_io;
+		// The connection is usually writable, so try right away. A keep-alive client answering
+		// a pipelined request is already polled for writing and wouldn't get another event.
+	
+	send_buffer:
+		if (flags & CLIENT_CON_CLEANUP)
+			goto free_buffer_to_free_and_disconnect;
 		
-	send_buffer_and_disconnect:
 		while (client->buffer.size > 0) {
 			ssize_t bytes_written = write(client_fd, client->buffer.ptr, client->buffer.size);
 			if (bytes_written >= 0) {
@@ -688,38 +902,51 @@ int client_handler(int client_fd, client_p client, server_p server, int flags) {
 					break;
 				} else {
 					warn("[client %d] write error: %s", client_fd, strerror(errno));
-					goto free_client_buffer_and_disconnect;
+					goto free_buffer_to_free_and_disconnect;
 				}
 			}
 		}
 		
-		if (client->buffer.size == 0) {
-			free(client->buffer_to_free);
-			client->buffer_to_free = NULL;
-			goto disconnect;
-		}
-		
 		// Still some buffer data left to write for the next time
-		goto return_to_server_to_poll_for_io;
+		if (client->buffer.size > 0)
+			goto return_to_server_to_poll_for_io;
+		
+		free(client->buffer_to_free);
+		client->buffer_to_free = NULL;
+		
+		// Keep-alive clients start over with their next request
+		if ( !(client->flags & CLIENT_KEEP_ALIVE) )
+			goto disconnect;
+		goto enter_http_request;
 	
 	
 	// Exit states, either to clean up a client or to return control to the server
 	// so it can poll for a readable or writable connection.
 	
+	release_status_json_and_disconnect:
+		if (client->status_json)
+			status_json_unref(client->status_json);
+		client->status_json = NULL;
+	
+	free_buffer_to_free_and_disconnect:
+		free(client->buffer_to_free);
+		client->buffer_to_free = NULL;
+		goto disconnect;
+	
 	free_client_buffer_and_disconnect:
 		free(client->buffer.ptr);
 		client->buffer.ptr  = NULL;
 		client->buffer.size = 0;
-		
+	
 	disconnect:
+		// Viewers and keep-alive clients still have their request buffer
+		http_request_free(client);
 		return -1;
 	
 	return_to_server_to_poll_for_io:
 		return 0;
 	
 	
-	// Cleanup macros used in the state machine
-#	undef FILL_LOCAL_BUFFER
 }
 
 
@@ -728,11 +955,57 @@ int client_handler(int client_fd, client_p client, server_p server, int flags) {
 // These are local functions because some of them need access to the labels of the state machine.
 //
 
+/**
+ * Reads from the connection into the request buffer and parses what arrived. Returns 1 when
+ * all headers of the request are there, 0 if we have to wait for more data and -1 if the
+ * client should be disconnected (closed connection, malformed or too large request).
+ */
+static int http_request_read(client_p client, int client_fd) {
+	while (true) {
+		http_event_t event;
+		while ( (event = http_parser_next(&client->http_parser, client->request.ptr, client->request.filled)).type != HTTP_NEED_MORE_DATA ) {
+			switch (event.type) {
+				case HTTP_REQUEST_LINE:
+					http_request_handle_headline(client, event.method.ptr, event.resource.ptr, event.version.ptr);
+					break;
+				case HTTP_HEADER:
+					http_request_handle_header(client, client_fd, event.name.ptr, event.value.ptr);
+					break;
+				case HTTP_HEADERS_COMPLETE:
+					return 1;
+				default:
+					// error on reading initial HTTP header line, disconnect client for now
+					warn("[client %d] error while parsing HTTP headline", client_fd);
+					return -1;
+			}
+		}
+		
+		if (client->request.filled == client->request.size) {
+			warn("[client %d] HTTP request headers larger than %zu bytes, disconnecting", client_fd, client->request.size);
+			return -1;
+		}
+		
+		ssize_t bytes_read = read(client_fd, client->request.ptr + client->request.filled, client->request.size - client->request.filled);
+		if (bytes_read == 0) {
+			return -1;
+		} else if (bytes_read == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			warn("[client %d] read error: %s", client_fd, strerror(errno));
+			return -1;
+		}
+		client->request.filled += bytes_read;
+	}
+}
+
 static void http_request_handle_headline(client_p client, char* verb, char* resource, char* version) {
-	client->resource = strdup(resource);
-	client->method = strdup(verb);
+	client->resource = resource;
+	client->method = verb;
 	if ( strcmp(verb, "POST") == 0 )
 		client->flags |= CLIENT_IS_POST_REQUEST;
+	// HTTP/1.1 connections are kept alive unless the client says otherwise
+	if ( strcmp(version, "HTTP/1.1") == 0 )
+		client->flags |= CLIENT_KEEP_ALIVE;
 }
 
 static void http_request_handle_header(client_p client, int client_fd, char* name, char* value) {
@@ -741,6 +1014,13 @@ static void http_request_handle_header(client_p client, int client_fd, char* nam
 		info("[client %d] User-Agent: %s", client_fd, value);
 	}
 	
+	if ( strcasecmp(name, "Connection") == 0 ) {
+		if ( strcasecmp(value, "close") == 0 )
+			client->flags &= ~CLIENT_KEEP_ALIVE;
+		else if ( strcasecmp(value, "keep-alive") == 0 )
+			client->flags |= CLIENT_KEEP_ALIVE;
+	}
+	
 	/*
 	if ( strcmp(name, "Authorization") == 0 ) {
 		int b64_start = 0, b64_end = 0;
@@ -756,30 +1036,92 @@ static void http_request_handle_header(client_p client, int client_fd, char* nam
 		
 	}
 	*/
+	
 }
 
-static void* http_request_dispatch(client_p client, int client_fd, server_p server,
-		void* enter_send_buffer_and_disconnect,
-		void* enter_receive_stream,
+/**
+ * Prepares the request buffer for the next request of a client and allocates it for the
+ * first one. Data the client already sent after the previous request is kept.
+ */
+static void http_request_next(client_p client) {
+	if (client->request.ptr == NULL) {
+		client->request.size = HTTP_REQUEST_BUFFER_SIZE;
+		client->request.filled = 0;
+		client->request.ptr = pool_alloc(client->request.size);
+	} else {
+		size_t rest_size = client->request.filled - client->http_parser.pos;
+		memmove(client->request.ptr, client->request.ptr + client->http_parser.pos, rest_size);
+		client->request.filled = rest_size;
+	}
+	
+	http_parser_init(&client->http_parser);
+	client->method = NULL;
+	client->resource = NULL;
+	client->flags &= ~(CLIENT_IS_POST_REQUEST | CLIENT_KEEP_ALIVE);
+}
+
+/**
+ * Frees the request buffer. The method and resource of the request are gone with it.
+ */
+static void http_request_free(client_p client) {
+	pool_free(client->request.ptr);
+	client->request = (buffer_t){ NULL, 0, 0 };
+	client->method = NULL;
+	client->resource = NULL;
+}
+
+/**
+ * Returns the URL decoded path of a resource without its parameters. The caller has to
+ * free() it.
+ */
+static char* http_request_decoded_path(const char* resource) {
+	char* path = strndup(resource, strcspn(resource, "?"));
+	urldecode(path, path);
+	return path;
+}
+
+static const char* http_connection_header(client_p client) {
+	return (client->flags & CLIENT_KEEP_ALIVE) ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+}
+
+/**
+ * Returns the last chunk if the client watched a stream on this connection before and
+ * the chunked response of that stream still has to be ended. Otherwise an empty string.
+ * Clears CLIENT_LAST_CHUNK_PENDING, so use the result in the next response.
+ */
+static const char* http_pending_last_chunk(client_p client) {
+	if ( !(client->flags & CLIENT_LAST_CHUNK_PENDING) )
+		return "";
+	
+	client->flags &= ~CLIENT_LAST_CHUNK_PENDING;
+	return STREAM_LAST_CHUNK;
+}
+
+static void* http_request_dispatch(client_p client, int client_fd, server_p server,
+		void* enter_send_buffer,
+		void* enter_receive_stream,
 		void* enter_send_stream,
-		void* enter_status_info
+		void* enter_status_info,
+		void* enter_metrics
 ) {
-	size_t path_len = strcspn(client->resource, "?");
-	char* urlencoded_path = strndup(client->resource, path_len);
-		char* path = malloc(path_len + 1);
-		urldecode(urlencoded_path, path);
-	free(urlencoded_path);
+	char* path = http_request_decoded_path(client->resource);
 	
 	if ( strcmp(path, "/") == 0 || strcmp(path, "/index.json") == 0 ) {
 		free(path);
 		return enter_status_info;
 	}
-
-	printf("DICT: %s %d\n", path, dict_contains(server->streams, path));	
-	if (dict_contains(server->streams, path)) {
-		client->stream = dict_get(server->streams, path, stream_p);
-		printf("DICT2: %p\n", dict_get(server->streams, path, stream_p));
+	
+	if ( strcmp(path, "/metrics") == 0 ) {
+		free(path);
+		return enter_metrics;
 	}
+	
+	// Keep-alive clients might still have the stream of their previous request
+	client->stream = NULL;
+	pthread_mutex_lock(server->streams_lock);
+		if (dict_contains(server->streams, path))
+			client->stream = dict_get(server->streams, path, stream_p);
+	pthread_mutex_unlock(server->streams_lock);
 	free(path);
 	
 	if (client->flags & CLIENT_IS_POST_REQUEST) {
@@ -788,78 +1130,292 @@ static void* http_request_dispatch(client_p client, int client_fd, server_p serv
 		return enter_send_stream;
 	}
 	
-	// We don't need those
-	free(client->method);
-	client->method = NULL;
-	free(client->resource);
-	client->resource = NULL;
-	
-	client->buffer.ptr = ""
-		"HTTP/1.0 404 Not Found\r\n"
+	const char* message = "Found nothing to serve to you. Sorry about that.\r\n";
+	int response_size = asprintf(&client->buffer.ptr, ""
+		"%s"
+		"HTTP/1.1 404 Not Found\r\n"
 		"Server: smeb v1.0.0\r\n"
 		"Content-Type: text/plain\r\n"
+		"Content-Length: %zu\r\n"
+		"%s"
 		"\r\n"
-		"Found nothing to serve to you. Sorry about that.\r\n";
-	client->buffer.size = strlen(client->buffer.ptr);
-	client->buffer_to_free = NULL;
-	return enter_send_buffer_and_disconnect;
+		"%s",
+		http_pending_last_chunk(client), strlen(message), http_connection_header(client), message
+	);
+	if (response_size == -1) {
+		// Send nothing and just close the connection
+		client->buffer = (buffer_t){ NULL, 0, 0 };
+		client->flags &= ~CLIENT_KEEP_ALIVE;
+	} else {
+		client->buffer.size = response_size;
+	}
+	client->buffer_to_free = client->buffer.ptr;
+	return enter_send_buffer;
+}
+
+/**
+ * Allocates a chunk buffer for a cluster of `cluster_size` bytes with room for the HTTP
+ * chunk framing around it (see shared_buffer_new_http_chunk()). The first
+ * `buffered_size` bytes of the cluster are copied from `buffered_ptr`.
+ */
+static char* streamer_new_cluster_chunk(char* buffered_ptr, size_t buffered_size, size_t cluster_size) {
+	char* chunk_ptr = pool_alloc(HTTP_CHUNK_HEADROOM + cluster_size + 2);
+	memcpy(chunk_ptr + HTTP_CHUNK_HEADROOM, buffered_ptr, buffered_size);
+	return chunk_ptr;
 }
 
-static ssize_t streamer_try_to_extract_mkv_header(void* buffer_ptr, size_t buffer_size) {
-	size_t buffer_pos = 0;
+/**
+ * Creates the shared buffer of a fragment cluster (low latency mode) with the given block
+ * (a SimpleBlock or BlockGroup element) as its first one. The cluster has an unknown size
+ * since the next blocks are appended as they arrive, each one as an HTTP chunk of its own
+ * (see streamer_append_block()). The first chunk also contains the cluster header and the
+ * timecode. `capacity` is set to the bytes the buffer has room for.
+ */
+static shared_buffer_p streamer_new_fragment_cluster(uint64_t timecode, char* block_ptr, size_t block_size, size_t refcount, stream_p stream, size_t* capacity) {
+	uint8_t cluster_header[4 + 1 + 2 + 8];
+	uint8_t* p = cluster_header;
+	streamer_write_uint(p, MKV_Cluster, 4);
+	p += 4;
+	*p++ = 0xff;
+	size_t timecode_bytes = ebml_unencoded_uint_required_bytes(timecode);
+	*p++ = MKV_Timecode;
+	*p++ = 0x80 | timecode_bytes;
+	streamer_write_uint(p, timecode, timecode_bytes);
+	p += timecode_bytes;
+	size_t cluster_header_size = p - cluster_header;
 	
-	uint32_t id = 0;
-	do {
-		size_t pos = 0;
-		id = ebml_read_element_id(buffer_ptr + buffer_pos, buffer_size - buffer_pos, &pos);
-		if (pos == 0) {
-			debug("  failed to read element id");
-			return -1;
-		}
-		buffer_pos += pos;
+	size_t content_size = cluster_header_size + block_size;
+	*capacity = HTTP_CHUNK_HEADROOM + content_size + 2;
+	if (*capacity < STREAMER_FRAGMENT_CLUSTER_SIZE)
+		*capacity = STREAMER_FRAGMENT_CLUSTER_SIZE;
+	char* allocation = pool_alloc(*capacity);
+	
+	size_t size = sprintf(allocation, "%zx\r\n", content_size);
+	memcpy(allocation + size, cluster_header, cluster_header_size);
+	size += cluster_header_size;
+	memcpy(allocation + size, block_ptr, block_size);
+	size += block_size;
+	memcpy(allocation + size, "\r\n", 2);
+	size += 2;
+	
+	// Slow viewers get the blocks as they arrive, there is no reduced variant
+	shared_buffer_p fragment = shared_buffer_new(allocation, allocation, size, refcount, stream);
+	fragment->reduced = fragment;
+	fragment->open = true;
+	return fragment;
+}
+
+/**
+ * Removes the first `size` bytes from the buffer. Shrinks the buffer back to its initial
+ * size if it was increased for a large element that is now gone.
+ */
+static void streamer_buffer_remove(buffer_p buffer, size_t size) {
+	memmove(buffer->ptr, buffer->ptr + size, buffer->filled - size);
+	buffer->filled -= size;
+	
+	if (buffer->size > STREAMER_BUFFER_SIZE && buffer->filled <= STREAMER_BUFFER_SIZE) {
+		buffer->size = STREAMER_BUFFER_SIZE;
+		buffer->ptr = realloc(buffer->ptr, buffer->size);
+	}
+}
+
+/**
+ * Patches a complete cluster received from the streamer, updates the intro and hands the
+ * cluster to the viewers on all workers. Takes over the chunk buffer (see
+ * streamer_new_cluster_chunk()), `chunk_size` includes the room for the framing.
+ */
+static void streamer_publish_cluster(char* chunk_ptr, size_t chunk_size, stream_p stream, server_p server) {
+	char* cluster_ptr = chunk_ptr + HTTP_CHUNK_HEADROOM;
+	size_t cluster_size = chunk_size - HTTP_CHUNK_HEADROOM - 2;
+	
+	// The intro and its sequence number are read by viewers joining on other workers.
+	// Update both at once so a viewer gets every cluster exactly once.
+	// 
+	// One reference for each worker, they release it when their viewers are done with it.
+	// The chunk buffer already has room for the HTTP chunk framing, so the shared buffer
+	// takes it over as it is.
+	uint64_t cluster_seq = 0;
+	shared_buffer_p cluster = NULL;
+	streamer_cluster_info_t info;
+	usec_t received_at = time_now();
+	pthread_mutex_lock(&stream->lock);
+		info = streamer_inspect_cluster(cluster_ptr, cluster_size, stream, server);
+		cluster_seq = ++stream->cluster_seq;
+		streamer_count_ingest(stream, cluster_size, info, received_at);
+		chunk_ptr = streamer_patch_cluster(chunk_ptr, &chunk_size, stream->prev_sources_offset);
+		cluster = shared_buffer_new_http_chunk(chunk_ptr, chunk_size, server->worker_count, stream);
+		cluster->received_at = received_at;
+		streamer_update_intro(server, stream, cluster, cluster_seq, info);
+	pthread_mutex_unlock(&stream->lock);
+	debug("[stream %s] received new cluster (%zu bytes)", stream->name, cluster_size);
+	
+	// Hand the cluster to the other workers first so they can start sending while we
+	// take care of our own viewers.
+	for(size_t i = 0; i < server->worker_count; i++) {
+		if (i == server->worker_index)
+			continue;
+		stream_ref(stream);
+		worker_post_message(&server->workers[i], (worker_message_t){
+			.type = WORKER_MESSAGE_CLUSTER, .stream = stream, .cluster = cluster, .cluster_seq = cluster_seq,
+			.cluster_starts_with_keyframe = info.starts_with_keyframe
+		});
+	}
+	
+	stream_deliver_cluster(server, stream, cluster, cluster_seq, info.starts_with_keyframe);
+}
+
+/**
+ * Updates the ingest counters of the stream for a published cluster (or block in low
+ * latency mode). The bitrate is calculated once per STREAM_BITRATE_INTERVAL, the first
+ * one starts with the first cluster. Call with the stream locked.
+ */
+static void streamer_count_ingest(stream_p stream, size_t cluster_size, streamer_cluster_info_t info, usec_t received_at) {
+	metric_add(&stream->ingest_bytes, cluster_size);
+	metric_add(&stream->ingest_clusters, 1);
+	if (info.keyframe_tail_size > 0)
+		metric_add(&stream->ingest_keyframes, 1);
+	
+	usec_t elapsed = received_at - stream->ingest_interval_start;
+	if (stream->ingest_interval_start == 0 || elapsed < 0) {
+		stream->ingest_interval_bytes = 0;
+		__atomic_store_n(&stream->ingest_interval_start, received_at, __ATOMIC_RELAXED);
+	} else if (elapsed >= STREAM_BITRATE_INTERVAL) {
+		__atomic_store_n(&stream->ingest_bitrate, stream->ingest_interval_bytes * 8 * 1000000 / elapsed, __ATOMIC_RELAXED);
+		stream->ingest_interval_bytes = 0;
+		__atomic_store_n(&stream->ingest_interval_start, received_at, __ATOMIC_RELAXED);
+	}
+	stream->ingest_interval_bytes += cluster_size;
+}
+
+/**
+ * Appends a block received in low latency mode to the fragment cluster of the source and
+ * tells the workers about it. Their viewers send the fragment cluster as it grows, so the
+ * blocks of a source cluster take one ring slot and one buffer. A new fragment cluster is
+ * started for the first block of each source cluster, for each video keyframe (so new
+ * and lagging viewers can start with it) and when the block doesn't fit anymore.
+ */
+static void streamer_append_block(client_p client, char* block_ptr, size_t block_size, server_p server) {
+	stream_p stream = client->stream;
+	usec_t received_at = time_now();
+	streamer_cluster_info_t info;
+	shared_buffer_p fragment = NULL;
+	bool new_fragment = false;
+	
+	// Viewers joining on other workers read the intro, the sequence number and the size of
+	// the fragment cluster with the stream locked
+	pthread_mutex_lock(&stream->lock);
+		info = streamer_inspect_block(block_ptr, block_size, client->cluster_timecode, stream);
+		streamer_count_ingest(stream, block_size, info, received_at);
 		
-		pos = 0;
-		uint64_t size = ebml_read_data_size(buffer_ptr + buffer_pos, buffer_size - buffer_pos, &pos);
-		if (pos == 0) {
-			debug("  failed to read data size");
-			return -1;
+		if ( client->fragment && (info.keyframe_tail_size > 0 || client->fragment->size + HTTP_CHUNK_HEADROOM + block_size + 2 > client->fragment_capacity) )
+			streamer_close_fragment(client, server);
+		
+		fragment = client->fragment;
+		if (fragment == NULL) {
+			// One reference for each worker and one for us while we append to it
+			client->fragment_seq = ++stream->cluster_seq;
+			fragment = streamer_new_fragment_cluster(stream->prev_sources_offset + client->cluster_timecode, block_ptr, block_size,
+				server->worker_count + 1, stream, &client->fragment_capacity);
+			fragment->received_at = received_at;
+			streamer_update_intro(server, stream, fragment, client->fragment_seq, info);
+			client->fragment = fragment;
+			new_fragment = true;
+		} else {
+			size_t chunk_size = streamer_http_encapsulate(fragment->ptr + fragment->size, block_ptr, block_size);
+			shared_buffer_grow(fragment, chunk_size);
+			__atomic_store_n(&fragment->received_at, received_at, __ATOMIC_RELAXED);
+			
+			array_p intro = stream->intro_clusters;
+			if (intro->length > 0 && array_elem(intro, shared_buffer_p, intro->length - 1) == fragment)
+				__atomic_add_fetch(&stream->intro_bytes, chunk_size, __ATOMIC_RELAXED);
 		}
-		buffer_pos += pos;
-		
-		if (id == MKV_Segment) {
-			debug("  <Segment 0x%08lX bytes>, patching to unknown size, entering", size);
-			// Add a leading 0 bit for each addidional size byte, then convert to big endian so
-			// we can directly copy it over the old size.
-			uint64_t unknown_size = __builtin_bswap64(0xffffffffffffffff >> (pos - 1));
-			memcpy(buffer_ptr + buffer_pos - pos, &unknown_size, pos);
+	pthread_mutex_unlock(&stream->lock);
+	
+	// Workers only need to know about new blocks if someone watches. Those that got no
+	// message take the blocks with the next one.
+	for(size_t i = 0; i < server->worker_count; i++) {
+		if (i == server->worker_index)
 			continue;
-		}
+		if ( !new_fragment && __atomic_load_n(&stream->viewer_count, __ATOMIC_RELAXED) == 0 )
+			break;
 		
-		if (buffer_pos + size > buffer_size) {
-			debug("  failed to read element data of <0x%08X %zu bytes>", id, size);
-			return -1;
+		stream_ref(stream);
+		if (new_fragment) {
+			worker_post_message(&server->workers[i], (worker_message_t){
+				.type = WORKER_MESSAGE_CLUSTER, .stream = stream, .cluster = fragment, .cluster_seq = client->fragment_seq,
+				.cluster_starts_with_keyframe = info.starts_with_keyframe
+			});
+		} else {
+			worker_post_message(&server->workers[i], (worker_message_t){ .type = WORKER_MESSAGE_BLOCKS, .stream = stream });
 		}
-		buffer_pos += size;
-		
-		debug("  <0x%08X %zu bytes>", id, size);
-	} while (id != MKV_Tracks);
+	}
+	
+	if (new_fragment)
+		stream_deliver_cluster(server, stream, fragment, client->fragment_seq, info.starts_with_keyframe);
+	else
+		stream_deliver_blocks(server, stream);
+}
+
+/**
+ * Ends the fragment cluster a low latency source appends to. Workers notice it with the
+ * next cluster (see stream_feed_update_fragment()), their viewers wait for it anyway.
+ */
+static void streamer_close_fragment(client_p client, server_p server) {
+	if (client->fragment == NULL)
+		return;
 	
-	return buffer_pos;
+	__atomic_store_n(&client->fragment->open, false, __ATOMIC_RELEASE);
+	shared_buffer_unref(server, client->fragment);
+	client->fragment = NULL;
 }
 
-static ssize_t streamer_try_to_extract_mkv_cluster(void* buffer_ptr, size_t buffer_size) {
-	size_t buffer_pos = 0;
-	ebml_elem_t element;
+/**
+ * Publishes the elements of an unknown size cluster we received so far. Used when the
+ * source disconnects. An element that isn't complete yet is left out, the cluster is
+ * given its actual size by streamer_patch_cluster().
+ */
+static void streamer_publish_open_cluster(client_p client, server_p server) {
+	ebml_parser_p parser = &client->parser;
+	if (client->stream->low_latency || parser->depth < 2)
+		return;
 	
-	do {
-		element = ebml_read_element(buffer_ptr, buffer_size, &buffer_pos);
-		if (element.id == 0)
-			return -1;
-		
-		//debug("  <0x%08X %zu bytes>\n", element.id, element.data_size);
-	} while (element.id != MKV_Cluster);
+	ebml_event_p cluster = &parser->stack[1];
+	if (cluster->id != MKV_Cluster || cluster->data_size != EBML_UNKNOWN_SIZE)
+		return;
+	
+	size_t end = (parser->element_pending) ? parser->pending.offset : parser->pos;
+	size_t cluster_size = end - cluster->offset;
+	if (cluster_size <= cluster->header_size || cluster_size > STREAMER_MAX_CLUSTER_SIZE)
+		return;
 	
-	return buffer_pos;
+	char* chunk_ptr = streamer_new_cluster_chunk(client->buffer.ptr + cluster->offset, cluster_size, cluster_size);
+	streamer_publish_cluster(chunk_ptr, HTTP_CHUNK_HEADROOM + cluster_size + 2, client->stream, server);
+	parser->depth = 1;
+}
+
+/**
+ * Adds a published cluster to the intro of the stream. A cluster with a video keyframe
+ * starts a new intro. If the keyframe isn't the first video block only the blocks from
+ * the keyframe on are sent to new viewers. Without a keyframe the cluster is appended to
+ * the current intro unless that already got too long. Call with the stream locked.
+ */
+static void streamer_update_intro(server_p server, stream_p stream, shared_buffer_p cluster, uint64_t cluster_seq, streamer_cluster_info_t info) {
+	if (info.keyframe_tail_size > 0) {
+		stream_release_intro_clusters(server, stream);
+		stream->intro_seq = cluster_seq;
+		stream->intro_timecode = stream->prev_sources_offset + info.timecode;
+		stream->intro_tail_size = (info.starts_with_keyframe) ? 0 : info.keyframe_tail_size;
+	} else if (stream->intro_clusters->length == 0) {
+		return;
+	} else if (stream->intro_clusters->length >= STREAM_MAX_INTRO_CLUSTERS) {
+		warn("[stream %s] no keyframe in the last %d clusters, dropping the intro", stream->name, STREAM_MAX_INTRO_CLUSTERS);
+		stream_release_intro_clusters(server, stream);
+		return;
+	}
+	
+	shared_buffer_ref(cluster);
+	array_append(stream->intro_clusters, shared_buffer_p, cluster);
+	__atomic_add_fetch(&stream->intro_bytes, cluster->size, __ATOMIC_RELAXED);
 }
 
 static size_t streamer_calculate_http_encapsulated_size(size_t payload_size) {
@@ -872,41 +1428,41 @@ static size_t streamer_calculate_http_encapsulated_size(size_t payload_size) {
 	return required_hex_digits + len_of_crlf + payload_size + len_of_crlf;
 }
 
-static bool streamer_inspect_cluster(void* buffer_ptr, size_t buffer_size, stream_p stream, char** patched_buffer_ptr, size_t* patched_buffer_size, server_p server) {
-	bool keyframe_found = false;
+/**
+ * Writes the content as one HTTP chunk into `dest`. `dest` has to have room for
+ * streamer_calculate_http_encapsulated_size(content_size) bytes. Returns the number
+ * of bytes written.
+ */
+static size_t streamer_http_encapsulate(char* dest, char* content_ptr, size_t content_size) {
+	int enc_bytes = sprintf(dest, "%zx\r\n", content_size);
+	memcpy(dest + enc_bytes, content_ptr, content_size);
+	dest[enc_bytes + content_size + 0] = '\r';
+	dest[enc_bytes + content_size + 1] = '\n';
+	return enc_bytes + content_size + 2;
+}
+
+/**
+ * Updates the last observed timecode of the stream with the blocks of a cluster and
+ * looks for video keyframes. starts_with_keyframe is set if the first video block of the
+ * cluster is a keyframe, so viewers can continue with it without the clusters before it.
+ */
+static streamer_cluster_info_t streamer_inspect_cluster(void* buffer_ptr, size_t buffer_size, stream_p stream, server_p server) {
+	streamer_cluster_info_t info = { 0 };
+	bool video_block_found = false;
 	size_t pos = 0;
 	uint64_t cluster_timecode = 0;
 	bool show_verbose = false;
 	
-	FILE* pb = open_memstream(patched_buffer_ptr, patched_buffer_size);
-	
 	// Read the cluster element header
 	ebml_read_element_header(buffer_ptr, buffer_size, &pos);
-	// Write a matching cluster element header into the intro stream
-	long o1 = ebml_element_start(stream->intro_stream, MKV_Cluster);
-	// Write cluster element header into the patched buffer stream
-	long pbo1 = ebml_element_start(pb, MKV_Cluster);
 	
 	while (pos < buffer_size) {
 		ebml_elem_t e = ebml_read_element_header(buffer_ptr, buffer_size, &pos);
 		
-		// Write the elements into the patched buffer
-		if (e.id == MKV_Timecode) {
-			// Write patched timecode to the patched buffer. This is the entire point of the
-			// patched buffer: patching the timecodes of the whole thing.
-			uint64_t timecode = ebml_read_uint(e.data_ptr, e.data_size);
-			ebml_element_uint(pb, MKV_Timecode, stream->prev_sources_offset + timecode);
-		} else {
-			// Copy all other elements as they are
-			fwrite(e.data_ptr - e.header_size, e.header_size + e.data_size, 1, pb);
-		}
-		
 		if (e.id == MKV_Timecode) {
 			cluster_timecode = ebml_read_uint(e.data_ptr, e.data_size);
+			info.timecode = cluster_timecode;
 			if (show_verbose) printf("cluster: <Timecode %zu bytes: %lu>\n", e.data_size, cluster_timecode);
-			
-			// Copy the timecode into the current intro cluster
-			ebml_element_uint(stream->intro_stream, MKV_Timecode, stream->prev_sources_offset + cluster_timecode);
 		} else if (e.id == MKV_SimpleBlock) {
 			size_t block_pos = pos;
 			uint64_t track_number = ebml_read_data_size(buffer_ptr + block_pos, buffer_size - block_pos, &block_pos);
@@ -917,12 +1473,17 @@ static bool streamer_inspect_cluster(void* buffer_ptr, size_t buffer_size, strea
 			block_pos += 1;
 			
 			stream->last_observed_timecode = cluster_timecode + timecode;
-			
+
 #			define MKV_FLAG_KEYFRAME    (0b10000000)
 #			define MKV_FLAG_INVISIBLE   (0b00001000)
 #			define MKV_FLAG_LACING      (0b00000110)
 #			define MKV_FLAG_DISCARDABLE (0b00000001)
 			
+			if (track_number == 1 && !video_block_found) {
+				video_block_found = true;
+				info.starts_with_keyframe = (flags & MKV_FLAG_KEYFRAME);
+			}
+			
 			if (show_verbose) printf("cluster: <SimpleBlock %5zu bytes, ", e.data_size);
 				if (show_verbose) printf("header:");
 				for(size_t i = 0; i < 5; i++)
@@ -933,24 +1494,12 @@ static bool streamer_inspect_cluster(void* buffer_ptr, size_t buffer_size, strea
 				if (flags & MKV_FLAG_KEYFRAME) {
 					if (show_verbose) printf(" keyframe");
 					if (track_number == 1) {
-						// We got a keyframe! Restart the magic.
-						keyframe_found = true;
-						
-						fclose(stream->intro_stream);
-						free(stream->intro_buffer.ptr);
-						stream->intro_stream = open_memstream(&stream->intro_buffer.ptr, &stream->intro_buffer.size);
-						
-						// Write cluster element header and the timecode element
-						o1 = ebml_element_start(stream->intro_stream, MKV_Cluster);
-						ebml_element_uint(stream->intro_stream, MKV_Timecode, stream->prev_sources_offset + cluster_timecode);
-						
-						// Now continue to write all simple block elements that follow it to the intro stream
+						// We got a keyframe! New viewers start with this block and the ones
+						// after it.
+						info.keyframe_tail_size = ((uint8_t*)buffer_ptr + buffer_size) - ((uint8_t*)e.data_ptr - e.header_size);
 					}
 				}
 				
-				// Write all simple blocks into the intro stream
-				fwrite(e.data_ptr - e.header_size, e.header_size + e.data_size, 1, stream->intro_stream);
-				
 				if (flags & MKV_FLAG_INVISIBLE)
 					if (show_verbose) printf(" invisible");
 				if (flags & MKV_FLAG_DISCARDABLE)
@@ -971,135 +1520,1307 @@ static bool streamer_inspect_cluster(void* buffer_ptr, size_t buffer_size, strea
 		pos += e.data_size;
 	}
 	
-	// End the cluster and make sure the intro buffer can be used
-	ebml_element_end(stream->intro_stream, o1);
-	fflush(stream->intro_stream);
-	if (show_verbose) printf("intro buffer size: %zu\n", stream->intro_buffer.size);
+	return info;
+}
+
+/**
+ * Like streamer_inspect_cluster() for a single block of a cluster with `cluster_timecode`
+ * (low latency mode). A video keyframe sets keyframe_tail_size to the size of the block.
+ */
+static streamer_cluster_info_t streamer_inspect_block(char* block_ptr, size_t block_size, uint64_t cluster_timecode, stream_p stream) {
+	streamer_cluster_info_t info = { .timecode = cluster_timecode };
+	
+	size_t pos = 0;
+	ebml_elem_t e = ebml_read_element_header(block_ptr, block_size, &pos);
+	if (e.id != MKV_SimpleBlock)
+		return info;
+	
+	size_t block_pos = 0;
+	uint64_t track_number = ebml_read_data_size(e.data_ptr, e.data_size, &block_pos);
+	if (block_pos + 3 > e.data_size)
+		return info;
+	int16_t timecode = ebml_read_int(e.data_ptr + block_pos, 2);
+	uint8_t flags = ebml_read_uint(e.data_ptr + block_pos + 2, 1);
+	
+	stream->last_observed_timecode = cluster_timecode + timecode;
+	if (track_number == 1 && (flags & MKV_FLAG_KEYFRAME)) {
+		info.starts_with_keyframe = true;
+		info.keyframe_tail_size = block_size;
+	}
+	
+	return info;
+}
+
+static void streamer_write_uint(uint8_t* ptr, uint64_t value, size_t bytes) {
+	for(size_t i = 0; i < bytes; i++)
+		ptr[i] = value >> (8 * (bytes - 1 - i));
+}
+
+/**
+ * Adds `timecode_offset` to the cluster timecode and writes the CRLF after the cluster.
+ * The cluster is in a chunk buffer (see streamer_new_cluster_chunk()). Clusters of
+ * unknown size get their actual size, viewers only see clusters of known size.
+ * 
+ * The timecode and size are patched in place if the new values fit into the elements of
+ * the source. Otherwise a new chunk buffer is created. There the timecode element is
+ * written anew with more bytes and the cluster gets an 8 byte data size. All other
+ * elements are copied as they are. Returns the chunk buffer to use from now on.
+ */
+static char* streamer_patch_cluster(char* chunk_ptr, size_t* chunk_size, uint64_t timecode_offset) {
+	void* cluster_ptr = chunk_ptr + HTTP_CHUNK_HEADROOM;
+	size_t cluster_size = *chunk_size - HTTP_CHUNK_HEADROOM - 2;
+	
+	size_t pos = 0;
+	ebml_elem_t cluster = ebml_read_element_header(cluster_ptr, cluster_size, &pos);
+	size_t cluster_id_size = 4 - __builtin_clz(cluster.id) / 8;
+	
+	// The size field of unknown size clusters is usually 8 bytes long, enough for any size
+	bool unknown_size = (cluster.data_size == EBML_UNKNOWN_SIZE);
+	size_t size_field_bytes = cluster.header_size - cluster_id_size;
+	uint64_t data_size = cluster_size - cluster.header_size;
+	bool size_fits = !unknown_size || data_size < (1ULL << (7 * size_field_bytes)) - 1;
+	
+	// Look for the timecode element, usually it's the first one in the cluster
+	ebml_elem_t timecode = { 0 };
+	while ( (timecode_offset > 0 || !size_fits) && pos < cluster_size ) {
+		ebml_elem_t e = ebml_read_element_header(cluster_ptr, cluster_size, &pos);
+		if (e.id == MKV_Timecode) {
+			timecode = e;
+			break;
+		}
+		pos += e.data_size;
+	}
+	
+	uint64_t patched_timecode = 0;
+	size_t patched_timecode_bytes = 0;
+	if (timecode.id == MKV_Timecode) {
+		patched_timecode = ebml_read_uint(timecode.data_ptr, timecode.data_size) + timecode_offset;
+		patched_timecode_bytes = ebml_unencoded_uint_required_bytes(patched_timecode);
+	}
+	
+	if (patched_timecode_bytes <= timecode.data_size && size_fits) {
+		// Common case: Patch the timecode in place (if there is anything to patch at all)
+		if (timecode.id == MKV_Timecode)
+			streamer_write_uint(timecode.data_ptr, patched_timecode, timecode.data_size);
+		// Replace an unknown size with the actual one, the length marker bit stays in place
+		if (unknown_size)
+			streamer_write_uint(cluster_ptr + cluster_id_size, data_size | (1ULL << (7 * size_field_bytes)), size_field_bytes);
+		memcpy(chunk_ptr + *chunk_size - 2, "\r\n", 2);
+		return chunk_ptr;
+	}
+	
+	// The patched timecode or the size doesn't fit. Write the cluster header with an 8 byte
+	// data size, a new timecode element and copy the other elements around it.
+	void* timecode_element_ptr = (timecode.id == MKV_Timecode) ? timecode.data_ptr - timecode.header_size : cluster.data_ptr;
+	void* after_timecode_ptr = (timecode.id == MKV_Timecode) ? timecode.data_ptr + timecode.data_size : cluster.data_ptr;
+	size_t timecode_element_size = (timecode.id == MKV_Timecode) ? 2 + patched_timecode_bytes : 0;
+	size_t before_size = timecode_element_ptr - (cluster.data_ptr);
+	size_t after_size = (cluster_ptr + cluster_size) - after_timecode_ptr;
+	uint64_t patched_data_size = before_size + timecode_element_size + after_size;
 	
-	ebml_element_end(pb, pbo1);
-	fclose(pb);
+	*chunk_size = HTTP_CHUNK_HEADROOM + cluster_id_size + 8 + patched_data_size + 2;
+	uint8_t* patched_chunk_ptr = pool_alloc(*chunk_size);
+	uint8_t* p = patched_chunk_ptr + HTTP_CHUNK_HEADROOM;
+	streamer_write_uint(p, cluster.id, cluster_id_size);
+	p += cluster_id_size;
+	*p++ = 0x01;
+	streamer_write_uint(p, patched_data_size, 7);
+	p += 7;
+	memcpy(p, cluster.data_ptr, before_size);
+	p += before_size;
+	if (timecode_element_size > 0) {
+		*p++ = MKV_Timecode;
+		*p++ = 0x80 | patched_timecode_bytes;
+		streamer_write_uint(p, patched_timecode, patched_timecode_bytes);
+		p += patched_timecode_bytes;
+	}
+	memcpy(p, after_timecode_ptr, after_size);
+	p += after_size;
+	memcpy(p, "\r\n", 2);
 	
-	return keyframe_found;
+	pool_free(chunk_ptr);
+	return (char*)patched_chunk_ptr;
+}
+
+static bool streamer_is_discardable_video_block(ebml_elem_t e) {
+	if (e.id != MKV_SimpleBlock)
+		return false;
+	
+	size_t pos = 0;
+	uint64_t track_number = ebml_read_data_size(e.data_ptr, e.data_size, &pos);
+	if (pos + 3 > e.data_size)
+		return false;
+	uint8_t flags = ebml_read_uint(e.data_ptr + pos + 2, 1);
+	return (track_number == 1 && (flags & MKV_FLAG_DISCARDABLE));
+}
+
+/**
+ * Builds a chunk buffer (see streamer_new_cluster_chunk()) with a copy of the cluster
+ * without the discardable video blocks. Those frames aren't referenced by any other
+ * frame, so the video continues with a lower frame rate. Audio, keyframes and all other
+ * elements are kept. Returns NULL if there is nothing to drop.
+ */
+static char* streamer_reduce_cluster(char* cluster_ptr, size_t cluster_size, size_t* chunk_size) {
+	size_t pos = 0;
+	ebml_elem_t cluster = ebml_read_element_header(cluster_ptr, cluster_size, &pos);
+	size_t elements_pos = pos;
+	
+	uint64_t reduced_data_size = 0;
+	while (pos < cluster_size) {
+		ebml_elem_t e = ebml_read_element(cluster_ptr, cluster_size, &pos);
+		if (e.id == 0)
+			return NULL;
+		if ( !streamer_is_discardable_video_block(e) )
+			reduced_data_size += e.header_size + e.data_size;
+	}
+	
+	if (reduced_data_size == cluster_size - elements_pos)
+		return NULL;
+	
+	size_t cluster_id_size = 4 - __builtin_clz(cluster.id) / 8;
+	*chunk_size = HTTP_CHUNK_HEADROOM + cluster_id_size + 8 + reduced_data_size + 2;
+	uint8_t* chunk_ptr = pool_alloc(*chunk_size);
+	uint8_t* p = chunk_ptr + HTTP_CHUNK_HEADROOM;
+	streamer_write_uint(p, cluster.id, cluster_id_size);
+	p += cluster_id_size;
+	*p++ = 0x01;
+	streamer_write_uint(p, reduced_data_size, 7);
+	p += 7;
+	
+	pos = elements_pos;
+	while (pos < cluster_size) {
+		ebml_elem_t e = ebml_read_element(cluster_ptr, cluster_size, &pos);
+		if ( streamer_is_discardable_video_block(e) )
+			continue;
+		memcpy(p, e.data_ptr - e.header_size, e.header_size + e.data_size);
+		p += e.header_size + e.data_size;
+	}
+	memcpy(p, "\r\n", 2);
+	
+	return (char*)chunk_ptr;
 }
 
 
 
 //
-// Small helper functions for buffer management and parsing
+// Stream buffer management
 //
 
-static ssize_t local_buffer_required_size(buffer_p local_buffer, client_p client, int client_fd) {
-	int bytes_in_recv_buffer = 0;
-	if ( ioctl(client_fd, SIOCINQ, &bytes_in_recv_buffer) == -1 )
-		return perror("ioctl(SIOCINQ)"), -1;
-	return client->buffer.size + bytes_in_recv_buffer;
+/**
+ * Initializes a ring slot for the content of a shared buffer. The slot takes over one
+ * reference of the shared buffer and releases it in stream_feed_release_oldest().
+ */
+static void stream_buffer_new(stream_buffer_p stream_buffer, shared_buffer_p shared) {
+	// The source might still append to a fragment cluster, see stream_feed_update_fragment()
+	stream_buffer->open = __atomic_load_n(&shared->open, __ATOMIC_ACQUIRE);
+	stream_buffer->ptr = shared->ptr;
+	stream_buffer->size = __atomic_load_n(&shared->size, __ATOMIC_ACQUIRE);
+	stream_buffer->timecode = time_now();
+	stream_buffer->registered_index = -1;
+	stream_buffer->shared = shared;
 }
 
-static ssize_t local_buffer_recv(buffer_p local_buffer, client_p client, int client_fd) {
-	memcpy(local_buffer->ptr, client->buffer.ptr, client->buffer.size);
-	ssize_t bytes_read = read(client_fd, local_buffer->ptr + client->buffer.size, local_buffer->size - client->buffer.size);
-	if (bytes_read > 0) {
-		local_buffer->size = client->buffer.size + bytes_read;
-		client->buffer.size = 0;
-		
-		return local_buffer->size;
-	} else if (bytes_read == 0) {
-		return -1;
-	} else {
-		perror("read");
-		return -1;
-	}
+/**
+ * Releases the oldest cluster in the ring of the feed. A buffer registered with the
+ * io_uring backend is unregistered before that. Viewers whose cursor still points to
+ * that cluster notice it when they continue (their cursor is before first_seq then). Those
+ * in the middle of it hold a reference and finish it first.
+ */
+static void stream_feed_release_oldest(server_p server, stream_feed_p feed) {
+	stream_buffer_p stream_buffer = stream_feed_buffer(feed, feed->first_seq);
+	
+	if (stream_buffer->registered_index != -1)
+		uring_buffer_unregister(server->uring, stream_buffer->registered_index);
+	// Evicted clusters only count the viewers that got all of it
+	if (stream_buffer->last_written_at != 0)
+		record_latency(&feed->last_write_latency, __atomic_load_n(&stream_buffer->shared->received_at, __ATOMIC_RELAXED), stream_buffer->last_written_at);
+	shared_buffer_unref(server, stream_buffer->shared);
+	
+	memset(stream_buffer, 0, sizeof(stream_buffer_t));
+	feed->first_seq++;
 }
 
-static void local_buffer_backup_to_client_buffer(buffer_p local_buffer, client_p client) {
-	// If there is an unprocessed rest store it in the client buffer
-	if (local_buffer->size > 0) {
-		//printf("http: %zu rest bytes in unfinished line\n", local_buffer->size);
-		client->buffer.ptr = realloc(client->buffer.ptr, local_buffer->size);
-		memcpy(client->buffer.ptr, local_buffer->ptr, local_buffer->size);
-		client->buffer.size = local_buffer->size;
+/**
+ * When all viewers of the feed are stalled nobody needs the clusters in the ring any
+ * more. New viewers start with the intro cluster, so we can release them right away.
+ * Only a fragment cluster the source still appends to is kept, the stalled viewers wait
+ * for its next blocks and new ones continue with it after the intro.
+ */
+static void stream_feed_release_unneeded(server_p server, stream_feed_p feed) {
+	if (feed->stalled_viewers->length != feed->viewers->length)
+		return;
+	
+	while (feed->first_seq < feed->next_seq && !stream_feed_buffer(feed, feed->first_seq)->open)
+		stream_feed_release_oldest(server, feed);
+}
+
+/**
+ * Takes the blocks the source appended to the fragment cluster at the end of the ring
+ * since we last looked (low latency mode). Once the source closed it the stalled viewers
+ * that sent all of it wait for the next cluster instead.
+ */
+static void stream_feed_update_fragment(server_p server, stream_feed_p feed) {
+	if (feed->first_seq == feed->next_seq)
+		return;
+	stream_buffer_p stream_buffer = stream_feed_buffer(feed, feed->next_seq - 1);
+	if (!stream_buffer->open)
+		return;
+	
+	// The size is final once the source closed the fragment cluster
+	stream_buffer->open = __atomic_load_n(&stream_buffer->shared->open, __ATOMIC_ACQUIRE);
+	size_t size = __atomic_load_n(&stream_buffer->shared->size, __ATOMIC_ACQUIRE);
+	if (size > stream_buffer->size) {
+		stream_buffer->size = size;
+		stream_buffer->timecode = time_now();
+	}
+	
+	if (stream_buffer->open)
+		return;
+	
+	for(size_t i = 0; i < feed->stalled_viewers->length; i++) {
+		client_p viewer = hash_get_ptr(server->clients, array_elem(feed->stalled_viewers, int, i));
+		if (viewer->cursor == feed->next_seq - 1 && viewer->cursor_offset == stream_buffer->size)
+			stream_viewer_finish_buffer(server, viewer);
 	}
 }
 
-static ssize_t first_line_length(buffer_p buffer) {
-	void* line_end = memchr(buffer->ptr, '\n', buffer->size);
-	if (line_end == NULL)
-		return -1;
-	// Regard the \n as part of the line (thats the `+ 1`). Makes things easier down the road.
-	return (line_end - (void*)buffer->ptr) + 1;
+static stream_buffer_p stream_feed_buffer(stream_feed_p feed, uint64_t seq) {
+	return &feed->stream_buffers[seq % STREAM_FEED_CAPACITY];
 }
 
 
 //
-// Stream buffer management
+// Memory budgets
 //
 
 size_t stream_buffers_allocated = 0, stream_bytes_allocated = 0;
 
-static void stream_buffer_new(stream_buffer_p stream_buffer, char* content_ptr, size_t content_size, uint32_t flags) {
-	memset(stream_buffer, 0, sizeof(stream_buffer_t));
-	stream_buffer->refcount = 1;
-	stream_buffer->flags = flags;
-	stream_buffer->timecode = time_now();
-	stream_buffer->ptr = content_ptr;
-	stream_buffer->size = content_size;
+/**
+ * Bytes buffered for the stream that count against its budget. The intro clusters are
+ * kept anyway and don't count. Both counters are updated independently, so clamp at 0.
+ */
+static size_t stream_budget_usage(stream_p stream, size_t buffered_bytes) {
+	size_t intro_bytes = __atomic_load_n(&stream->intro_bytes, __ATOMIC_RELAXED);
+	return (buffered_bytes > intro_bytes) ? buffered_bytes - intro_bytes : 0;
+}
+
+static bool stream_over_budget(server_p server, stream_p stream) {
+	return server->stream_budget > 0 && stream_budget_usage(stream, __atomic_load_n(&stream->buffered_bytes, __ATOMIC_RELAXED)) > server->stream_budget;
+}
+
+static bool global_over_budget(server_p server) {
+	return server->global_budget > 0 && __atomic_load_n(&stream_bytes_allocated, __ATOMIC_RELAXED) > server->global_budget;
+}
+
+/**
+ * Returns true if the oldest clusters of the stream should be evicted to get below the
+ * stream or the global budget.
+ */
+static bool stream_should_evict(server_p server, stream_p stream) {
+	if ( global_over_budget(server) )
+		return true;
+	return server->budget_policy == BUDGET_POLICY_EVICT && stream_over_budget(server, stream);
+}
+
+/**
+ * Pauses the source of the stream if the stream is over its budget. Returns false if
+ * the source can continue to read. Otherwise the source no longer polls for read and
+ * waits for stream_resume_source().
+ * 
+ * The worker freeing the clusters might check source_paused right before we set it. So
+ * look at the budget again afterwards and resume on our own if it's already fine.
+ */
+static bool stream_pause_source(server_p server, stream_p stream, int client_fd, client_p client) {
+	if ( !stream_over_budget(server, stream) )
+		return false;
+	
+	stream->source_fd = client_fd;
+	stream->source_worker_index = server->worker_index;
+	__atomic_store_n(&stream->source_paused, 1, __ATOMIC_RELEASE);
 	
-	stream_buffers_allocated++;
-	stream_bytes_allocated += stream_buffer->size;
-	debug("[buffer %p] buffer allocated (%zu buffers, %zu bytes)", stream_buffer, stream_buffers_allocated, stream_bytes_allocated);
+	uint32_t paused = 1;
+	if ( !stream_over_budget(server, stream) && __atomic_compare_exchange_n(&stream->source_paused, &paused, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) )
+		return false;
+	
+	client->flags |= CLIENT_SOURCE_PAUSED;
+	client->flags &= ~CLIENT_POLL_FOR_READ;
+	info("[stream %s] over budget (%zu bytes buffered), pausing source", stream->name, __atomic_load_n(&stream->buffered_bytes, __ATOMIC_RELAXED));
+	return true;
 }
 
-static void stream_buffer_new_http_encapsulated(stream_buffer_p stream_buffer, char* content_ptr, size_t content_size, uint32_t flags) {
-	memset(stream_buffer, 0, sizeof(stream_buffer_t));
-	stream_buffer->refcount = 1;
-	stream_buffer->flags = flags;
-	stream_buffer->timecode = time_now();
+/**
+ * Called on the worker of the source after a WORKER_MESSAGE_RESUME_SOURCE. The source
+ * might have disconnected in the meantime, so only resume it if it's still paused.
+ */
+void stream_resume_source(server_p server, stream_p stream) {
+	client_p client = hash_get_ptr(server->clients, stream->source_fd);
+	if (client == NULL || client->stream != stream || !(client->flags & CLIENT_SOURCE_PAUSED))
+		return;
 	
-	// Calculate size for HTTP chunked encoding encapsulation
-	size_t http_encapsulated_size = streamer_calculate_http_encapsulated_size(content_size);
+	client->flags &= ~CLIENT_SOURCE_PAUSED;
+	client->flags |= CLIENT_POLL_FOR_READ;
+	array_append(server->clients_with_changed_flags, int, stream->source_fd);
+	info("[stream %s] below budget again (%zu bytes buffered), resuming source", stream->name, __atomic_load_n(&stream->buffered_bytes, __ATOMIC_RELAXED));
+}
+
+
+//
+// Shared buffer management
+//
+
+/**
+ * Creates a shared buffer from a pool_alloc()ed buffer that starts with HTTP_CHUNK_HEADROOM
+ * bytes of free space and ends with a CRLF. The hex size of the data in between is
+ * written right in front of it, so the buffer becomes one complete HTTP chunk without
+ * copying the data. The shared buffer takes over the buffer and frees it when the last
+ * reference is gone.
+ */
+static shared_buffer_p shared_buffer_new_http_chunk(char* chunk_ptr, size_t chunk_size, size_t refcount, stream_p stream) {
+	size_t content_size = chunk_size - HTTP_CHUNK_HEADROOM - 2;
+	char chunk_header[HTTP_CHUNK_HEADROOM + 1];
+	int chunk_header_size = snprintf(chunk_header, sizeof(chunk_header), "%zx\r\n", content_size);
+	
+	char* ptr = chunk_ptr + HTTP_CHUNK_HEADROOM - chunk_header_size;
+	memcpy(ptr, chunk_header, chunk_header_size);
+	return shared_buffer_new(chunk_ptr, ptr, chunk_size - HTTP_CHUNK_HEADROOM + chunk_header_size, refcount, stream);
+}
+
+/**
+ * Creates a shared buffer for `size` bytes at `ptr` within the pool_alloc()ed
+ * `allocation`. Takes over the allocation and accounts the size to the stream.
+ */
+static shared_buffer_p shared_buffer_new(char* allocation, char* ptr, size_t size, size_t refcount, stream_p stream) {
+	shared_buffer_p shared = pool_alloc(sizeof(shared_buffer_t));
+	shared->refcount = refcount;
+	shared->allocation = allocation;
+	shared->ptr = ptr;
+	shared->size = size;
+	shared->stream = stream;
+	shared->reduced = NULL;
+	shared->received_at = 0;
+	shared->open = false;
 	
-	// Fill the buffer with the cluster and add HTTP chunked encapsulation around it
-	stream_buffer->ptr = malloc(http_encapsulated_size);
-	stream_buffer->size = http_encapsulated_size;
-	int enc_bytes = snprintf(stream_buffer->ptr, stream_buffer->size, "%zx\r\n", content_size);
-	memcpy(stream_buffer->ptr + enc_bytes, content_ptr, content_size);
-	stream_buffer->ptr[enc_bytes + content_size + 0] = '\r';
-	stream_buffer->ptr[enc_bytes + content_size + 1] = '\n';
+	__atomic_add_fetch(&stream->buffered_bytes, shared->size, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stream->buffer_count, 1, __ATOMIC_RELAXED);
+	size_t buffers = __atomic_add_fetch(&stream_buffers_allocated, 1, __ATOMIC_RELAXED);
+	size_t bytes = __atomic_add_fetch(&stream_bytes_allocated, shared->size, __ATOMIC_RELAXED);
+	debug("[buffer %p] buffer allocated (%zu buffers, %zu bytes)", shared, buffers, bytes);
 	
-	stream_buffers_allocated++;
-	stream_bytes_allocated += stream_buffer->size;
-	debug("[buffer %p] buffer allocated (%zu buffers, %zu bytes)", stream_buffer, stream_buffers_allocated, stream_bytes_allocated);
+	return shared;
 }
 
-static void stream_buffer_ref(stream_buffer_p stream_buffer) {
-	stream_buffer->refcount++;
-	debug("[buffer %p] buffer ref (count %zu)", stream_buffer, stream_buffer->refcount);
+/**
+ * Makes `bytes` the source appended to a fragment cluster visible to the workers and
+ * accounts them to the stream. Only the source calls it while the buffer is open.
+ */
+static void shared_buffer_grow(shared_buffer_p shared, size_t bytes) {
+	__atomic_store_n(&shared->size, shared->size + bytes, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&shared->stream->buffered_bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stream_bytes_allocated, bytes, __ATOMIC_RELAXED);
+}
+
+void shared_buffer_ref(shared_buffer_p shared) {
+	__atomic_add_fetch(&shared->refcount, 1, __ATOMIC_RELAXED);
 }
 
 /**
- * Decrements the refcount of the stream buffer and returns `true` if the refcount dropped to 0.
- * The buffer ptr is freed if the refcount reaches 0 unless the STREAM_BUFFER_DONT_FREE_CONTENT
- * flag is set.
+ * Frees the shared buffer when the last reference is gone. If that gets a paused
+ * source below 3/4 of its stream budget the worker of the source is told to resume it.
+ * The margin avoids pausing and resuming the source on every cluster.
  */
-static bool stream_buffer_unref(stream_buffer_p stream_buffer) {
-	if (stream_buffer->refcount > 0)
-		stream_buffer->refcount--;
-	
-	if (stream_buffer->refcount == 0) {
-		if ( !(stream_buffer->flags & STREAM_BUFFER_DONT_FREE_CONTENT) )
-			free(stream_buffer->ptr);
-		stream_buffer->ptr = NULL;
-		
-		stream_buffers_allocated--;
-		stream_bytes_allocated -= stream_buffer->size;
-		debug("[buffer %p] buffer unrefed and freed (%zu buffers, %zu bytes)", stream_buffer, stream_buffers_allocated, stream_bytes_allocated);
+void shared_buffer_unref(server_p server, shared_buffer_p shared) {
+	if ( __atomic_sub_fetch(&shared->refcount, 1, __ATOMIC_ACQ_REL) != 0 )
+		return;
+	
+	// The reduced variant is owned by the buffer it was built from
+	if (shared->reduced != NULL && shared->reduced != shared)
+		shared_buffer_unref(server, shared->reduced);
+	
+	stream_p stream = shared->stream;
+	size_t stream_bytes = __atomic_sub_fetch(&stream->buffered_bytes, shared->size, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&stream->buffer_count, 1, __ATOMIC_RELAXED);
+	size_t buffers = __atomic_sub_fetch(&stream_buffers_allocated, 1, __ATOMIC_RELAXED);
+	size_t bytes = __atomic_sub_fetch(&stream_bytes_allocated, shared->size, __ATOMIC_RELAXED);
+	debug("[buffer %p] buffer freed (%zu buffers, %zu bytes)", shared, buffers, bytes);
+	
+	pool_free(shared->allocation);
+	pool_free(shared);
+	
+	uint32_t paused = 1;
+	if ( stream_budget_usage(stream, stream_bytes) <= server->stream_budget - server->stream_budget / 4 && __atomic_load_n(&stream->source_paused, __ATOMIC_RELAXED)
+		&& __atomic_compare_exchange_n(&stream->source_paused, &paused, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ) {
+		stream_ref(stream);
+		worker_post_message(&server->workers[stream->source_worker_index], (worker_message_t){
+			.type = WORKER_MESSAGE_RESUME_SOURCE, .stream = stream
+		});
+	}
+}
+
+/**
+ * Returns the variant of a cluster without its discardable video blocks or the cluster
+ * itself if there is nothing to drop. The first viewer that needs it builds it, all
+ * viewers on all workers share it. If viewers on two workers build it at the same time
+ * the one that loses throws its variant away.
+ */
+static shared_buffer_p shared_buffer_reduced(server_p server, shared_buffer_p cluster) {
+	shared_buffer_p reduced = __atomic_load_n(&cluster->reduced, __ATOMIC_ACQUIRE);
+	if (reduced)
+		return reduced;
+	
+	char* cluster_ptr = (char*)cluster->allocation + HTTP_CHUNK_HEADROOM;
+	size_t cluster_size = (cluster->ptr + cluster->size - 2) - cluster_ptr;
+	size_t chunk_size = 0;
+	char* chunk_ptr = streamer_reduce_cluster(cluster_ptr, cluster_size, &chunk_size);
+	reduced = (chunk_ptr) ? shared_buffer_new_http_chunk(chunk_ptr, chunk_size, 1, cluster->stream) : cluster;
+	debug("[buffer %p] built reduced variant (%zu of %zu bytes)", cluster, reduced->size, cluster->size);
+	
+	shared_buffer_p existing = NULL;
+	if ( !__atomic_compare_exchange_n(&cluster->reduced, &existing, reduced, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ) {
+		if (reduced != cluster)
+			shared_buffer_unref(server, reduced);
+		reduced = existing;
+	}
+	
+	return reduced;
+}
+
+
+//
+// Stream management, also used by the server
+//
+
+void stream_ref(stream_p stream) {
+	__atomic_add_fetch(&stream->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Frees the stream when the last reference is gone. By then each worker has to have
+ * released its feed (see WORKER_MESSAGE_DELETE_STREAM and stream_release_feed()).
+ */
+void stream_unref(stream_p stream) {
+	if ( __atomic_sub_fetch(&stream->refcount, 1, __ATOMIC_ACQ_REL) != 0 )
+		return;
+	
+	free(stream->header.ptr);
+	array_destroy(stream->intro_clusters);
+	pthread_mutex_destroy(&stream->lock);
+	free(stream);
+}
+
+/**
+ * Releases all clusters in the ring of this workers feed and the viewer sets. The
+ * viewers have to be disconnected before that.
+ */
+void stream_release_feed(server_p server, stream_p stream) {
+	stream_feed_p feed = &stream->feeds[server->worker_index];
+	while (feed->first_seq < feed->next_seq)
+		stream_feed_release_oldest(server, feed);
+	array_destroy(feed->viewers);
+	array_destroy(feed->stalled_viewers);
+}
+
+/**
+ * Returns the ring slot of the cluster the client is currently sending or NULL if the
+ * client isn't sending a cluster of the ring (e.g. it's still sending its intro).
+ */
+stream_buffer_p stream_buffer_of_viewer(server_p server, client_p client) {
+	if ( !(client->flags & CLIENT_IS_VIEWER) || client->intro_clusters != NULL )
+		return NULL;
+	
+	stream_feed_p feed = &client->stream->feeds[server->worker_index];
+	if (client->cursor < feed->first_seq || client->cursor >= feed->next_seq)
+		return NULL;
+	return stream_feed_buffer(feed, client->cursor);
+}
+
+//
+// The intro of a stream: the clusters since the last keyframe. Viewers send them straight
+// from the shared cluster buffers, only the cluster header of a trimmed first cluster
+// goes into the join bundle.
+//
+
+/**
+ * Writes the start of the first intro cluster if it has to be trimmed to the keyframe:
+ * The HTTP chunk header, a cluster header and the timecode element. The rest of the chunk
+ * is the tail of the cluster in its shared buffer (including the CRLF). `dest` needs
+ * room for 64 bytes. Returns the number of bytes written. Call with the stream locked.
+ */
+static size_t stream_intro_prefix(stream_p stream, char* dest) {
+	if (stream->intro_clusters->length == 0 || stream->intro_tail_size == 0)
+		return 0;
+	
+	size_t timecode_bytes = ebml_unencoded_uint_required_bytes(stream->intro_timecode);
+	uint64_t cluster_data_size = 2 + timecode_bytes + stream->intro_tail_size;
+	size_t size = sprintf(dest, "%zx\r\n", (size_t)(4 + 8 + cluster_data_size));
+	
+	uint8_t* p = (uint8_t*)dest + size;
+	streamer_write_uint(p, MKV_Cluster, 4);
+	p += 4;
+	*p++ = 0x01;
+	streamer_write_uint(p, cluster_data_size, 7);
+	p += 7;
+	*p++ = MKV_Timecode;
+	*p++ = 0x80 | timecode_bytes;
+	streamer_write_uint(p, stream->intro_timecode, timecode_bytes);
+	p += timecode_bytes;
+	
+	return p - (uint8_t*)dest;
+}
+
+/**
+ * Drops the references of the stream to its intro clusters. Call with the stream locked.
+ */
+static void stream_release_intro_clusters(server_p server, stream_p stream) {
+	__atomic_store_n(&stream->intro_bytes, 0, __ATOMIC_RELAXED);
+	for(size_t i = 0; i < stream->intro_clusters->length; i++)
+		shared_buffer_unref(server, array_elem(stream->intro_clusters, shared_buffer_p, i));
+	array_resize(stream->intro_clusters, 0);
+	stream_release_join_bundle(server, stream);
+}
+
+/**
+ * Drops the reference of the stream to its join bundle, viewers still sending it keep
+ * theirs. Call with the stream locked.
+ */
+static void stream_release_join_bundle(server_p server, stream_p stream) {
+	if (stream->join_bundle == NULL)
+		return;
+	
+	shared_buffer_unref(server, stream->join_bundle);
+	stream->join_bundle = NULL;
+}
+
+/**
+ * Returns the join bundle of the stream and builds it if necessary. It contains the HTTP
+ * response header, the WebM header and the start of a trimmed first intro cluster (see
+ * stream_intro_prefix()), the last join_prefix_size bytes. So it only changes with the
+ * header and with each keyframe. Call with the stream locked.
+ */
+static shared_buffer_p stream_join_bundle(stream_p stream) {
+	if (stream->join_bundle)
+		return stream->join_bundle;
+	
+	size_t response_header_size = strlen(STREAM_RESPONSE_HEADER);
+	char intro_prefix[64];
+	size_t intro_prefix_size = stream_intro_prefix(stream, intro_prefix);
+	size_t size = response_header_size + stream->header.size + intro_prefix_size;
+	
+	// Viewers that switch from another stream end their previous response with the last
+	// chunk in front of the bundle, see enter_send_stream
+	char* allocation = pool_alloc(strlen(STREAM_LAST_CHUNK) + size);
+	memcpy(allocation, STREAM_LAST_CHUNK, strlen(STREAM_LAST_CHUNK));
+	char* ptr = allocation + strlen(STREAM_LAST_CHUNK);
+	char* pos = ptr;
+	memcpy(pos, STREAM_RESPONSE_HEADER, response_header_size);
+	pos += response_header_size;
+	if (stream->header.size > 0)
+		memcpy(pos, stream->header.ptr, stream->header.size);
+	pos += stream->header.size;
+	memcpy(pos, intro_prefix, intro_prefix_size);
+	
+	stream->join_bundle = shared_buffer_new(allocation, ptr, size, 1, stream);
+	stream->join_prefix_size = intro_prefix_size;
+	debug("[stream %s] built join bundle (%zu bytes)", stream->name, size);
+	return stream->join_bundle;
+}
+
+/**
+ * Drops the intro of a stream that is deleted, called by each worker before it releases
+ * its feed.
+ */
+void stream_release_intro(server_p server, stream_p stream) {
+	pthread_mutex_lock(&stream->lock);
+		stream_release_intro_clusters(server, stream);
+	pthread_mutex_unlock(&stream->lock);
+}
+
+/**
+ * Starts to send the current intro of the stream to the viewer. New viewers (`join` is
+ * true) start with the join bundle of the stream, they just take a reference to it. The
+ * viewer takes a reference to each intro cluster and continues with the first cluster
+ * after them.
+ * 
+ * Lagging viewers skip ahead to the intro. They only need the end of the join bundle
+ * if the first cluster is trimmed. That's only done if the intro starts after the viewers
+ * cursor, otherwise the timecodes would go back. Returns false if that's not possible.
+ */
+static bool stream_viewer_start_intro(server_p server, client_p client, bool join) {
+	stream_p stream = client->stream;
+	
+	// The streamer might update the header and the intro on another worker. The sequence
+	// number tells us which clusters are already part of the intro.
+	pthread_mutex_lock(&stream->lock);
+		// A fragment cluster the source still appends to (low latency mode) is always the
+		// last intro cluster. The viewer sends it from the ring as it grows.
+		size_t intro_length = stream->intro_clusters->length;
+		bool fragment_open = intro_length > 0 && __atomic_load_n(&array_elem(stream->intro_clusters, shared_buffer_p, intro_length - 1)->open, __ATOMIC_ACQUIRE);
+		if (fragment_open)
+			intro_length--;
+		
+		if ( !join && !(intro_length > 0 && stream->intro_seq > client->cursor) ) {
+			pthread_mutex_unlock(&stream->lock);
+			return false;
+		}
+		
+		client->join_buffer = NULL;
+		if (join || stream->intro_tail_size > 0) {
+			client->join_buffer = stream_join_bundle(stream);
+			shared_buffer_ref(client->join_buffer);
+			size_t skipped = (join) ? 0 : client->join_buffer->size - stream->join_prefix_size;
+			client->buffer.ptr  = client->join_buffer->ptr + skipped;
+			client->buffer.size = client->join_buffer->size - skipped;
+		}
+		
+		client->intro_clusters = array_of(shared_buffer_p);
+		for(size_t i = 0; i < intro_length; i++) {
+			shared_buffer_p cluster = array_elem(stream->intro_clusters, shared_buffer_p, i);
+			shared_buffer_ref(cluster);
+			array_append(client->intro_clusters, shared_buffer_p, cluster);
+		}
+		client->intro_index = 0;
+		client->intro_tail_size = stream->intro_tail_size;
+		
+		client->cursor = (fragment_open) ? stream->cluster_seq : stream->cluster_seq + 1;
+		client->cursor_offset = 0;
+	pthread_mutex_unlock(&stream->lock);
+	
+	// Without the join bundle start with the first intro cluster right away
+	if (client->join_buffer == NULL)
+		stream_viewer_next_intro_buffer(server, client);
+	return true;
+}
+
+/**
+ * Returns the part of the intro cluster at `index` the viewer has to send.
+ */
+static struct iovec stream_viewer_intro_iovec(client_p client, size_t index) {
+	shared_buffer_p cluster = array_elem(client->intro_clusters, shared_buffer_p, index);
+	if (index == 0 && client->intro_tail_size > 0) {
+		// The join bundle ended with the start of the trimmed first cluster, the chunk
+		// ends with its tail and the CRLF
+		size_t size = client->intro_tail_size + 2;
+		return (struct iovec){ cluster->ptr + cluster->size - size, size };
+	}
+	return (struct iovec){ cluster->ptr, cluster->size };
+}
+
+/**
+ * Points the buffer of the viewer to the intro cluster at intro_index. When all of them
+ * are sent the intro is released and false is returned.
+ */
+static bool stream_viewer_next_intro_buffer(server_p server, client_p client) {
+	if (client->intro_clusters == NULL)
+		return false;
+	
+	if (client->intro_index < client->intro_clusters->length) {
+		struct iovec iov = stream_viewer_intro_iovec(client, client->intro_index);
+		client->buffer.ptr  = iov.iov_base;
+		client->buffer.size = iov.iov_len;
 		return true;
 	}
 	
-	debug("[buffer %p] buffer unrefed (count %zu)", stream_buffer, stream_buffer->refcount);
+	stream_viewer_release_intro(server, client);
 	return false;
 }
 
+/**
+ * Fills `iov` with the rest of the viewers buffer. While sending the join bundle or the
+ * intro the intro clusters after it follow. Returns the number of entries used.
+ */
+static size_t stream_viewer_iovecs(client_p client, struct iovec* iov, size_t iov_capacity) {
+	size_t count = 0;
+	iov[count++] = (struct iovec){ client->buffer.ptr, client->buffer.size };
+	
+	if (client->intro_clusters) {
+		size_t index = (client->join_buffer) ? client->intro_index : client->intro_index + 1;
+		for(; index < client->intro_clusters->length && count < iov_capacity; index++)
+			iov[count++] = stream_viewer_intro_iovec(client, index);
+	}
+	
+	return count;
+}
+
+/**
+ * Moves on after the viewer finished its current buffer. Either it was the join bundle,
+ * an intro cluster or the cluster at the cursor.
+ */
+static void stream_viewer_finish_buffer(server_p server, client_p client) {
+	if (client->join_buffer) {
+		shared_buffer_unref(server, client->join_buffer);
+		client->join_buffer = NULL;
+	} else if (client->intro_clusters) {
+		client->intro_index++;
+	} else {
+		// The cluster is released when the last viewer is done, see stream_feed_release_oldest().
+		// A fragment cluster is only done when the source closed it and we sent all of it.
+		stream_feed_p feed = &client->stream->feeds[server->worker_index];
+		if (client->cursor >= feed->first_seq && client->cursor < feed->next_seq) {
+			stream_buffer_p stream_buffer = stream_feed_buffer(feed, client->cursor);
+			if (stream_buffer->open || client->cursor_offset < stream_buffer->size)
+				return;
+			
+			usec_t now = time_now();
+			if (stream_buffer->last_written_at == 0)
+				record_latency(&feed->first_write_latency, __atomic_load_n(&stream_buffer->shared->received_at, __ATOMIC_RELAXED), now);
+			stream_buffer->last_written_at = now;
+		} else if (client->cursor_buffer == NULL) {
+			// The ring wrapped around us before we started with the cluster at the cursor,
+			// send_stream skips ahead
+			return;
+		}
+		stream_viewer_hold_cluster(server, client, NULL);
+		client->cursor++;
+		client->cursor_offset = 0;
+	}
+}
+
+/**
+ * Returns true if the viewer sent everything there is: All clusters in the ring of its
+ * feed or all blocks of a fragment cluster the source still appends to.
+ */
+static bool stream_viewer_caught_up(stream_feed_p feed, client_p client) {
+	if (client->cursor >= feed->next_seq)
+		return true;
+	if (client->cursor < feed->first_seq)
+		return false;
+	
+	stream_buffer_p stream_buffer = stream_feed_buffer(feed, client->cursor);
+	return stream_buffer->open && client->cursor_offset == stream_buffer->size;
+}
+
+/**
+ * Advances the buffer of the viewer by the bytes written with the iovecs of
+ * stream_viewer_iovecs(). Bytes beyond the current buffer went into the next intro
+ * clusters. If the current buffer is finished exactly its size is left at 0.
+ */
+static void stream_viewer_advance(server_p server, client_p client, size_t bytes_written) {
+	metric_add(&client->stream->feeds[server->worker_index].fanout_bytes, bytes_written);
+	
+	while (bytes_written > client->buffer.size) {
+		bytes_written -= client->buffer.size;
+		stream_viewer_finish_buffer(server, client);
+		stream_viewer_next_intro_buffer(server, client);
+	}
+	
+	client->buffer.ptr  += bytes_written;
+	client->buffer.size -= bytes_written;
+}
+
+/**
+ * Records how long it took a viewer from joining until it continues with the clusters in
+ * the ring. Called each time it gets a cluster from the ring but only the first one counts.
+ */
+static void stream_viewer_record_join(stream_feed_p feed, client_p client) {
+	if (client->joined_at == 0)
+		return;
+	
+	record_latency(&feed->join_latency, client->joined_at, time_now());
+	client->joined_at = 0;
+}
+
+static void stream_viewer_release_intro(server_p server, client_p client) {
+	if (client->join_buffer) {
+		shared_buffer_unref(server, client->join_buffer);
+		client->join_buffer = NULL;
+	}
+	
+	if (client->intro_clusters == NULL)
+		return;
+	
+	for(size_t i = 0; i < client->intro_clusters->length; i++)
+		shared_buffer_unref(server, array_elem(client->intro_clusters, shared_buffer_p, i));
+	array_destroy(client->intro_clusters);
+	client->intro_clusters = NULL;
+}
+
+/**
+ * Replaces the reference the viewer holds to the cluster at its cursor (NULL releases it).
+ * The reduced variant of the cluster is freed along with it.
+ */
+static void stream_viewer_hold_cluster(server_p server, client_p client, shared_buffer_p cluster) {
+	if (client->cursor_buffer == cluster)
+		return;
+	
+	if (cluster)
+		shared_buffer_ref(cluster);
+	if (client->cursor_buffer)
+		shared_buffer_unref(server, client->cursor_buffer);
+	client->cursor_buffer = cluster;
+}
+
+/**
+ * Returns true if the viewer finished an HTTP chunk with its last buffer. The join bundle
+ * of an intro with a trimmed first cluster ends in the middle of a chunk, the tail of the
+ * first intro cluster completes it.
+ */
+static bool stream_viewer_at_chunk_boundary(client_p client) {
+	if (client->join_buffer != NULL)
+		return false;
+	return !(client->intro_clusters != NULL && client->intro_index == 0 && client->intro_tail_size > 0);
+}
+
+/**
+ * Removes a keep-alive viewer from its stream when it sent its next request, e.g. for
+ * another stream (channel zapping). Call it only between two chunks (see
+ * stream_viewer_at_chunk_boundary()), the response to the next request then ends the
+ * stream response with the last chunk.
+ */
+static void stream_viewer_leave(server_p server, client_p client) {
+	stream_viewer_release_intro(server, client);
+	stream_viewer_hold_cluster(server, client, NULL);
+	stream_remove_stalled_viewer(server, client->stream, client);
+	stream_remove_viewer(server, client->stream, client);
+	stream_feed_release_unneeded(server, &client->stream->feeds[server->worker_index]);
+	client->stream = NULL;
+	client->buffer = (buffer_t){ NULL, 0, 0 };
+}
+
+//
+// Viewer sets of a stream feed. Each array contains the file descriptors of the clients.
+// A removed client is replaced by the last one in the array, so we have to update the
+// index of that one.
+//
+
+static void stream_add_viewer(server_p server, stream_p stream, int client_fd, client_p client) {
+	stream_feed_p feed = &stream->feeds[server->worker_index];
+	client->viewer_index = feed->viewers->length;
+	array_append(feed->viewers, int, client_fd);
+	client->flags |= CLIENT_IS_VIEWER;
+	__atomic_add_fetch(&stream->viewer_count, 1, __ATOMIC_RELAXED);
+	metric_add(&feed->viewer_joins, 1);
+}
+
+static void stream_remove_viewer(server_p server, stream_p stream, client_p client) {
+	if ( !(client->flags & CLIENT_IS_VIEWER) )
+		return;
+	
+	stream_feed_p feed = &stream->feeds[server->worker_index];
+	int last_fd = array_elem(feed->viewers, int, feed->viewers->length - 1);
+	array_elem(feed->viewers, int, client->viewer_index) = last_fd;
+	((client_p)hash_get_ptr(server->clients, last_fd))->viewer_index = client->viewer_index;
+	array_resize(feed->viewers, feed->viewers->length - 1);
+	
+	client->flags &= ~CLIENT_IS_VIEWER;
+	__atomic_sub_fetch(&stream->viewer_count, 1, __ATOMIC_RELAXED);
+	metric_add(&feed->viewer_leaves, 1);
+}
+
+static void stream_add_stalled_viewer(server_p server, stream_p stream, int client_fd, client_p client) {
+	stream_feed_p feed = &stream->feeds[server->worker_index];
+	client->stalled_index = feed->stalled_viewers->length;
+	array_append(feed->stalled_viewers, int, client_fd);
+	client->flags |= CLIENT_STALLED;
+	metric_add(&feed->viewer_stalls, 1);
+}
+
+static void stream_remove_stalled_viewer(server_p server, stream_p stream, client_p client) {
+	if ( !(client->flags & CLIENT_STALLED) )
+		return;
+	
+	stream_feed_p feed = &stream->feeds[server->worker_index];
+	int last_fd = array_elem(feed->stalled_viewers, int, feed->stalled_viewers->length - 1);
+	array_elem(feed->stalled_viewers, int, client->stalled_index) = last_fd;
+	((client_p)hash_get_ptr(server->clients, last_fd))->stalled_index = client->stalled_index;
+	array_resize(feed->stalled_viewers, feed->stalled_viewers->length - 1);
+	
+	client->flags &= ~CLIENT_STALLED;
+}
+
+/**
+ * Puts a new cluster into the ring of this workers feed and unstalls all viewers
+ * waiting for it. Takes over one reference of the cluster. Viewers that already got the
+ * cluster as part of their intro cluster have a cursor past it and don't see it.
+ */
+void stream_deliver_cluster(server_p server, stream_p stream, shared_buffer_p cluster, uint64_t cluster_seq, bool starts_with_keyframe) {
+	stream_feed_p feed = &stream->feeds[server->worker_index];
+	feed->latest_cluster_received_at = time_now();
+	
+	// The source closed the previous fragment cluster before it started this one. Viewers
+	// that didn't get its last blocks yet have to continue before we release it.
+	stream_feed_update_fragment(server, feed);
+	stream_feed_unstall_viewers(server, stream, feed);
+	stream_feed_release_unneeded(server, feed);
+	
+	// A fragment cluster is kept without viewers, those joining later continue with it
+	if (feed->viewers->length == 0 && !__atomic_load_n(&cluster->open, __ATOMIC_ACQUIRE)) {
+		shared_buffer_unref(server, cluster);
+		feed->first_seq = feed->next_seq = cluster_seq + 1;
+		return;
+	}
+	
+	// Sequence numbers are consecutive except when the ring was empty. Then start with
+	// the new cluster.
+	if (feed->first_seq == feed->next_seq)
+		feed->first_seq = feed->next_seq = cluster_seq;
+	if (feed->next_seq - feed->first_seq >= STREAM_FEED_CAPACITY)
+		stream_feed_release_oldest(server, feed);
+	
+	stream_buffer_p stream_buffer = stream_feed_buffer(feed, cluster_seq);
+	stream_buffer_new(stream_buffer, cluster);
+	feed->next_seq = cluster_seq + 1;
+	if (starts_with_keyframe)
+		feed->keyframe_seq = cluster_seq;
+	
+	// Over budget: evict the oldest clusters, that cuts off the slowest viewers. All workers
+	// evict their oldest clusters, so the same ones are freed everywhere. Evict two per new
+	// cluster so we get below the budget again.
+	for(size_t i = 0; i < 2 && feed->first_seq < cluster_seq && stream_should_evict(server, stream); i++) {
+		info("[stream %s] over budget (%zu bytes buffered), evicting cluster %lu", stream->name, __atomic_load_n(&stream->buffered_bytes, __ATOMIC_RELAXED), feed->first_seq);
+		stream_feed_release_oldest(server, feed);
+	}
+	
+	// Register the buffer with io_uring so the writes of all viewers can use it as a
+	// fixed buffer. If the buffer table is full we just do normal writes. A fragment
+	// cluster still grows beyond what we could register now.
+	if (server->uring && feed->viewers->length > 1 && !stream_buffer->open)
+		stream_buffer->registered_index = uring_buffer_register(server->uring, stream_buffer->ptr, stream_buffer->size);
+	
+	stream_feed_unstall_viewers(server, stream, feed);
+}
+
+/**
+ * Lets the viewers of this worker send the blocks the source appended to its fragment
+ * cluster (low latency mode, see WORKER_MESSAGE_BLOCKS).
+ */
+void stream_deliver_blocks(server_p server, stream_p stream) {
+	stream_feed_p feed = &stream->feeds[server->worker_index];
+	feed->latest_cluster_received_at = time_now();
+	
+	stream_feed_update_fragment(server, feed);
+	stream_feed_unstall_viewers(server, stream, feed);
+}
+
+/**
+ * Continues all stalled viewers that have something to send again. Go backwards since
+ * unstalled viewers are removed from the array (the last one takes their place).
+ */
+static void stream_feed_unstall_viewers(server_p server, stream_p stream, stream_feed_p feed) {
+	for(size_t i = feed->stalled_viewers->length; i > 0; i--) {
+		int viewer_fd = array_elem(feed->stalled_viewers, int, i - 1);
+		client_p viewer = hash_get_ptr(server->clients, viewer_fd);
+		if ( stream_viewer_caught_up(feed, viewer) )
+			continue;
+		
+		// The ring might have wrapped around a viewer that waited for its socket for too
+		// long. It has nothing to send then and skips ahead in send_stream.
+		stream_remove_stalled_viewer(server, stream, viewer);
+		if (viewer->cursor >= feed->first_seq) {
+			stream_buffer_p stream_buffer = stream_feed_buffer(feed, viewer->cursor);
+			viewer->buffer.ptr  = stream_buffer->ptr + viewer->cursor_offset;
+			viewer->buffer.size = stream_buffer->size - viewer->cursor_offset;
+			viewer->cursor_offset = stream_buffer->size;
+			stream_viewer_hold_cluster(server, viewer, stream_buffer->shared);
+			stream_viewer_record_join(feed, viewer);
+		}
+		viewer->flags |= CLIENT_POLL_FOR_WRITE;
+		array_append(server->clients_with_changed_flags, int, viewer_fd);
+		debug("[stream %s] unstalled client %d", stream->name, viewer_fd);
+	}
+}
+
+
+//
+// Status information. The JSON is cached and rebuilt at most every STATUS_JSON_MAX_AGE so
+// clients polling it don't walk all streams on each request.
+//
+
+// The current status JSON and the version of the streams dict, both protected by the
+// streams lock. The cache holds one reference to the status JSON.
+static status_json_p status_json_cache = NULL;
+uint32_t streams_version = 0;
+
+/**
+ * Returns a reference to the current status JSON. It's rebuilt when it's too old or the
+ * streams changed since (see streams_version), otherwise all clients on all workers get
+ * the same one.
+ */
+static status_json_p status_json_current(server_p server) {
+	pthread_mutex_lock(server->streams_lock);
+		status_json_p status_json = status_json_cache;
+		usec_t now = time_now();
+		if ( status_json == NULL || status_json->version != streams_version
+			|| now - status_json->built_at >= STATUS_JSON_MAX_AGE || now < status_json->built_at ) {
+			status_json = status_json_build(server, now);
+			if (status_json_cache)
+				status_json_unref(status_json_cache);
+			status_json_cache = status_json;
+		}
+		status_json_ref(status_json);
+	pthread_mutex_unlock(server->streams_lock);
+	
+	return status_json;
+}
+
+/**
+ * Builds the status JSON of all streams. Has to be called with the streams lock held.
+ */
+static status_json_p status_json_build(server_p server, usec_t now) {
+	status_json_p status_json = malloc(sizeof(status_json_t));
+	status_json->refcount = 1;
+	status_json->version = streams_version;
+	status_json->built_at = now;
+	status_json->body = NULL;
+	status_json->size = 0;
+	
+	FILE* json = open_memstream(&status_json->body, &status_json->size);
+		void add(char* text) { fwrite(text, strlen(text), 1, json); }
+		
+		add("{\n");
+		
+		bool first1 = true;
+		for(dict_elem_t e = dict_start(server->streams); e != NULL; e = dict_next(server->streams, e)) {
+			if (first1) {
+				first1 = false;
+			} else {
+				add(",\n");
+			}
+			
+			const char* path = dict_key(e);
+			stream_p stream = dict_value(e, stream_p);
+			
+			// Escaped strings are added on their own, they can be as large as the buffer
+			char buffer[512], buffer_escaped[512];
+			add("\t\"");
+			json_escape(path, buffer_escaped, sizeof(buffer_escaped));
+			add(buffer_escaped);
+			add("\": {\n");
+			
+			// Viewers of all workers are counted by the stream itself
+			uint32_t watch_count = __atomic_load_n(&stream->viewer_count, __ATOMIC_RELAXED);
+			snprintf(buffer, sizeof(buffer), "\t\t\"viewers\": \"%u\"", watch_count);
+			add(buffer);
+			
+			// Memory used by the clusters of the stream and its budget (0 for no limit)
+			size_t buffered_bytes = __atomic_load_n(&stream->buffered_bytes, __ATOMIC_RELAXED);
+			bool source_paused = __atomic_load_n(&stream->source_paused, __ATOMIC_RELAXED);
+			snprintf(buffer, sizeof(buffer), ",\n\t\t\"buffered_bytes\": \"%zu\",\n\t\t\"budget_bytes\": \"%zu\",\n\t\t\"source_paused\": \"%s\"",
+				buffered_bytes, server->stream_budget, source_paused ? "true" : "false");
+			add(buffer);
+			
+			for(dict_elem_t e = dict_start(stream->params); e != NULL; e = dict_next(stream->params, e)) {
+				add(",\n");
+				
+				add("\t\t\"");
+				json_escape(dict_key(e), buffer_escaped, sizeof(buffer_escaped));
+				add(buffer_escaped);
+				
+				// Params without a value show up as null
+				char* value = dict_value(e, char*);
+				if (value) {
+					add("\": \"");
+					json_escape(value, buffer_escaped, sizeof(buffer_escaped));
+					add(buffer_escaped);
+					add("\"");
+				} else {
+					add("\": null");
+				}
+			}
+			
+			add("\n\t}");
+		}
+		
+		add("\n}");
+	fclose(json);
+	
+	debug("[status] rebuilt status JSON (version %u, %zu bytes)", status_json->version, status_json->size);
+	return status_json;
+}
+
+static void status_json_ref(status_json_p status_json) {
+	__atomic_add_fetch(&status_json->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static void status_json_unref(status_json_p status_json) {
+	if ( __atomic_sub_fetch(&status_json->refcount, 1, __ATOMIC_ACQ_REL) != 0 )
+		return;
+	
+	free(status_json->body);
+	free(status_json);
+}
+
+/**
+ * Releases the reference of the cache. Called by the server on shutdown.
+ */
+void status_json_free_cache(server_p server) {
+	pthread_mutex_lock(server->streams_lock);
+		if (status_json_cache)
+			status_json_unref(status_json_cache);
+		status_json_cache = NULL;
+	pthread_mutex_unlock(server->streams_lock);
+}
+
+
+//
+// Metrics in the Prometheus text format. The counters are updated where things happen
+// (see metric_add()), here they're only summed up over all workers and formatted.
+//
+
+typedef enum {
+	STREAM_METRIC_VIEWERS,
+	STREAM_METRIC_INGEST_BYTES,
+	STREAM_METRIC_INGEST_CLUSTERS,
+	STREAM_METRIC_INGEST_KEYFRAMES,
+	STREAM_METRIC_INGEST_BITRATE,
+	STREAM_METRIC_BUFFERS,
+	STREAM_METRIC_BUFFERED_BYTES,
+	STREAM_METRIC_VIEWER_JOINS,
+	STREAM_METRIC_VIEWER_LEAVES,
+	STREAM_METRIC_VIEWER_STALLS,
+	STREAM_METRIC_VIEWER_LAG_SKIPS,
+	STREAM_METRIC_FANOUT_BYTES,
+	STREAM_METRIC_COUNT
+} stream_metric_t;
+
+static const struct { const char* name; const char* type; const char* help; } stream_metrics[STREAM_METRIC_COUNT] = {
+	[STREAM_METRIC_VIEWERS]                = { "smeb_stream_viewers",                      "gauge",   "Viewers currently connected" },
+	[STREAM_METRIC_INGEST_BYTES]           = { "smeb_stream_ingest_bytes_total",           "counter", "Bytes of the clusters received from the source" },
+	[STREAM_METRIC_INGEST_CLUSTERS]        = { "smeb_stream_ingest_clusters_total",        "counter", "Clusters received from the source (blocks in low latency mode)" },
+	[STREAM_METRIC_INGEST_KEYFRAMES]       = { "smeb_stream_ingest_keyframes_total",       "counter", "Received clusters that contain a video keyframe" },
+	[STREAM_METRIC_INGEST_BITRATE]         = { "smeb_stream_ingest_bits_per_second",       "gauge",   "Bitrate of the source over the last second" },
+	[STREAM_METRIC_BUFFERS]                = { "smeb_stream_buffers",                      "gauge",   "Clusters still held by any worker" },
+	[STREAM_METRIC_BUFFERED_BYTES]         = { "smeb_stream_buffered_bytes",               "gauge",   "Bytes of the clusters still held by any worker" },
+	[STREAM_METRIC_VIEWER_JOINS]           = { "smeb_stream_viewer_joins_total",           "counter", "Viewers that started watching" },
+	[STREAM_METRIC_VIEWER_LEAVES]          = { "smeb_stream_viewer_leaves_total",          "counter", "Viewers that stopped watching" },
+	[STREAM_METRIC_VIEWER_STALLS]          = { "smeb_stream_viewer_stalls_total",          "counter", "Times a viewer sent all clusters and waited for the next one" },
+	[STREAM_METRIC_VIEWER_LAG_SKIPS]       = { "smeb_stream_viewer_lag_skips_total",       "counter", "Times a lagging viewer skipped ahead" },
+	[STREAM_METRIC_FANOUT_BYTES]           = { "smeb_stream_fanout_bytes_total",           "counter", "Bytes sent to viewers" }
+};
+
+static const struct { const char* name; const char* help; size_t offset; } stream_histograms[] = {
+	{ "smeb_stream_first_write_latency_seconds", "Time from the source sending a cluster until the first viewer of a worker wrote all of it", offsetof(stream_feed_t, first_write_latency) },
+	{ "smeb_stream_last_write_latency_seconds",  "Time from the source sending a cluster until the last viewer of a worker wrote all of it",  offsetof(stream_feed_t, last_write_latency) },
+	{ "smeb_stream_join_to_live_seconds",        "Time from a viewer joining until it continues with new clusters (after the intro)",         offsetof(stream_feed_t, join_latency) }
+};
+
+/**
+ * Records the latency between `start` and `end` in usec. Clusters without a start time
+ * aren't recorded, latencies from a clock that jumped back are recorded as 0.
+ */
+static void record_latency(histogram_p histogram, usec_t start, usec_t end) {
+	if (start != 0)
+		histogram_record(histogram, (end > start) ? end - start : 0);
+}
+
+/**
+ * Returns the current value of a metric of the stream. Counters of the viewers are summed
+ * up over the feeds of all workers.
+ */
+static uint64_t stream_metric_value(server_p server, stream_p stream, stream_metric_t metric) {
+	switch (metric) {
+		case STREAM_METRIC_VIEWERS:          return __atomic_load_n(&stream->viewer_count, __ATOMIC_RELAXED);
+		case STREAM_METRIC_INGEST_BYTES:     return __atomic_load_n(&stream->ingest_bytes, __ATOMIC_RELAXED);
+		case STREAM_METRIC_INGEST_CLUSTERS:  return __atomic_load_n(&stream->ingest_clusters, __ATOMIC_RELAXED);
+		case STREAM_METRIC_INGEST_KEYFRAMES: return __atomic_load_n(&stream->ingest_keyframes, __ATOMIC_RELAXED);
+		case STREAM_METRIC_BUFFERS:          return __atomic_load_n(&stream->buffer_count, __ATOMIC_RELAXED);
+		case STREAM_METRIC_BUFFERED_BYTES:   return __atomic_load_n(&stream->buffered_bytes, __ATOMIC_RELAXED);
+		case STREAM_METRIC_INGEST_BITRATE: {
+			// The bitrate of a source that stopped sending is outdated
+			usec_t interval_start = __atomic_load_n(&stream->ingest_interval_start, __ATOMIC_RELAXED);
+			if (time_now() - interval_start > 2 * STREAM_BITRATE_INTERVAL)
+				return 0;
+			return __atomic_load_n(&stream->ingest_bitrate, __ATOMIC_RELAXED);
+		}
+		default:
+			break;
+	}
+	
+	uint64_t sum = 0;
+	for(size_t i = 0; i < server->worker_count; i++) {
+		stream_feed_p feed = &stream->feeds[i];
+		uint64_t* counter = NULL;
+		switch (metric) {
+			case STREAM_METRIC_VIEWER_JOINS:           counter = &feed->viewer_joins;           break;
+			case STREAM_METRIC_VIEWER_LEAVES:          counter = &feed->viewer_leaves;          break;
+			case STREAM_METRIC_VIEWER_STALLS:          counter = &feed->viewer_stalls;          break;
+			case STREAM_METRIC_VIEWER_LAG_SKIPS:       counter = &feed->viewer_lag_skips;       break;
+			case STREAM_METRIC_FANOUT_BYTES:           counter = &feed->fanout_bytes;           break;
+			default:                                   return 0;
+		}
+		sum += __atomic_load_n(counter, __ATOMIC_RELAXED);
+	}
+	
+	return sum;
+}
+
+/**
+ * Escapes a label value of the Prometheus text format (backslash, double quote and line
+ * break).
+ */
+static void metrics_escape_label(const char *src, char* dest, size_t dest_size) {
+	char* p = dest;
+	while(*src != '\0' && (dest_size - (p - dest)) > 2) {
+		if (*src == '"' || *src == '\\') {
+			*p++ = '\\';
+			*p++ = *src++;
+		} else if (*src == '\n') {
+			*p++ = '\\';
+			*p++ = 'n';
+			src++;
+		} else {
+			*p++ = *src++;
+		}
+	}
+	
+	*p = '\0';
+}
+
+/**
+ * Formats the metrics of all streams and the global ones. Returns a malloc()ed buffer and
+ * its size. Samples of one metric have to be grouped together, so we go over the streams
+ * once for each metric.
+ */
+static char* metrics_build(server_p server, size_t* size) {
+	char* body = NULL;
+	FILE* out = open_memstream(&body, size);
+	
+	pthread_mutex_lock(server->streams_lock);
+	for(stream_metric_t metric = 0; metric < STREAM_METRIC_COUNT; metric++) {
+		fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", stream_metrics[metric].name, stream_metrics[metric].help,
+			stream_metrics[metric].name, stream_metrics[metric].type);
+		
+		for(dict_elem_t e = dict_start(server->streams); e != NULL; e = dict_next(server->streams, e)) {
+			char label[512];
+			metrics_escape_label(dict_key(e), label, sizeof(label));
+			fprintf(out, "%s{stream=\"%s\"} %lu\n", stream_metrics[metric].name, label,
+				stream_metric_value(server, dict_value(e, stream_p), metric));
+		}
+	}
+	
+	// The latency histograms of all workers are merged, the buckets of the Prometheus format
+	// are cumulative and in seconds
+	for(size_t h = 0; h < sizeof(stream_histograms) / sizeof(stream_histograms[0]); h++) {
+		const char* name = stream_histograms[h].name;
+		fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, stream_histograms[h].help, name);
+		
+		for(dict_elem_t e = dict_start(server->streams); e != NULL; e = dict_next(server->streams, e)) {
+			stream_p stream = dict_value(e, stream_p);
+			histogram_t histogram;
+			memset(&histogram, 0, sizeof(histogram));
+			for(size_t i = 0; i < server->worker_count; i++)
+				histogram_merge(&histogram, (histogram_p)((char*)&stream->feeds[i] + stream_histograms[h].offset));
+			
+			char label[512];
+			metrics_escape_label(dict_key(e), label, sizeof(label));
+			uint64_t cumulative_count = 0;
+			for(size_t i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+				cumulative_count += histogram.counts[i];
+				fprintf(out, "%s_bucket{stream=\"%s\",le=\"%.6f\"} %lu\n", name, label, histogram_bucket_limit(i) / 1000000.0, cumulative_count);
+			}
+			fprintf(out, "%s_bucket{stream=\"%s\",le=\"+Inf\"} %lu\n", name, label, histogram.count);
+			fprintf(out, "%s_sum{stream=\"%s\"} %.6f\n", name, label, histogram.sum / 1000000.0);
+			fprintf(out, "%s_count{stream=\"%s\"} %lu\n", name, label, histogram.count);
+		}
+	}
+	pthread_mutex_unlock(server->streams_lock);
+	
+	fprintf(out, "# HELP smeb_buffers_allocated Clusters held by any worker\n# TYPE smeb_buffers_allocated gauge\n");
+	fprintf(out, "smeb_buffers_allocated %zu\n", __atomic_load_n(&stream_buffers_allocated, __ATOMIC_RELAXED));
+	fprintf(out, "# HELP smeb_buffer_bytes_allocated Bytes of the clusters held by any worker\n# TYPE smeb_buffer_bytes_allocated gauge\n");
+	fprintf(out, "smeb_buffer_bytes_allocated %zu\n", __atomic_load_n(&stream_bytes_allocated, __ATOMIC_RELAXED));
+	
+	fclose(out);
+	return body;
+}
 
 
 /**
@@ -6,5 +6,24 @@
 #define CLIENT_CON_WRITABLE (1 << 1)
 #define CLIENT_CON_CLEANUP  (1 << 2)
 
+// Clusters and their bytes held by any worker, only use atomic operations on them
+extern size_t stream_buffers_allocated, stream_bytes_allocated;
+// Incremented when a stream is added to or removed from the streams dict or gets new
+// params. Only access it with the streams lock held.
+extern uint32_t streams_version;
+
 int client_handlers_init();
-int client_handler(int client_fd, client_p client, server_p server, int flags);
\ No newline at end of file
+int client_handler(int client_fd, client_p client, server_p server, int flags);
+
+void shared_buffer_ref(shared_buffer_p shared);
+void shared_buffer_unref(server_p server, shared_buffer_p shared);
+
+void stream_ref(stream_p stream);
+void stream_unref(stream_p stream);
+void stream_release_feed(server_p server, stream_p stream);
+void stream_release_intro(server_p server, stream_p stream);
+void stream_deliver_cluster(server_p server, stream_p stream, shared_buffer_p cluster, uint64_t cluster_seq, bool starts_with_keyframe);
+void stream_deliver_blocks(server_p server, stream_p stream);
+stream_buffer_p stream_buffer_of_viewer(server_p server, client_p client);
+void stream_resume_source(server_p server, stream_p stream);
+void status_json_free_cache(server_p server);
@@ -1,11 +1,18 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <pthread.h>
 #include "timer.h"
 #include "hash.h"
 #include "list.h"
+#include "array.h"
 #include "logger.h"
+#include "uring.h"
+#include "ebml_reader.h"
+#include "http_parser.h"
+#include "histogram.h"
 
 // Simple buffer to handle memory blocks
 typedef struct {
@@ -14,45 +21,188 @@ typedef struct {
 } buffer_t, *buffer_p;
 
 
-// A reference counted buffer for streaming data
+// Data shared between worker threads, e.g. a received cluster. Each worker holds one
+// reference, so do the intro of the stream and the viewers sending it. The refcount is
+// only modified with atomic operations. ptr points into the allocation since the HTTP
+// chunk header is written into headroom in front of the data.
+// The size is accounted to the budget of the stream until the last reference is gone.
+typedef struct shared_buffer_s {
+	size_t refcount;
+	char*  ptr;
+	size_t size;
+	void*  allocation;
+	struct stream_s* stream;
+	// When the source sent the cluster, 0 for other buffers
+	usec_t received_at;
+	// Variant of a cluster without its discardable video blocks, built when the first
+	// slow viewer needs it (see shared_buffer_reduced()). Points to the buffer itself if
+	// there is nothing to drop. Set atomically and freed along with the buffer.
+	struct shared_buffer_s* reduced;
+	// Set while the source still appends blocks to a fragment cluster (low latency mode,
+	// see streamer_append_block()). Until then its size grows. Both are modified
+	// atomically, the size is stored after the new data is written.
+	bool open;
+} shared_buffer_t, *shared_buffer_p;
+
+// Body of the status JSON, shared by all clients that request it until it's rebuilt (see
+// status_json_current()). The refcount is only modified with atomic operations.
+typedef struct {
+	size_t refcount;
+	// Value of streams_version the body was built from
+	uint32_t version;
+	usec_t   built_at;
+	char*    body;
+	size_t   size;
+} status_json_t, *status_json_p;
+
+// The status JSON is rebuilt when it's older than this (in usec). Streams that were added,
+// removed or got new params show up right away.
+#define STATUS_JSON_MAX_AGE  (250 * 1000LL)
+
+// Space reserved in front of a cluster for the HTTP chunk header. Enough for the hex
+// size of a size_t and a CRLF.
+#define HTTP_CHUNK_HEADROOM 18
+
+// Size of the buffer the HTTP request line and headers of a client are read into. Clients
+// with larger requests are disconnected.
+#define HTTP_REQUEST_BUFFER_SIZE (8 * 1024)
+
+// Initial size of a streamers client buffer, the number of bytes read into it at once and
+// the largest cluster we accept. The client buffer only holds the data between clusters,
+// clusters are read into their own buffer.
+#define STREAMER_BUFFER_SIZE      (64 * 1024)
+#define STREAMER_READ_SIZE        (4 * 1024)
+#define STREAMER_MAX_CLUSTER_SIZE (64 * 1024 * 1024)
+// Room for the blocks of a fragment cluster (low latency mode). When the next block
+// doesn't fit anymore a new fragment cluster is started.
+#define STREAMER_FRAGMENT_CLUSTER_SIZE (256 * 1024)
+
+// A cluster in the stream buffer ring of a stream feed. Only used by one worker thread.
+// ptr and size point into the shared buffer.
 typedef struct {
 	char*    ptr;
 	size_t   size;
-	size_t   refcount;
-	uint32_t flags;
 	usec_t   timecode;
+	// Index of the buffer in the io_uring buffer table or -1 if it isn't registered
+	int      registered_index;
+	// When the last viewer finished writing the cluster, 0 if none did yet
+	usec_t   last_written_at;
+	// A fragment cluster the source still appends to, size is updated as it grows (see
+	// stream_feed_update_fragment())
+	bool     open;
+	shared_buffer_p shared;
 } stream_buffer_t, *stream_buffer_p;
 
-// Don't free the stream buffers ptr when the refcount reaches 0. Used for
-// static string data and data that belongs to the stream (e.g. the video
-// header).
-#define STREAM_BUFFER_DONT_FREE_CONTENT   (1 << 0)
-// The stream buffers list node was created by the client itself and doesn't
-// belong to the streams buffer list. So they must not be removed from that list.
-#define STREAM_BUFFER_CLIENT_PRIVATE      (1 << 1)
+// Number of clusters a stream feed can hold. When a new cluster arrives and the ring is
+// full the oldest one is reclaimed. Viewers that still need it are cut off.
+#define STREAM_FEED_CAPACITY  64
+
+// Viewers lagging behind more than that skip ahead to the newest cluster that starts
+// with a keyframe. Can be changed per stream with the max_lag URL parameter (seconds).
+// Viewers lagging more than half of it get clusters without discardable video frames.
+#define STREAM_DEFAULT_MAX_LAG  (5 * 1000000LL)
+
+// Interval over which the bitrate of a source is measured
+#define STREAM_BITRATE_INTERVAL  (1 * 1000000LL)
 
+// The most clusters the intro of a stream holds. Streams with longer GOPs don't have an
+// intro until the next keyframe, new viewers start with the next cluster until then.
+#define STREAM_MAX_INTRO_CLUSTERS  STREAM_FEED_CAPACITY
 
-// A video stream, one client sends the video, many others receive it
+
+// The part of a stream that belongs to one worker thread. The stream buffers are
+// the clusters the viewers of that worker still have to send. It's a ring of the
+// clusters with the sequence numbers first_seq to next_seq - 1, cluster seq is
+// stored in stream_buffers[seq % STREAM_FEED_CAPACITY].
 typedef struct {
+	stream_buffer_t stream_buffers[STREAM_FEED_CAPACITY];
+	uint64_t first_seq, next_seq;
+	// The newest cluster that starts with a video keyframe. Lagging viewers can continue
+	// with it. Only valid if it's still in the ring.
+	uint64_t keyframe_seq;
+	usec_t latest_cluster_received_at;
+	
+	// File descriptors of the viewers on this worker and of those that ran out of data.
+	// Each client stores its position in these arrays (viewer_index, stalled_index) so
+	// it can be removed in constant time.
+	array_p viewers, stalled_viewers;
+	
+	// Counters of the viewers on this worker for the /metrics endpoint (see metric_add())
+	uint64_t viewer_joins, viewer_leaves, viewer_stalls, viewer_lag_skips;
+	uint64_t fanout_bytes;
+	// Latencies in usec of the viewers on this worker: From the source sending a cluster
+	// until the first and the last viewer wrote all of it, and from a viewer joining until
+	// it continues with the clusters in the ring (after the intro).
+	histogram_t first_write_latency, last_write_latency, join_latency;
+} stream_feed_t, *stream_feed_p;
+
+// A video stream, one client sends the video, many others receive it. The streamer
+// and the viewers can belong to different worker threads.
+typedef struct stream_s {
+	// Protects the header, the intro and cluster_seq. The last_disconnect_at
+	// and params fields are protected by the streams lock of the server.
+	pthread_mutex_t lock;
+	// References of the streams dict and messages sent to workers. Modified atomically.
+	size_t refcount;
+	// Viewers on all workers, modified atomically when a viewer is added to or removed
+	// from the viewers of a feed.
 	uint32_t viewer_count;
-	list_p stream_buffers;
 	buffer_t header;
 	
-	FILE* intro_stream;
-	buffer_t intro_buffer;
+	// Sequence number of the last cluster received (and added to the intro)
+	uint64_t cluster_seq;
+	
+	// The intro is an index of the clusters since the last video keyframe (the current
+	// GOP), new viewers start with it. The stream holds a reference to each of them. If
+	// intro_tail_size isn't 0 the first one is sent from the keyframe block on: The last
+	// intro_tail_size bytes of its data with a new cluster header and intro_timecode in
+	// front. intro_seq is the sequence number of the first cluster. The intro clusters
+	// don't count against the stream budget, intro_bytes is modified atomically.
+	array_p intro_clusters;
+	uint64_t intro_seq, intro_timecode;
+	size_t intro_tail_size, intro_bytes;
+	// What a new viewer gets before the intro clusters, built when the first one joins and
+	// shared by all viewers joining until the header changes or the next keyframe arrives.
+	// The last join_prefix_size bytes are the start of a trimmed first intro cluster.
+	shared_buffer_p join_bundle;
+	size_t join_prefix_size;
 	
 	uint64_t prev_sources_offset;
 	uint64_t last_observed_timecode;
 	
+	// Bytes and number of the clusters still held by any worker, modified atomically. The
+	// bytes are checked against the stream budget of the server.
+	size_t buffered_bytes, buffer_count;
+	
+	// Counters of the source for the /metrics endpoint, updated with the stream lock held
+	// (see metric_add()). ingest_bitrate is the bitrate in bit/s of the last full
+	// STREAM_BITRATE_INTERVAL, the current one started at ingest_interval_start.
+	uint64_t ingest_bytes, ingest_clusters, ingest_keyframes;
+	uint64_t ingest_bitrate, ingest_interval_bytes;
+	usec_t ingest_interval_start;
+	// Set (atomically) when the source stopped reading because the stream is over its
+	// budget. Whoever clears it again sends a WORKER_MESSAGE_RESUME_SOURCE to the worker
+	// of the source. The source sets source_fd and source_worker_index before that.
+	uint32_t source_paused;
+	int source_fd;
+	size_t source_worker_index;
+	
 	usec_t last_disconnect_at;
 	dict_p params;
+	// Lag after which viewers skip ahead (see STREAM_DEFAULT_MAX_LAG), set by the source
+	// and read by the viewers with atomic operations.
+	usec_t max_lag;
+	// Set by the source via the low_latency URL parameter. The blocks of each cluster are
+	// forwarded as soon as they're complete (see streamer_append_block()).
+	bool low_latency;
 	char* name;
 	
-	usec_t latest_cluster_received_at;
-	
 	// For later
 	//buffer_t snapshot_image, stalled_frame;
 	//char* snapshot_mime_type;
+	
+	// One feed per worker, indexed by server->worker_index
+	stream_feed_t feeds[];
 } stream_t, *stream_p;
 
 
@@ -63,6 +213,12 @@ typedef struct {
 	// Flags to remember parts of the client state. Mostly used by the client
 	// functions to keep track of what has already been done. See CLIENT_* constants.
 	uint32_t flags;
+	// The CLIENT_POLL_FOR_* flags the server currently polls the connection for. Used
+	// by the server to update the event registration only when the flags change.
+	uint32_t polled_flags;
+	// Incremented for each new connection. Used by the io_uring backend to ignore
+	// completions of requests that belong to a previous connection with the same fd.
+	uint32_t io_generation;
 	
 	// Buffer that points to stuff to receive or send. Sometimes also used to store
 	// partial stuff.
@@ -71,24 +227,60 @@ typedef struct {
 	// the originally malloced block that was used as buffer.
 	void* buffer_to_free;
 	
-	// A malloced() string containing the HTTP method and resource the client requested.
+	// Fixed size buffer the HTTP request is read into and the state of its parser. Kept for
+	// the next request of keep-alive clients, otherwise freed once the request is handled.
+	buffer_t request;
+	http_parser_t http_parser;
+	// The HTTP method and resource the client requested. Both point into the request
+	// buffer and are only valid as long as it is.
 	char* method;
 	char* resource;
 	
+	// Reference to the status JSON the client sends and how much of its body it already
+	// wrote. The response headers are in buffer.
+	status_json_p status_json;
+	size_t status_json_offset;
+	
 	// The stream this client is connected to (either as streamer or as viewer)
 	stream_p stream;
+	// Parser state of the data a streamer sent us so far (the data in buffer)
+	ebml_parser_t parser;
+	// Chunk buffer of the cluster a streamer currently sends. The cluster data is read
+	// directly into it, filled and size include the HTTP chunk headroom.
+	buffer_t cluster;
+	// Timecode of the cluster whose blocks a low latency streamer currently forwards, the
+	// fragment cluster it appends them to (it holds a reference while it's open), its
+	// sequence number and how many bytes fit into its buffer.
+	uint64_t cluster_timecode;
+	shared_buffer_p fragment;
+	uint64_t fragment_seq;
+	size_t fragment_capacity;
 	
-	// Pointer to the stream buffer node this client currently views
-	list_node_p current_stream_buffer;
-	
-	// If this pointer is not NULL we have to write a pointer to the next received
-	// cluster buffer of this stream there. It's necessary to wire up new clients
-	// to the "main line" of cluster buffers. Otherwise they may miss one or more
-	// clusters while the initial buffers are send to them.
-	// This field is NULLed when a cluster is received (and the pointer was written)
-	// or the client is stalled (in that case the buffer node we wanted to write the
-	// pointer to has been freed and we would overwrite something totally unrelated).
-	list_node_p* insert_next_received_cluster_buffer;
+	// Sequence number of the cluster this viewer currently sends. While it sends the join
+	// bundle or the intro it's the first cluster after the intro. How far the viewer is
+	// behind is just next_seq - cursor of the stream feed. cursor_offset is how much of that
+	// cluster is sent once the current buffer is done. It's only less than the clusters
+	// size for a fragment cluster that grew in the meantime.
+	uint64_t cursor;
+	size_t cursor_offset;
+	// The intro clusters the viewer sends before the ones in the ring, it holds a reference
+	// to each. NULL when done. intro_index is the one currently sent, intro_tail_size is
+	// copied from the stream.
+	array_p intro_clusters;
+	size_t intro_index, intro_tail_size;
+	// Reference to the join bundle of the stream while the viewer sends it
+	shared_buffer_p join_buffer;
+	// Reference to the cluster at the cursor while the viewer sends it. The ring can wrap
+	// around a slow viewer in the middle of it, it still finishes the cluster then.
+	shared_buffer_p cursor_buffer;
+	// Reference to the cluster an io_uring write request of the viewer reads from while
+	// it's in flight (see CLIENT_WRITE_IN_FLIGHT)
+	shared_buffer_p write_buffer;
+	// Positions in the viewers and stalled_viewers arrays of the stream feed. Only valid
+	// while the CLIENT_IS_VIEWER or CLIENT_STALLED flag is set.
+	size_t viewer_index, stalled_index;
+	// When the viewer joined its stream, 0 once it got to the clusters in the ring
+	usec_t joined_at;
 } client_t, *client_p;
 
 #define CLIENT_POLL_FOR_READ       (1 << 0)
@@ -98,14 +290,104 @@ typedef struct {
 #define CLIENT_IS_AUTHORIZED       (1 << 3)
 
 #define CLIENT_STALLED             (1 << 4)
+// A write request for this client was submitted to io_uring and hasn't completed yet
+#define CLIENT_WRITE_IN_FLIGHT     (1 << 5)
+// The client is in the viewers array of its stream feed
+#define CLIENT_IS_VIEWER           (1 << 6)
+// The source doesn't read any data until the stream is below its budget again
+#define CLIENT_SOURCE_PAUSED       (1 << 7)
+// The viewer used up its write budget and is in the yielded_clients array of the server
+#define CLIENT_WRITE_YIELDED       (1 << 8)
+// The client wants to send more requests over its connection (HTTP keep-alive)
+#define CLIENT_KEEP_ALIVE          (1 << 9)
+// A keep-alive viewer sent its next request and leaves its stream after the current cluster
+#define CLIENT_SWITCH_PENDING      (1 << 10)
+// The response to the next request has to start with the last chunk of the stream the
+// client watched before (see http_pending_last_chunk())
+#define CLIENT_LAST_CHUNK_PENDING  (1 << 11)
+
+// Bytes a viewer writes before it lets the other clients of its worker go first. The
+// server continues with it after all other pending events (see yielded_clients).
+#define CLIENT_WRITE_BUDGET  (256 * 1024)
 
+// Adds to a counter of the /metrics endpoint. Each counter is only written by one thread
+// at a time, so this is a plain load and store without a locked instruction. They're
+// atomic so the endpoint can read them from other workers.
+static inline void metric_add(uint64_t* counter, uint64_t value) {
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
 
-// Server stuff that others need to interact with
+
+// Messages the workers send each other, see worker_post_message()
 typedef struct {
-	// List of all connected clients
+	int type;
+	stream_p stream;
+	shared_buffer_p cluster;
+	uint64_t cluster_seq;
+	bool cluster_starts_with_keyframe;
+} worker_message_t, *worker_message_p;
+
+// A new cluster of the stream was received
+#define WORKER_MESSAGE_CLUSTER        1
+// The stream was removed from the streams dict, disconnect all its viewers
+#define WORKER_MESSAGE_DELETE_STREAM  2
+// Leave the event loop
+#define WORKER_MESSAGE_STOP           3
+// The stream is below its budget again, continue to read from its source
+#define WORKER_MESSAGE_RESUME_SOURCE  4
+// Blocks were appended to the newest cluster of the stream (low latency mode)
+#define WORKER_MESSAGE_BLOCKS         5
+
+// What to do when the clusters of a stream exceed the stream budget. Evicting drops the
+// oldest clusters, cutting off the slowest viewers. Pausing the source stops reading
+// from it, TCP backpressure then slows down the encoder until the viewers caught up.
+// When all streams together exceed the global budget the oldest clusters are always
+// evicted since pausing one source doesn't help the others.
+#define BUDGET_POLICY_EVICT         1
+#define BUDGET_POLICY_PAUSE_SOURCE  2
+
+
+// Server stuff that others need to interact with. Each worker thread has its own
+// server_t. Only the streams dict is shared.
+typedef struct server_s {
+	// List of all clients connected to this worker
 	hash_p clients;
-	// List of all streams
+	// List of all streams, shared by all workers
 	dict_p streams;
+	pthread_mutex_t* streams_lock;
 	
 	int stream_delete_timeout_sec;
+	
+	// Limits for the bytes of buffered clusters of one stream and of all streams, 0 for
+	// no limit. See BUDGET_POLICY_* for what happens when they're exceeded.
+	size_t stream_budget, global_budget;
+	int budget_policy;
+	
+	// All workers, this one is workers[worker_index]
+	struct server_s* workers;
+	size_t worker_count, worker_index;
+	pthread_t thread;
+	int http_server_fd;
+	
+	// Messages from other workers. inbox_fd is an eventfd signaled when the first
+	// message is added to an empty inbox.
+	pthread_mutex_t inbox_lock;
+	array_p inbox;
+	int inbox_fd;
+	
+	// File descriptors of clients whose CLIENT_POLL_FOR_* flags were changed while
+	// handling another client (e.g. viewers unstalled by a new cluster). The server
+	// updates their event registration after each batch of events.
+	array_p clients_with_changed_flags;
+	// File descriptors of viewers that used up their write budget (CLIENT_WRITE_YIELDED is
+	// set). The server lets them continue once per round of its event loop, round-robin.
+	array_p yielded_clients;
+	
+	// The I/O backend. If uring is NULL the epoll backend is used.
+	int epoll_fd;
+	uring_p uring;
+	// Write requests of already disconnected viewers (uring_orphaned_write_t). They still
+	// read from their cluster, so it's only released when they complete.
+	array_p orphaned_writes;
+	uint32_t next_io_generation;
 } server_t, *server_p;
\ No newline at end of file
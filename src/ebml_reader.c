@@ -71,7 +71,8 @@ uint64_t ebml_read_data_size(void* buffer, size_t buffer_size, size_t* pos) {
 ebml_elem_t ebml_read_element(void* buffer, size_t buffer_size, size_t* buffer_pos) {
 	ebml_elem_t element = ebml_read_element_header(buffer, buffer_size, buffer_pos);
 	if (element.id != 0) {
-		if (*buffer_pos + element.header_size + element.data_size <= buffer_size)
+		// ebml_read_element_header() already moved buffer_pos behind the header
+		if (*buffer_pos + element.data_size <= buffer_size)
 			*buffer_pos += element.data_size;
 		else
 			element.id = 0;
@@ -93,8 +94,9 @@ ebml_elem_t ebml_read_element_header(void* buffer, size_t buffer_size, size_t* b
 	if (pos == *buffer_pos)
 		return element;
 	
+	size_t data_size_pos = pos;
 	element.data_size = ebml_read_data_size(buffer + pos, buffer_size - pos, &pos);
-	if (pos == *buffer_pos) {
+	if (pos == data_size_pos) {
 		element.id = 0;
 		return element;
 	}
@@ -134,4 +136,127 @@ int64_t ebml_read_int(void* buffer, size_t buffer_size) {
 	value = value >> ((sizeof(value) - buffer_size) * 8);
 	
 	return value;
-}
\ No newline at end of file
+}
+
+
+//
+// Resumable parser
+//
+
+void ebml_parser_init(ebml_parser_p parser) {
+	memset(parser, 0, sizeof(ebml_parser_t));
+}
+
+/**
+ * Returns the next event for the data in the buffer. Call it again with the same buffer
+ * (but more data in it) when it returns EBML_NEED_MORE_DATA. The parser remembers where
+ * it stopped so each element header is only read once.
+ * 
+ * An EBML_ELEMENT_BEGIN event is returned as soon as the element header is complete. Call
+ * ebml_parser_enter() right after it to parse the child elements. Otherwise the data of
+ * the element is skipped without looking at it. EBML_ELEMENT_COMPLETE is returned when
+ * all data of a skipped element is in the buffer or all children of an entered element
+ * have been parsed.
+ * 
+ * Elements of unknown size are always entered. They're completed when an element with
+ * the same ID begins (e.g. the next cluster after an unknown size cluster).
+ */
+ebml_event_t ebml_parser_next(ebml_parser_p parser, void* buffer, size_t buffer_size) {
+	ebml_event_t event;
+	memset(&event, 0, sizeof(ebml_event_t));
+	
+	if (parser->element_pending) {
+		if (parser->pending.data_size == EBML_UNKNOWN_SIZE) {
+			ebml_parser_enter(parser);
+		} else {
+			size_t end = parser->pending.offset + parser->pending.header_size + parser->pending.data_size;
+			if (end > buffer_size)
+				return event;
+			
+			parser->pos = end;
+			parser->element_pending = false;
+			event = parser->pending;
+			event.type = EBML_ELEMENT_COMPLETE;
+			return event;
+		}
+	}
+	
+	// Complete entered elements when we reached their end
+	if (parser->depth > 0) {
+		ebml_event_p top = &parser->stack[parser->depth - 1];
+		if (top->data_size != EBML_UNKNOWN_SIZE && parser->pos >= top->offset + top->header_size + top->data_size) {
+			parser->depth--;
+			event = *top;
+			event.type = EBML_ELEMENT_COMPLETE;
+			return event;
+		}
+	}
+	
+	size_t pos = parser->pos;
+	ebml_elem_t element = ebml_read_element_header(buffer, buffer_size, &pos);
+	if (element.id == 0)
+		return event;
+	
+	// An element with the same ID ends an entered element of unknown size. Complete that one
+	// first, the new element is read again with the next call.
+	if (parser->depth > 0) {
+		ebml_event_p top = &parser->stack[parser->depth - 1];
+		if (top->data_size == EBML_UNKNOWN_SIZE && top->id == element.id) {
+			parser->depth--;
+			event = *top;
+			event.type = EBML_ELEMENT_COMPLETE;
+			event.data_size = parser->pos - top->offset - top->header_size;
+			return event;
+		}
+	}
+	
+	event.type = EBML_ELEMENT_BEGIN;
+	event.id = element.id;
+	event.offset = parser->pos;
+	event.header_size = element.header_size;
+	event.data_size = element.data_size;
+	
+	parser->pos = pos;
+	parser->element_pending = true;
+	parser->pending = event;
+	return event;
+}
+
+/**
+ * Parses the child elements of the element returned by the last EBML_ELEMENT_BEGIN
+ * event instead of skipping it. If the maximal depth is reached the element is skipped.
+ */
+void ebml_parser_enter(ebml_parser_p parser) {
+	if (!parser->element_pending || parser->depth >= EBML_PARSER_MAX_DEPTH)
+		return;
+	
+	parser->stack[parser->depth] = parser->pending;
+	parser->depth++;
+	parser->element_pending = false;
+}
+
+/**
+ * Continues after the element returned by the last EBML_ELEMENT_BEGIN event without
+ * waiting for its data. No complete event is reported for it. Useful when the caller
+ * takes care of the element data on its own.
+ */
+void ebml_parser_skip(ebml_parser_p parser) {
+	if (!parser->element_pending)
+		return;
+	
+	parser->pos = parser->pending.offset + parser->pending.header_size + parser->pending.data_size;
+	parser->element_pending = false;
+}
+
+/**
+ * Tells the parser that the first `bytes` bytes have been removed from the buffer. Only
+ * remove data that has already been parsed. Offsets of entered elements that started
+ * in the removed data wrap around, but offset + header_size + data_size (their end) is
+ * still correct.
+ */
+void ebml_parser_consume(ebml_parser_p parser, size_t bytes) {
+	parser->pos -= bytes;
+	parser->pending.offset -= bytes;
+	for(size_t i = 0; i < parser->depth; i++)
+		parser->stack[i].offset -= bytes;
+}
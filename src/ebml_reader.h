@@ -13,6 +13,39 @@ typedef struct {
 	uint64_t data_size, header_size;
 } ebml_elem_t, *ebml_elem_p;
 
+// Data size of elements with an unknown size (all size bits set to 1)
+#define EBML_UNKNOWN_SIZE ((uint64_t)-1)
+
+
+// Resumable parser for data that arrives piece by piece. See ebml_parser_next().
+
+#define EBML_PARSER_MAX_DEPTH 4
+
+typedef enum {
+	EBML_NEED_MORE_DATA = 0,
+	EBML_ELEMENT_BEGIN,
+	EBML_ELEMENT_COMPLETE
+} ebml_event_type_t;
+
+typedef struct {
+	ebml_event_type_t type;
+	uint32_t id;
+	// Offset of the element header in the buffer, the data follows after header_size bytes
+	size_t   offset;
+	uint64_t header_size, data_size;
+} ebml_event_t, *ebml_event_p;
+
+typedef struct {
+	// Offset of the next byte to look at in the buffer
+	size_t pos;
+	// Set after a begin event until the element is entered or skipped
+	bool         element_pending;
+	ebml_event_t pending;
+	// Elements we entered, the innermost one is last
+	size_t       depth;
+	ebml_event_t stack[EBML_PARSER_MAX_DEPTH];
+} ebml_parser_t, *ebml_parser_p;
+
 
 uint32_t ebml_read_element_id(void* buffer, size_t buffer_size, size_t* pos);
 uint64_t ebml_read_data_size(void* buffer, size_t buffer_size, size_t* pos);
@@ -21,4 +54,10 @@ ebml_elem_t ebml_read_element(void* buffer, size_t buffer_size, size_t* pos);
 ebml_elem_t ebml_read_element_header(void* buffer, size_t buffer_size, size_t* pos);
 
 uint64_t ebml_read_uint(void* buffer, size_t buffer_size);
-int64_t ebml_read_int(void* buffer, size_t buffer_size);
\ No newline at end of file
+int64_t ebml_read_int(void* buffer, size_t buffer_size);
+
+void         ebml_parser_init   (ebml_parser_p parser);
+ebml_event_t ebml_parser_next   (ebml_parser_p parser, void* buffer, size_t buffer_size);
+void         ebml_parser_enter  (ebml_parser_p parser);
+void         ebml_parser_skip   (ebml_parser_p parser);
+void         ebml_parser_consume(ebml_parser_p parser, size_t bytes);
\ No newline at end of file
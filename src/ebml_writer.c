@@ -219,6 +219,10 @@ size_t ebml_encoded_int_required_bytes(int64_t value) {
 }
 
 size_t ebml_unencoded_uint_required_bytes(uint64_t value) {
+	// Use 1 byte for zero, __builtin_clzll() is undefined for it
+	if (value == 0)
+		return 1;
+	
 	int leading_zeros = __builtin_clzll(value);
 	int value_bits = 64 - leading_zeros;
 	int value_bytes = (value_bits - 1) / 8 + 1;
@@ -226,6 +230,10 @@ size_t ebml_unencoded_uint_required_bytes(uint64_t value) {
 }
 
 size_t ebml_unencoded_int_required_bytes(int64_t value) {
+	// Use 1 byte for zero and -1, __builtin_clzll() is undefined for 0
+	if (value == 0 || value == -1)
+		return 1;
+	
 	//int leading_sign_bits = __builtin_clrsbll(value);
 	int leading_sign_bits = __builtin_clzll( (value >= 0) ? value : ~value ) - 1;
 	int value_bits = 64 - leading_sign_bits;
@@ -195,10 +195,15 @@ static ssize_t unified_hash_search(unified_hash_p hashmap, hash_key_t int_key, c
 		index = (index + 1) % hashmap->capacity;
 		probe_offset++;
 		
-		// We probed for a long time but didn't find anything. But there should be free slots
-		// in the hashmap so something is broken. Return a value that will crash for sure.
-		if (probe_offset > hashmap->capacity) {
-			//printf("aborted probing: %zd, returning %zd\n", first_deleted_index, -(first_deleted_index + 1));
+		// We probed the entire hashmap without finding the key or a free slot. That happens
+		// when removed elements left only deleted slots behind (only the number of elements
+		// triggers a resize). The key isn't there, so reuse the first deleted slot.
+		if (probe_offset >= hashmap->capacity) {
+			if (first_deleted_index != -1)
+				return -(first_deleted_index + 1);
+			
+			// No free and no deleted slots, something is broken. Return a value that will
+			// crash for sure.
 			return (ssize_t)((SIZE_MAX / 2) + 1);
 		}
 	}
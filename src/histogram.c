@@ -0,0 +1,53 @@
+#include "histogram.h"
+
+
+static void histogram_add(uint64_t* counter, uint64_t value) {
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+void histogram_record(histogram_p histogram, uint64_t value) {
+	histogram_add(&histogram->counts[histogram_bucket_of(value)], 1);
+	histogram_add(&histogram->count, 1);
+	histogram_add(&histogram->sum, value);
+}
+
+/**
+ * Adds the counts of `src` to `dest`. `src` can be written by another thread at the same
+ * time, `dest` must not.
+ */
+void histogram_merge(histogram_p dest, histogram_p src) {
+	for(size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+		dest->counts[i] += __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+	dest->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	dest->sum   += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+}
+
+/**
+ * Returns the bucket a value is counted in. Like the size classes of the pool the index of
+ * the highest set bit of value - 1 tells us the power of two range, the bits after it the
+ * sub bucket.
+ */
+size_t histogram_bucket_of(uint64_t value) {
+	if (value <= ((uint64_t)1 << HISTOGRAM_MIN_SHIFT))
+		return 0;
+	if (value > ((uint64_t)1 << HISTOGRAM_MAX_SHIFT))
+		return HISTOGRAM_BUCKETS - 1;
+	
+	size_t shift = 63 - __builtin_clzll(value - 1);
+	size_t sub_bucket = ((value - 1) >> (shift - HISTOGRAM_SUB_BUCKET_BITS)) - HISTOGRAM_SUB_BUCKETS;
+	return 1 + (shift - HISTOGRAM_MIN_SHIFT) * HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+/**
+ * Returns the largest value counted in the bucket, UINT64_MAX for the last one.
+ */
+uint64_t histogram_bucket_limit(size_t bucket) {
+	if (bucket == 0)
+		return (uint64_t)1 << HISTOGRAM_MIN_SHIFT;
+	if (bucket >= HISTOGRAM_BUCKETS - 1)
+		return UINT64_MAX;
+	
+	size_t shift = HISTOGRAM_MIN_SHIFT + (bucket - 1) / HISTOGRAM_SUB_BUCKETS;
+	size_t sub_bucket = (bucket - 1) % HISTOGRAM_SUB_BUCKETS;
+	return ((uint64_t)1 << shift) + (sub_bucket + 1) * (((uint64_t)1 << shift) / HISTOGRAM_SUB_BUCKETS);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+/**
+
+# Latency histogram
+
+Counts values (e.g. latencies in usec) in logarithmic buckets, like an HDR histogram with
+a fixed precision. Each power of two range is divided into HISTOGRAM_SUB_BUCKETS buckets:
+2^n < value <= 1.5 * 2^n and 1.5 * 2^n < value <= 2^(n+1). Values up to
+2^HISTOGRAM_MIN_SHIFT go into the first bucket, values above 2^HISTOGRAM_MAX_SHIFT into
+the last one.
+
+A histogram is written by only one thread but can be read by others, e.g. to merge the
+histograms of all workers. histogram_record() is a plain increment done with relaxed
+atomic stores, histogram_merge() reads with relaxed atomic loads. A zeroed histogram is
+empty, there is no init function.
+
+histogram_t latency;
+memset(&latency, 0, sizeof(latency));
+histogram_record(&latency, 1500);
+
+for(size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+	printf("<= %lu: %lu\n", histogram_bucket_limit(i), latency.counts[i]);
+
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HISTOGRAM_MIN_SHIFT        7
+#define HISTOGRAM_MAX_SHIFT        25
+#define HISTOGRAM_SUB_BUCKET_BITS  1
+#define HISTOGRAM_SUB_BUCKETS      (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS          ((HISTOGRAM_MAX_SHIFT - HISTOGRAM_MIN_SHIFT) * HISTOGRAM_SUB_BUCKETS + 2)
+
+typedef struct {
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	// Number and sum of all recorded values
+	uint64_t count, sum;
+} histogram_t, *histogram_p;
+
+void     histogram_record(histogram_p histogram, uint64_t value);
+void     histogram_merge(histogram_p dest, histogram_p src);
+
+size_t   histogram_bucket_of(uint64_t value);
+uint64_t histogram_bucket_limit(size_t bucket);
@@ -0,0 +1,138 @@
+#include <string.h>
+
+#include "http_parser.h"
+
+
+void http_parser_init(http_parser_p parser) {
+	memset(parser, 0, sizeof(http_parser_t));
+}
+
+/**
+ * Returns the slice between `start` and `end` without leading and trailing spaces or
+ * tabs and terminates it with a zero byte. `end` has to point into the buffer.
+ */
+static http_slice_t http_slice_trimmed(char* start, char* end) {
+	while (start < end && (*start == ' ' || *start == '\t'))
+		start++;
+	while (end > start && (end[-1] == ' ' || end[-1] == '\t'))
+		end--;
+	
+	*end = '\0';
+	return (http_slice_t){ start, end - start };
+}
+
+/**
+ * Returns the next word of a line (up to the next space) and moves `pos` behind it. The
+ * line has to be terminated by a zero byte at `end`.
+ */
+static http_slice_t http_next_word(char** pos, char* end) {
+	char* start = *pos;
+	while (start < end && *start == ' ')
+		start++;
+	
+	char* word_end = memchr(start, ' ', end - start);
+	if (word_end == NULL)
+		word_end = end;
+	
+	*pos = (word_end < end) ? word_end + 1 : end;
+	*word_end = '\0';
+	return (http_slice_t){ start, word_end - start };
+}
+
+/**
+ * Returns the next request line or header in the buffer. `buffer_size` can grow between
+ * calls but the data already in the buffer must stay where it is. Lines that don't look
+ * like a header are skipped.
+ *
+ * Returns HTTP_NEED_MORE_DATA if there is no complete line left and HTTP_ERROR if the
+ * request line is malformed. Once all headers are parsed it always returns
+ * HTTP_HEADERS_COMPLETE.
+ */
+http_event_t http_parser_next(http_parser_p parser, char* buffer, size_t buffer_size) {
+	http_event_t event;
+	memset(&event, 0, sizeof(http_event_t));
+	
+	if (parser->headers_done) {
+		event.type = HTTP_HEADERS_COMPLETE;
+		return event;
+	}
+	
+	while (true) {
+		char* line = buffer + parser->pos;
+		char* line_end = memchr(buffer + parser->scanned, '\n', buffer_size - parser->scanned);
+		if (line_end == NULL) {
+			parser->scanned = buffer_size;
+			return event;
+		}
+		
+		parser->pos = parser->scanned = (line_end - buffer) + 1;
+		
+		// Lines end with "\r\n" but we also accept a plain "\n"
+		char* end = line_end;
+		if (end > line && end[-1] == '\r')
+			end--;
+		*end = '\0';
+		
+		if (!parser->request_line_done) {
+			// Ignore empty lines before the request line (RFC 7230 section 3.5)
+			if (end == line)
+				continue;
+			
+			char* pos = line;
+			event.method   = http_next_word(&pos, end);
+			event.resource = http_next_word(&pos, end);
+			event.version  = http_slice_trimmed(pos, end);
+			
+			event.type = (event.method.size > 0 && event.resource.size > 0 && event.version.size > 0) ? HTTP_REQUEST_LINE : HTTP_ERROR;
+			parser->request_line_done = true;
+			return event;
+		}
+		
+		// An empty line ends the headers
+		if (end == line) {
+			parser->headers_done = true;
+			event.type = HTTP_HEADERS_COMPLETE;
+			return event;
+		}
+		
+		char* colon = memchr(line, ':', end - line);
+		if (colon == NULL)
+			continue;
+		
+		event.name = http_slice_trimmed(line, colon);
+		if (event.name.size == 0)
+			continue;
+		event.value = http_slice_trimmed(colon + 1, end);
+		
+		event.type = HTTP_HEADER;
+		return event;
+	}
+}
+
+/**
+ * Returns the next parameter of the query string at `pos` (the ? or & in front of it) and
+ * moves `pos` behind it. A parameter without a value gets an empty one. Returns false at
+ * the end of the query string. Nothing is terminated or decoded here.
+ */
+bool http_next_param(char** pos, http_slice_t* name, http_slice_t* value) {
+	char* p = *pos;
+	if (*p == '\0')
+		return false;
+	
+	name->ptr = p + 1;  // jump over ? or &
+	name->size = strcspn(name->ptr, "=&");
+	p = name->ptr + name->size;
+	
+	if (*p == '=') {
+		value->ptr = p + 1;
+		value->size = strcspn(value->ptr, "&");
+		p = value->ptr + value->size;
+	} else {
+		// Only name, no value
+		value->ptr = p;
+		value->size = 0;
+	}
+	
+	*pos = p;
+	return true;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+/**
+
+# Incremental HTTP/1.x request parser
+
+Parses the request line and headers of a request as it arrives piece by piece. The
+caller reads into one buffer and calls http_parser_next() after each read until it
+returns HTTP_NEED_MORE_DATA. The parser remembers how far it already searched for the
+end of a line, so each byte is only looked at once.
+
+Nothing is copied, the parser returns slices of the buffer. It terminates each slice
+with a zero byte in place (overwriting the space, colon or line break after it), so
+they can also be used as normal C strings as long as the buffer lives.
+
+http_parser_t parser;
+http_parser_init(&parser);
+
+http_event_t event;
+while ( (event = http_parser_next(&parser, buffer, filled)).type != HTTP_NEED_MORE_DATA ) {
+	if (event.type == HTTP_REQUEST_LINE)
+		printf("%s %s\n", event.method.ptr, event.resource.ptr);
+	else if (event.type == HTTP_HEADER)
+		printf("%s: %s\n", event.name.ptr, event.value.ptr);
+	else
+		break;
+}
+
+After HTTP_HEADERS_COMPLETE parser.pos is the offset of the request body in the buffer.
+
+http_next_param() splits the query string of a resource into its parameters. Parameters
+without a value (like "?low_latency") get an empty one.
+
+char* pos = strchr(resource, '?');
+http_slice_t name, value;
+while ( pos && http_next_param(&pos, &name, &value) )
+	printf("%.*s = %.*s\n", (int)name.size, name.ptr, (int)value.size, value.ptr);
+
+*/
+
+#include <stddef.h>
+#include <stdbool.h>
+
+
+typedef struct {
+	char*  ptr;
+	size_t size;
+} http_slice_t;
+
+typedef enum {
+	HTTP_NEED_MORE_DATA = 0,
+	HTTP_REQUEST_LINE,
+	HTTP_HEADER,
+	HTTP_HEADERS_COMPLETE,
+	HTTP_ERROR
+} http_event_type_t;
+
+typedef struct {
+	http_event_type_t type;
+	// Set for HTTP_REQUEST_LINE
+	http_slice_t method, resource, version;
+	// Set for HTTP_HEADER
+	http_slice_t name, value;
+} http_event_t;
+
+typedef struct {
+	// Offset of the next line in the buffer
+	size_t pos;
+	// Offset up to which we already searched for the end of the next line
+	size_t scanned;
+	bool   request_line_done, headers_done;
+} http_parser_t, *http_parser_p;
+
+
+void         http_parser_init(http_parser_p parser);
+http_event_t http_parser_next(http_parser_p parser, char* buffer, size_t buffer_size);
+bool         http_next_param(char** pos, http_slice_t* name, http_slice_t* value);
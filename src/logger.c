@@ -1,20 +1,153 @@
+// For rindex(), usleep() and eventfd()
+#define _GNU_SOURCE
+
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
 #include "logger.h"
 
 
 int log_level = LOG_DEBUG;
 
+// A slot of the log ring. sequence tells who owns it (see logger_ring_reserve()).
+typedef struct {
+	size_t sequence;
+	size_t size;
+	char   text[LOGGER_MESSAGE_SIZE];
+} logger_slot_t;
+
+// Bounded multi-producer queue (the one by Dmitry Vyukov), only the log thread takes
+// messages out. A producer reserves a slot by incrementing enqueue_pos, formats its
+// message into it and then publishes it by setting the sequence of the slot.
+static logger_slot_t logger_ring[LOGGER_RING_SLOTS];
+static size_t enqueue_pos = 0, dequeue_pos = 0, dropped_messages = 0;
+
+// The log thread sleeps on wakeup_fd when the ring is empty. It sets sleeping before
+// that, so producers only write to the eventfd when necessary.
+static uint32_t  running = 0, sleeping = 0, stopping = 0;
+static int       wakeup_fd = -1;
+static pthread_t thread;
+static FILE*     output = NULL;
 
-void logger_setup(int level) {
+static void* logger_thread(void* arg);
+
+
+/**
+ * Sets the log level and starts the log thread. Messages go to the file at `path` (appended)
+ * or stderr if `path` is NULL. If the thread can't be started messages are written
+ * directly.
+ */
+void logger_setup(int level, const char* path) {
 	log_level = level;
+	
+	output = stderr;
+	if (path) {
+		output = fopen(path, "a");
+		if (output == NULL) {
+			fprintf(stderr, "failed to open log file %s: %s\n", path, strerror(errno));
+			output = stderr;
+		}
+	}
+	
+	for(size_t i = 0; i < LOGGER_RING_SLOTS; i++)
+		logger_ring[i].sequence = i;
+	
+	wakeup_fd = eventfd(0, EFD_NONBLOCK);
+	if (wakeup_fd == -1) {
+		perror("eventfd");
+		return;
+	}
+	
+	// The log thread inherits our signal mask. Block all signals so they're handled by the
+	// thread that expects them.
+	sigset_t all_signals, old_signals;
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+	int error = pthread_create(&thread, NULL, logger_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	if (error != 0) {
+		fprintf(stderr, "failed to start log thread: %s\n", strerror(error));
+		close(wakeup_fd);
+		wakeup_fd = -1;
+		return;
+	}
+	
+	__atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+	atexit(logger_shutdown);
 }
 
-void logger_message(int level, const char *file, int line, const char *func, const char *format, ...) {
-	if (level < log_level)
+/**
+ * Writes all messages still in the ring and stops the log thread. Messages after that are
+ * written directly.
+ */
+void logger_shutdown() {
+	if ( !__atomic_load_n(&running, __ATOMIC_ACQUIRE) )
 		return;
 	
+	__atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+	uint64_t value = 1;
+	if ( write(wakeup_fd, &value, sizeof(value)) == -1 )
+		perror("write");
+	pthread_join(thread, NULL);
+	
+	__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+	close(wakeup_fd);
+	wakeup_fd = -1;
+	if (output != stderr)
+		fclose(output);
+	output = NULL;
+}
+
+/**
+ * Reserves a slot in the ring. Returns NULL if the ring is full.
+ */
+static logger_slot_t* logger_ring_reserve() {
+	size_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+	while (true) {
+		logger_slot_t* slot = &logger_ring[pos % LOGGER_RING_SLOTS];
+		size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+		
+		if (diff == 0) {
+			// The slot is free, try to take it
+			if ( __atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+				return slot;
+		} else if (diff < 0) {
+			// The log thread didn't write the message of the previous round yet
+			return NULL;
+		} else {
+			// Another producer took the slot, try the next one
+			pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/**
+ * Hands a filled slot to the log thread and wakes it up if it's sleeping.
+ */
+static void logger_ring_publish(logger_slot_t* slot) {
+	size_t pos = slot->sequence;
+	__atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_SEQ_CST);
+	
+	if ( __atomic_load_n(&sleeping, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&sleeping, 0, __ATOMIC_SEQ_CST) ) {
+		// If that fails the log thread still wakes up after its poll() timeout
+		uint64_t value = 1;
+		ssize_t result = write(wakeup_fd, &value, sizeof(value));
+		(void)result;
+	}
+}
+
+static size_t logger_format(char* buffer, size_t buffer_size, int level, const char *file, int line, const char *func, const char *format, va_list args) {
 	char *label = NULL;
 	switch(level) {
 		case LOG_DEBUG: label = "debug"; break;
@@ -22,16 +155,92 @@ void logger_message(int level, const char *file, int line, const char *func, con
 		case LOG_ERROR: label = "error"; break;
 	}
 	
-	va_list args;
-	va_start(args, format);
-	
+	// Leave room for the line break
+	buffer_size--;
+	size_t size = 0;
 	if (label) {
 		const char* filename = rindex(file, '/');
 		filename = (filename) ? filename + 1 : file;
-		fprintf(stderr, "[%s in %s:%d %s()]: ", label, filename, line, func);
+		int written = snprintf(buffer, buffer_size, "[%s in %s:%d %s()]: ", label, filename, line, func);
+		size = (written < 0) ? 0 : ((size_t)written < buffer_size) ? (size_t)written : buffer_size - 1;
+	}
+	
+	int written = vsnprintf(buffer + size, buffer_size - size, format, args);
+	size += (written < 0) ? 0 : ((size_t)written < buffer_size - size) ? (size_t)written : buffer_size - size - 1;
+	buffer[size++] = '\n';
+	return size;
+}
+
+void logger_message(int level, const char *file, int line, const char *func, const char *format, ...) {
+	if (level < log_level)
+		return;
+	
+	va_list args;
+	va_start(args, format);
+	
+	if ( __atomic_load_n(&running, __ATOMIC_ACQUIRE) ) {
+		logger_slot_t* slot = logger_ring_reserve();
+		if (slot) {
+			slot->size = logger_format(slot->text, sizeof(slot->text), level, file, line, func, format, args);
+			logger_ring_publish(slot);
+		} else {
+			__atomic_add_fetch(&dropped_messages, 1, __ATOMIC_RELAXED);
+		}
+	} else {
+		char buffer[LOGGER_MESSAGE_SIZE];
+		size_t size = logger_format(buffer, sizeof(buffer), level, file, line, func, format, args);
+		fwrite(buffer, size, 1, stderr);
 	}
-	vfprintf(stderr, format, args);
-	fprintf(stderr, "\n");
 	
 	va_end(args);
-}
\ No newline at end of file
+}
+
+/**
+ * Takes the messages out of the ring and writes them. Output is only flushed when the ring
+ * is empty, so a burst of messages is written at once.
+ */
+static void* logger_thread(void* arg) {
+	size_t dropped_reported = 0;
+	
+	while (true) {
+		logger_slot_t* slot = &logger_ring[dequeue_pos % LOGGER_RING_SLOTS];
+		if ( __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == dequeue_pos + 1 ) {
+			fwrite(slot->text, slot->size, 1, output);
+			__atomic_store_n(&slot->sequence, dequeue_pos + LOGGER_RING_SLOTS, __ATOMIC_RELEASE);
+			dequeue_pos++;
+			continue;
+		}
+		
+		size_t dropped = __atomic_load_n(&dropped_messages, __ATOMIC_RELAXED);
+		if (dropped != dropped_reported) {
+			fprintf(output, "[logger] log ring full, dropped %zu messages\n", dropped - dropped_reported);
+			dropped_reported = dropped;
+		}
+		fflush(output);
+		
+		if ( __atomic_load_n(&stopping, __ATOMIC_SEQ_CST) ) {
+			// A producer might still write into a reserved slot, wait for it
+			if (dequeue_pos == __atomic_load_n(&enqueue_pos, __ATOMIC_SEQ_CST))
+				break;
+			usleep(1000);
+			continue;
+		}
+		
+		// Check the ring again after we announced that we sleep, otherwise we could miss a
+		// message published right before that. The timeout is just a safety net.
+		__atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+		if ( __atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST) == dequeue_pos + 1 ) {
+			__atomic_store_n(&sleeping, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		
+		struct pollfd pollfd = { .fd = wakeup_fd, .events = POLLIN };
+		poll(&pollfd, 1, 1000);
+		uint64_t value = 0;
+		if ( read(wakeup_fd, &value, sizeof(value)) == -1 && errno != EAGAIN )
+			break;
+		__atomic_store_n(&sleeping, 0, __ATOMIC_SEQ_CST);
+	}
+	
+	return NULL;
+}
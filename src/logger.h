@@ -2,6 +2,14 @@
 
 /**
  * A simple logger which prefixes each message with the source code location.
+ *
+ * The level is checked before the arguments of a message are evaluated. Messages below
+ * LOG_MIN_LEVEL are compiled out entirely, release builds (NDEBUG defined) drop the debug
+ * messages that way. Use e.g. -DLOG_MIN_LEVEL=LOG_DEBUG to keep them anyway.
+ *
+ * After logger_setup() the threads don't write messages themselves. They're formatted into
+ * a lock-free ring and a background thread writes them to stderr or the log file. When the
+ * ring is full messages are dropped (and counted) instead of waiting for a slow terminal.
  */
 
 #define LOG_DEBUG 1
@@ -9,10 +17,30 @@
 #define LOG_WARN  3
 #define LOG_ERROR 4
 
-void logger_setup(int level);
-void logger_message(int level, const char *file, int line, const char *func, const char *format, ...);
+#ifndef LOG_MIN_LEVEL
+#	ifdef NDEBUG
+#		define LOG_MIN_LEVEL LOG_INFO
+#	else
+#		define LOG_MIN_LEVEL LOG_DEBUG
+#	endif
+#endif
 
-#define debug(...) logger_message(LOG_DEBUG, __FILE__, __LINE__, __func__, __VA_ARGS__)
-#define info(...)  logger_message(LOG_INFO,  __FILE__, __LINE__, __func__, __VA_ARGS__)
-#define warn(...)  logger_message(LOG_WARN,  __FILE__, __LINE__, __func__, __VA_ARGS__)
-#define error(...) logger_message(LOG_ERROR, __FILE__, __LINE__, __func__, __VA_ARGS__)
\ No newline at end of file
+// Number of messages the ring holds and the size of each one (longer ones are truncated)
+#define LOGGER_RING_SLOTS    1024
+#define LOGGER_MESSAGE_SIZE  512
+
+extern int log_level;
+
+void logger_setup(int level, const char* path);
+void logger_shutdown();
+void logger_message(int level, const char *file, int line, const char *func, const char *format, ...) __attribute__ ((format (printf, 5, 6)));
+
+#define logger_log(level, ...) do { \
+	if ( (level) >= LOG_MIN_LEVEL && (level) >= log_level ) \
+		logger_message((level), __FILE__, __LINE__, __func__, __VA_ARGS__); \
+} while(0)
+
+#define debug(...) logger_log(LOG_DEBUG, __VA_ARGS__)
+#define info(...)  logger_log(LOG_INFO,  __VA_ARGS__)
+#define warn(...)  logger_log(LOG_WARN,  __VA_ARGS__)
+#define error(...) logger_log(LOG_ERROR, __VA_ARGS__)
@@ -50,4 +50,5 @@
 
 #define MKV_Cluster      0x1F43B675
 #define MKV_Timecode     0xE7
-#define MKV_SimpleBlock  0xA3
\ No newline at end of file
+#define MKV_SimpleBlock  0xA3
+#define MKV_BlockGroup   0xA0
\ No newline at end of file
@@ -0,0 +1,308 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+
+// Size classes start at 32 bytes (2^5) and go up to POOL_MAX_BLOCK_SIZE (2^26). Class 0
+// is used for blocks that aren't pooled.
+#define POOL_MIN_SHIFT    5
+#define POOL_MAX_SHIFT    26
+#define POOL_CLASS_COUNT  ((POOL_MAX_SHIFT - POOL_MIN_SHIFT) * 4 + 2)
+
+// Stored in front of each block. Keeps the data 16 byte aligned.
+typedef struct {
+	size_t size_class;
+	size_t block_size;
+} pool_header_t, *pool_header_p;
+
+// A free block, the pointer to the next free block is stored in the block data
+typedef struct pool_free_block_s pool_free_block_t, *pool_free_block_p;
+struct pool_free_block_s {
+	pool_free_block_p next;
+};
+
+// Free list of one size class shared by all threads. Threads only lock it to move a
+// whole batch of blocks between it and their own cache.
+typedef struct {
+	pthread_mutex_t lock;
+	pool_free_block_p first;
+	size_t count;
+} pool_class_t;
+
+// Free lists of one thread. Only the owning thread touches the lists. The byte counters
+// are also read by pool_used_bytes() and pool_cached_bytes() from other threads. used_bytes
+// can become negative when a thread frees blocks allocated by another thread.
+typedef struct pool_cache_s pool_cache_t;
+struct pool_cache_s {
+	pool_free_block_p first[POOL_CLASS_COUNT];
+	size_t count[POOL_CLASS_COUNT];
+	int64_t used_bytes, cached_bytes;
+	pool_cache_t *prev, *next;
+};
+
+static pool_class_t pool_classes[POOL_CLASS_COUNT];
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static size_t shared_cached_bytes = 0;
+
+// All thread caches, only used to sum up the byte counters. retired_used_bytes keeps the
+// counter of caches whose thread already exited.
+static pthread_key_t pool_cache_key;
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_cache_t* caches = NULL;
+static int64_t retired_used_bytes = 0;
+
+static __thread pool_cache_t* thread_cache = NULL;
+
+static void pool_cache_destroy(void* arg);
+
+
+static void pool_init() {
+	for(size_t i = 0; i < POOL_CLASS_COUNT; i++) {
+		pthread_mutex_init(&pool_classes[i].lock, NULL);
+		pool_classes[i].first = NULL;
+		pool_classes[i].count = 0;
+	}
+	pthread_key_create(&pool_cache_key, pool_cache_destroy);
+}
+
+/**
+ * Returns the size class for `size` bytes and its block size. Each power of two range
+ * is divided into 4 classes: 2^n, 1.25 * 2^n, 1.5 * 2^n and 1.75 * 2^n.
+ */
+static size_t pool_class_of(size_t size, size_t* block_size) {
+	if (size <= (1 << POOL_MIN_SHIFT)) {
+		*block_size = 1 << POOL_MIN_SHIFT;
+		return 1;
+	}
+	
+	// Index of the highest set bit of size - 1 tells us the power of two range
+	size_t shift = 63 - __builtin_clzll(size - 1);
+	size_t quarter = (size_t)1 << (shift - 2);
+	size_t quarters = ((size - 1) >> (shift - 2)) - 4 + 1;
+	*block_size = ((size_t)1 << shift) + quarters * quarter;
+	return (shift - POOL_MIN_SHIFT) * 4 + quarters + 1;
+}
+
+/**
+ * Number of blocks moved at once between a thread cache and the shared free list. Small
+ * blocks are moved in large batches, large blocks one at a time.
+ */
+static size_t pool_batch_size(size_t block_size) {
+	size_t blocks = POOL_BATCH_BYTES / block_size;
+	if (blocks < 1)
+		return 1;
+	if (blocks > POOL_MAX_BATCH_BLOCKS)
+		return POOL_MAX_BATCH_BLOCKS;
+	return blocks;
+}
+
+static void counter_add(int64_t* counter, int64_t value) {
+	// Only the owning thread writes the counter, others just read it
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static pool_cache_t* pool_cache() {
+	if (thread_cache)
+		return thread_cache;
+	
+	pthread_once(&pool_once, pool_init);
+	pool_cache_t* cache = calloc(1, sizeof(pool_cache_t));
+	if (cache == NULL)
+		return NULL;
+	
+	pthread_mutex_lock(&caches_lock);
+		cache->next = caches;
+		if (caches)
+			caches->prev = cache;
+		caches = cache;
+	pthread_mutex_unlock(&caches_lock);
+	
+	// Registers pool_cache_destroy() to run when the thread exits
+	pthread_setspecific(pool_cache_key, cache);
+	thread_cache = cache;
+	return cache;
+}
+
+/**
+ * Moves up to `count` blocks of `size_class` from the cache to the shared free list.
+ * Blocks that don't fit into the POOL_MAX_CACHED_BYTES of the shared lists are returned
+ * to free().
+ */
+static void pool_cache_spill(pool_cache_t* cache, size_t size_class, size_t count) {
+	pool_free_block_p first = cache->first[size_class], last = NULL;
+	size_t moved = 0;
+	while (moved < count && cache->first[size_class]) {
+		last = cache->first[size_class];
+		cache->first[size_class] = last->next;
+		moved++;
+	}
+	if (moved == 0)
+		return;
+	cache->count[size_class] -= moved;
+	
+	size_t block_size = ((pool_header_p)first - 1)->block_size;
+	counter_add(&cache->cached_bytes, -(int64_t)(moved * block_size));
+	
+	// The limit is only checked roughly, concurrent spills can exceed it a bit
+	if ( __atomic_load_n(&shared_cached_bytes, __ATOMIC_RELAXED) + moved * block_size > POOL_MAX_CACHED_BYTES ) {
+		last->next = NULL;
+		while (first) {
+			pool_free_block_p next = first->next;
+			free((pool_header_p)first - 1);
+			first = next;
+		}
+		return;
+	}
+	
+	__atomic_add_fetch(&shared_cached_bytes, moved * block_size, __ATOMIC_RELAXED);
+	pool_class_t* class = &pool_classes[size_class];
+	pthread_mutex_lock(&class->lock);
+		last->next = class->first;
+		class->first = first;
+		__atomic_store_n(&class->count, class->count + moved, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&class->lock);
+}
+
+/**
+ * Moves a batch of blocks of `size_class` from the shared free list into the cache.
+ */
+static void pool_cache_refill(pool_cache_t* cache, size_t size_class, size_t block_size) {
+	pool_class_t* class = &pool_classes[size_class];
+	size_t batch = pool_batch_size(block_size);
+	
+	// Only look at the list without the lock, an empty list is the common case for large
+	// blocks and we don't want to lock it for nothing
+	if ( __atomic_load_n(&class->count, __ATOMIC_RELAXED) == 0 )
+		return;
+	
+	pool_free_block_p first = NULL, last = NULL;
+	size_t moved = 0;
+	pthread_mutex_lock(&class->lock);
+		first = class->first;
+		while (moved < batch && class->first) {
+			last = class->first;
+			class->first = last->next;
+			moved++;
+		}
+		__atomic_store_n(&class->count, class->count - moved, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&class->lock);
+	if (moved == 0)
+		return;
+	
+	__atomic_sub_fetch(&shared_cached_bytes, moved * block_size, __ATOMIC_RELAXED);
+	last->next = cache->first[size_class];
+	cache->first[size_class] = first;
+	cache->count[size_class] += moved;
+	counter_add(&cache->cached_bytes, moved * block_size);
+}
+
+/**
+ * Hands all blocks of an exiting thread to the shared free lists.
+ */
+static void pool_cache_destroy(void* arg) {
+	pool_cache_t* cache = arg;
+	for(size_t i = 1; i < POOL_CLASS_COUNT; i++)
+		pool_cache_spill(cache, i, cache->count[i]);
+	
+	pthread_mutex_lock(&caches_lock);
+		if (cache->prev)
+			cache->prev->next = cache->next;
+		else
+			caches = cache->next;
+		if (cache->next)
+			cache->next->prev = cache->prev;
+		retired_used_bytes += cache->used_bytes;
+	pthread_mutex_unlock(&caches_lock);
+	
+	if (thread_cache == cache)
+		thread_cache = NULL;
+	free(cache);
+}
+
+void* pool_alloc(size_t size) {
+	pool_cache_t* cache = pool_cache();
+	if (cache == NULL)
+		return NULL;
+	
+	size_t block_size = size, size_class = 0;
+	if (size <= POOL_MAX_BLOCK_SIZE)
+		size_class = pool_class_of(size, &block_size);
+	
+	pool_header_p header = NULL;
+	if (size_class != 0) {
+		if (cache->first[size_class] == NULL)
+			pool_cache_refill(cache, size_class, block_size);
+		
+		pool_free_block_p block = cache->first[size_class];
+		if (block) {
+			cache->first[size_class] = block->next;
+			cache->count[size_class]--;
+			counter_add(&cache->cached_bytes, -(int64_t)block_size);
+			header = (pool_header_p)block - 1;
+		}
+	}
+	
+	if (header == NULL) {
+		header = malloc(sizeof(pool_header_t) + block_size);
+		if (header == NULL)
+			return NULL;
+		header->size_class = size_class;
+		header->block_size = block_size;
+	}
+	
+	counter_add(&cache->used_bytes, block_size);
+	return header + 1;
+}
+
+void pool_free(void* ptr) {
+	if (ptr == NULL)
+		return;
+	
+	pool_header_p header = (pool_header_p)ptr - 1;
+	pool_cache_t* cache = pool_cache();
+	if (cache == NULL) {
+		free(header);
+		return;
+	}
+	
+	counter_add(&cache->used_bytes, -(int64_t)header->block_size);
+	if (header->size_class == 0) {
+		free(header);
+		return;
+	}
+	
+	size_t size_class = header->size_class;
+	pool_free_block_p block = ptr;
+	block->next = cache->first[size_class];
+	cache->first[size_class] = block;
+	cache->count[size_class]++;
+	counter_add(&cache->cached_bytes, header->block_size);
+	
+	// Keep up to two batches per class in the thread cache. With one batch left the next
+	// allocations and frees of this thread don't have to touch the shared list.
+	size_t batch = pool_batch_size(header->block_size);
+	if (cache->cached_bytes > POOL_MAX_THREAD_CACHED_BYTES)
+		pool_cache_spill(cache, size_class, cache->count[size_class]);
+	else if (cache->count[size_class] > 2 * batch)
+		pool_cache_spill(cache, size_class, batch);
+}
+
+size_t pool_used_bytes() {
+	pthread_mutex_lock(&caches_lock);
+		int64_t bytes = retired_used_bytes;
+		for(pool_cache_t* cache = caches; cache; cache = cache->next)
+			bytes += __atomic_load_n(&cache->used_bytes, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&caches_lock);
+	return (bytes > 0) ? bytes : 0;
+}
+
+size_t pool_cached_bytes() {
+	pthread_mutex_lock(&caches_lock);
+		int64_t bytes = __atomic_load_n(&shared_cached_bytes, __ATOMIC_RELAXED);
+		for(pool_cache_t* cache = caches; cache; cache = cache->next)
+			bytes += __atomic_load_n(&cache->cached_bytes, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&caches_lock);
+	return bytes;
+}
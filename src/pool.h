@@ -0,0 +1,51 @@
+#pragma once
+
+/**
+
+# Size-classed memory pool
+
+Recycles memory blocks instead of returning them to malloc(). Meant for the blocks the
+server allocates and frees all the time (clusters, their shared buffer structs, intro
+buffers of new viewers). Can be used from all threads.
+
+Each request is rounded up to a size class. There are four size classes for each power of
+two, so at most 25% of a block are wasted. Each thread has its own free list per class and
+allocations and frees of a thread don't take any locks as long as they can be served from
+them. Blocks freed by a thread go into its own lists, even if another thread allocated them
+(e.g. a cluster read by one worker and released by another one).
+
+When a thread list holds more than two batches of blocks one batch is moved to a shared
+list of that class. If all lists of a thread together exceed POOL_MAX_THREAD_CACHED_BYTES
+the whole list of the freed class is moved. An allocation with an empty thread list takes a batch from the shared
+list before asking malloc(). A batch is about POOL_BATCH_BYTES, so the shared lists are
+locked once for many small blocks. Once the shared lists hold more than
+POOL_MAX_CACHED_BYTES the spilled blocks are returned to free() instead. This keeps the
+memory held by the pool bounded, so the RSS can come down again after a peak. The lists of
+an exiting thread are moved to the shared lists.
+
+void* ptr = pool_alloc(1500);
+pool_free(ptr);
+
+*/
+
+#include <stddef.h>
+
+// Blocks larger than that are always allocated with malloc() and freed with free()
+#define POOL_MAX_BLOCK_SIZE   (64 * 1024 * 1024)
+// Upper limit of bytes kept in the shared free lists of all classes together
+#define POOL_MAX_CACHED_BYTES (64 * 1024 * 1024)
+// Blocks are moved between the thread and shared free lists in batches of about that many
+// bytes but at most POOL_MAX_BATCH_BLOCKS blocks. A thread keeps at most two batches per
+// class.
+#define POOL_BATCH_BYTES      (256 * 1024)
+#define POOL_MAX_BATCH_BLOCKS 64
+// Upper limit of bytes kept in the free lists of one thread
+#define POOL_MAX_THREAD_CACHED_BYTES (8 * 1024 * 1024)
+
+void* pool_alloc(size_t size);
+void  pool_free(void* ptr);
+
+// Bytes currently handed out by pool_alloc() (including the rounding to size classes)
+// and bytes kept in the thread and shared free lists
+size_t pool_used_bytes();
+size_t pool_cached_bytes();
@@ -24,19 +24,100 @@ ffmpeg -re -i hd-video.mkv -quality realtime -minrate 1M -maxrate 1M -b:v 1M -th
 #include <unistd.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
 #include <poll.h>
 
 #include <signal.h>
 #include <sys/signalfd.h>
 #include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
 
 #include "common.h"
 #include "client.h"
+#include "uring.h"
+#include "worker.h"
+
+
+static int   create_server_socket(struct sockaddr_in* bind_addr);
+static void* worker_main(void* arg);
+
+static void epoll_event_loop(server_p server);
+static void uring_event_loop(server_p server);
+static void uring_release_orphaned_write(server_p server, uint32_t generation);
+
+static void accept_client          (server_p server, int client_fd);
+static void disconnect_client      (server_p server, int client_fd, client_p client);
+static void update_client_events   (server_p server, int client_fd, client_p client);
+static bool process_worker_messages(server_p server, array_p* spare_inbox);
+static void continue_yielded_clients(server_p server, array_p* spare_yielded);
+static void delete_stream          (server_p server, stream_p stream);
+static void delete_expired_streams (server_p workers, size_t worker_count);
+
+static bool use_uring = false;
 
 
 int main(int argc, char** argv) {
+	// Optional arguments first
+	unsigned int worker_count = 1;
+	size_t stream_budget_mib = 0, global_budget_mib = 0;
+	int budget_policy = BUDGET_POLICY_EVICT;
+	char* log_path = NULL;
+	int option;
+	while ( (option = getopt(argc, argv, "b:w:m:M:p:l:")) != -1 ) {
+		switch(option) {
+			case 'b':
+				if ( strcmp(optarg, "uring") == 0 ) {
+					use_uring = true;
+				} else if ( strcmp(optarg, "epoll") != 0 ) {
+					fprintf(stderr, "unknown I/O backend: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'w':
+				if ( sscanf(optarg, "%u", &worker_count) != 1 || worker_count < 1 ) {
+					fprintf(stderr, "invalid worker count: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'm':
+				if ( sscanf(optarg, "%zu", &stream_budget_mib) != 1 ) {
+					fprintf(stderr, "invalid stream budget: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'M':
+				if ( sscanf(optarg, "%zu", &global_budget_mib) != 1 ) {
+					fprintf(stderr, "invalid global budget: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'p':
+				if ( strcmp(optarg, "evict") == 0 ) {
+					budget_policy = BUDGET_POLICY_EVICT;
+				} else if ( strcmp(optarg, "pause") == 0 ) {
+					budget_policy = BUDGET_POLICY_PAUSE_SOURCE;
+				} else {
+					fprintf(stderr, "unknown budget policy: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'l':
+				log_path = optarg;
+				break;
+			default:
+				goto usage;
+		}
+	}
+	
+	// Skip the options so the positional arguments start at argv[1]
+	argc -= optind - 1;
+	argv += optind - 1;
+	
 	if (argc != 5) {
-		fprintf(stderr, "usage: %s bind-addr port log-level stream-timeout-in-sec\n", argv[0]);
+		usage:
+		fprintf(stderr, "usage: %s [-b epoll|uring] [-w workers] [-m stream-budget-in-mib] [-M global-budget-in-mib] [-p evict|pause] [-l log-file]\n"
+			"       bind-addr port log-level stream-timeout-in-sec\n", argv[0]);
 		return 1;
 	}
 	
@@ -60,9 +141,11 @@ int main(int argc, char** argv) {
 		return 1;
 	}
 	
-	logger_setup(log_level);
+	if (log_level < LOG_MIN_LEVEL)
+		fprintf(stderr, "debug messages are compiled out of this build (see LOG_MIN_LEVEL)\n");
+	logger_setup(log_level, log_path);
 	
-	// Setup SIGINT and SIGTERM to terminate our poll loop. For that we read them via a signal fd.
+	// Setup SIGINT and SIGTERM to terminate our event loop. For that we read them via a signal fd.
 	// To prevent the signals from interrupting our process we need to block them first.
 	sigset_t signal_mask;
 	sigemptyset(&signal_mask);
@@ -76,6 +159,10 @@ int main(int argc, char** argv) {
 	if (signals == -1)
 		perror("signalfd"), exit(1);
 	
+	// Viewers are written to right after new data arrived, that might be before we saw
+	// their hangup. Get EPIPE from write() instead of getting killed by SIGPIPE.
+	signal(SIGPIPE, SIG_IGN);
+	
 	
 	client_handlers_init();
 	
@@ -92,69 +179,64 @@ int main(int argc, char** argv) {
 	timerfd_settime(timer, 0, &timer_setup, NULL);
 	
 	
-	// Setup HTTP server socket.
-	// Use SO_REUSEADDR in case we have to restart the server with clients still connected.
+	// Setup the workers. Each one gets its own server socket and event loop. The kernel
+	// distributes new connections among them (SO_REUSEPORT). Only the streams are shared.
 	uint16_t port = atoi(argv[2]);
 	struct sockaddr_in http_bind_addr = { AF_INET, htons(port), { INADDR_ANY }, {0} };
 	inet_pton(AF_INET, argv[1], &http_bind_addr.sin_addr);
 	
-	int http_server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
-	
-	int value = 1;
-	if ( setsockopt(http_server_fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value)) == -1 )
-		perror("setsockopt"), exit(1);
-	if ( bind(http_server_fd, &http_bind_addr, sizeof(http_bind_addr)) == -1 )
-		perror("bind"), exit(1);
+	dict_p streams = dict_of(stream_p);
+	pthread_mutex_t streams_lock = PTHREAD_MUTEX_INITIALIZER;
+	server_p workers = calloc(worker_count, sizeof(server_t));
 	
-	if ( listen(http_server_fd, 3) == -1 )
-		perror("listen"), exit(1);
+	for(size_t i = 0; i < worker_count; i++) {
+		server_p worker = &workers[i];
+		worker->clients = hash_of(client_t);
+		worker->streams = streams;
+		worker->streams_lock = &streams_lock;
+		worker->stream_delete_timeout_sec = timeout; //15 * 60;
+		worker->stream_budget = stream_budget_mib * 1024 * 1024;
+		worker->global_budget = global_budget_mib * 1024 * 1024;
+		worker->budget_policy = budget_policy;
+		worker->clients_with_changed_flags = array_of(int);
+		worker->yielded_clients = array_of(int);
+		
+		worker->workers = workers;
+		worker->worker_count = worker_count;
+		worker->worker_index = i;
+		worker->http_server_fd = create_server_socket(&http_bind_addr);
+		
+		pthread_mutex_init(&worker->inbox_lock, NULL);
+		worker->inbox = array_of(worker_message_t);
+		worker->inbox_fd = eventfd(0, EFD_NONBLOCK);
+		if (worker->inbox_fd == -1)
+			perror("eventfd"), exit(1);
+	}
 	
 	char ip_addr_text[INET6_ADDRSTRLEN];
 	inet_ntop(http_bind_addr.sin_family, &http_bind_addr.sin_addr, ip_addr_text, sizeof(ip_addr_text));
-	info("[server] listening on %s:%d", ip_addr_text, ntohs(http_bind_addr.sin_port));
+	info("[server] listening on %s:%d with %u workers", ip_addr_text, ntohs(http_bind_addr.sin_port), worker_count);
 	
+	// The signals are still blocked, so the worker threads inherit that signal mask
+	for(size_t i = 0; i < worker_count; i++) {
+		int error = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+		if (error != 0)
+			fprintf(stderr, "pthread_create: %s\n", strerror(error)), exit(1);
+	}
 	
-	// Setup stuff for the poll loop
-	server_t server;
-	memset(&server, 0, sizeof(server));
-	server.clients = hash_of(client_t);
-	server.streams = dict_of(stream_p);
-	server.stream_delete_timeout_sec = timeout; //15 * 60;
 	
-	// Small helper used multiple times in the poll loop
-	void disconnect_client(int client_fd, client_p client, hash_elem_t e) {
-		shutdown(client_fd, SHUT_RDWR);
-		close(client_fd);
-		
-		client_handler(client_fd, client, &server, CLIENT_CON_CLEANUP);
-		hash_remove_elem(server.clients, e);
-	}
+	// The main thread only waits for signals to shutdown the server and deletes expired streams
+	struct pollfd pollfds[] = {
+		{ .fd = signals, .events = POLLIN },
+		{ .fd = timer,   .events = POLLIN }
+	};
 	
-	// Do the poll loop
 	while (true) {
-		size_t non_client_fds = 3;
-		size_t pollfds_length = non_client_fds + server.clients->length;
-		struct pollfd pollfds[pollfds_length];
-		pollfds[0] = (struct pollfd){ signals, POLLIN, 0 };
-		pollfds[1] = (struct pollfd){ http_server_fd,  POLLIN, 0 };
-		pollfds[2] = (struct pollfd){ timer,  POLLIN, 0 };
-		
-		size_t i = non_client_fds;
-		for(hash_elem_t e = hash_start(server.clients); e != NULL; e = hash_next(server.clients, e), i++) {
-			int client_fd = hash_key(e);
-			client_p client = hash_value_ptr(e);
-			
-			short events = 0;
-			if (client->flags & CLIENT_POLL_FOR_READ)
-				events |= POLLIN;
-			if (client->flags & CLIENT_POLL_FOR_WRITE)
-				events |= POLLOUT;
-			
-			pollfds[i] = (struct pollfd){ client_fd, events, 0 };
-		}
-		
-		if ( poll(pollfds, sizeof(pollfds) / sizeof(pollfds[0]), -1) == -1 )
+		if ( poll(pollfds, sizeof(pollfds) / sizeof(pollfds[0]), -1) == -1 ) {
+			if (errno == EINTR)
+				continue;
 			perror("poll"), exit(1);
+		}
 		
 		// Check for incomming signals to shutdown the server
 		if (pollfds[0].revents & POLLIN) {
@@ -163,27 +245,171 @@ int main(int argc, char** argv) {
 			if ( read(signals, &infos, sizeof(infos)) == -1 )
 				warn("[server] failed to consume signal from signalfd: %s", strerror(errno));
 			
-			// Break poll loop
+			// Break event loop
 			break;
 		}
 		
-		// Check for incomming data from clients. For this to work the clients hash must not
-		// be changed between the poll() call and here. Because of this we handle new connections
-		// at the end.
-		i = non_client_fds;
-		for(hash_elem_t e = hash_start(server.clients); e != NULL; e = hash_next(server.clients, e), i++) {
-			int client_fd = pollfds[i].fd;
-			client_p client = hash_value_ptr(e);
+		if (pollfds[1].revents & POLLIN) {
+			uint64_t expirations;
+			ssize_t bytes_read = read(timer, &expirations, sizeof(expirations));
 			
-			if ( pollfds[i].revents & POLLHUP ) {
-				info("[client %d]: disconnected via POLLHUP", client_fd);
-				disconnect_client(client_fd, client, e);
+			// If the read failed we just try again on the next event loop iteration
+			if (bytes_read == sizeof(expirations))
+				delete_expired_streams(workers, worker_count);
+		}
+	}
+	
+	
+	// Clean up time
+	info("[server] cleaning up");
+	
+	for(size_t i = 0; i < worker_count; i++)
+		worker_post_message(&workers[i], (worker_message_t){ .type = WORKER_MESSAGE_STOP });
+	for(size_t i = 0; i < worker_count; i++)
+		pthread_join(workers[i].thread, NULL);
+	
+	for(size_t i = 0; i < worker_count; i++) {
+		server_p worker = &workers[i];
+		hash_destroy(worker->clients);
+		array_destroy(worker->clients_with_changed_flags);
+		array_destroy(worker->yielded_clients);
+		array_destroy(worker->inbox);
+		pthread_mutex_destroy(&worker->inbox_lock);
+		close(worker->inbox_fd);
+		close(worker->http_server_fd);
+	}
+	status_json_free_cache(&workers[0]);
+	free(workers);
+	dict_destroy(streams);
+	pthread_mutex_destroy(&streams_lock);
+	
+	close(timer);
+	close(signals);
+	if ( sigprocmask(SIG_UNBLOCK, &signal_mask, NULL) == -1 )
+		perror("sigprocmask"), exit(1);
+	
+	return 0;
+}
+
+/**
+ * Creates a non-blocking server socket. SO_REUSEPORT allows each worker to bind its own
+ * socket to the same address. Use SO_REUSEADDR in case we have to restart the server with
+ * clients still connected.
+ */
+static int create_server_socket(struct sockaddr_in* bind_addr) {
+	int http_server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (http_server_fd == -1)
+		perror("socket"), exit(1);
+	
+	int value = 1;
+	if ( setsockopt(http_server_fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value)) == -1 )
+		perror("setsockopt"), exit(1);
+	if ( setsockopt(http_server_fd, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)) == -1 )
+		perror("setsockopt"), exit(1);
+	if ( bind(http_server_fd, bind_addr, sizeof(*bind_addr)) == -1 )
+		perror("bind"), exit(1);
+	
+	if ( listen(http_server_fd, 3) == -1 )
+		perror("listen"), exit(1);
+	
+	return http_server_fd;
+}
+
+static void* worker_main(void* arg) {
+	server_p server = arg;
+	
+	if (use_uring)
+		uring_event_loop(server);
+	else
+		epoll_event_loop(server);
+	
+	return NULL;
+}
+
+
+//
+// epoll backend
+//
+
+static uint32_t epoll_events_for(uint32_t client_flags) {
+	uint32_t events = EPOLLET;
+	if (client_flags & CLIENT_POLL_FOR_READ)
+		events |= EPOLLIN;
+	if (client_flags & CLIENT_POLL_FOR_WRITE)
+		events |= EPOLLOUT;
+	return events;
+}
+
+// Clients a worker writes to right after they got new data per round of its event loop.
+// Above that the remaining clients are written to when epoll reports them as writable,
+// so one worker with many viewers still gets to its other events.
+#define EPOLL_EAGER_WRITES_PER_ROUND 1024
+
+/**
+ * The inbox eventfd and server socket are level-triggered. Client connections are
+ * registered edge-triggered once when they connect. Afterwards their registration is
+ * only modified when the CLIENT_POLL_FOR_* flags of a client actually change. The
+ * client handler always reads or writes until it gets an EAGAIN so we don't miss
+ * any edges.
+ */
+static void epoll_event_loop(server_p server) {
+	server->epoll_fd = epoll_create1(0);
+	if (server->epoll_fd == -1)
+		perror("epoll_create1"), exit(1);
+	
+	int http_server_fd = server->http_server_fd, inbox_fd = server->inbox_fd;
+	int non_client_fds[] = { http_server_fd, inbox_fd };
+	for(size_t i = 0; i < sizeof(non_client_fds) / sizeof(non_client_fds[0]); i++) {
+		struct epoll_event event = { .events = EPOLLIN, .data.fd = non_client_fds[i] };
+		if ( epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, non_client_fds[i], &event) == -1 )
+			perror("epoll_ctl"), exit(1);
+	}
+	
+	array_p spare_inbox = array_of(worker_message_t), spare_yielded = array_of(int);
+	struct epoll_event events[256];
+	bool running = true;
+	while (running) {
+		// Don't block while viewers wait to continue their writes
+		int timeout = (server->yielded_clients->length > 0) ? 0 : -1;
+		int event_count = epoll_wait(server->epoll_fd, events, sizeof(events) / sizeof(events[0]), timeout);
+		if (event_count == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait"), exit(1);
+		}
+		
+		bool new_messages = false, new_connections = false;
+		for(int i = 0; i < event_count; i++) {
+			if (events[i].data.fd == inbox_fd)
+				new_messages = true;
+			else if (events[i].data.fd == http_server_fd)
+				new_connections = true;
+		}
+		
+		// Handle events of clients. Only clients with pending events are touched here. Clients
+		// disconnected earlier in this batch are no longer in the clients hash and are skipped.
+		// New connections are handled at the end so a reused file descriptor never receives
+		// a stale event of its previous connection. Reads are handled first so new clusters
+		// of sources don't wait behind the writes of viewers.
+		for(int i = 0; i < event_count; i++) {
+			int client_fd = events[i].data.fd;
+			if (client_fd == inbox_fd || client_fd == http_server_fd)
+				continue;
+			
+			client_p client = hash_get_ptr(server->clients, client_fd);
+			if (client == NULL)
+				continue;
+			
+			if ( events[i].events & EPOLLHUP ) {
+				info("[client %d]: disconnected via EPOLLHUP", client_fd);
+				disconnect_client(server, client_fd, client);
+				hash_remove(server->clients, client_fd);
 				continue;
 			}
 			
 			// In case of an error we disconnect the client. Not perfect but this way we
 			// at least will notice errors.
-			if ( pollfds[i].revents & POLLERR ) {
+			if ( events[i].events & EPOLLERR ) {
 				int error = 0;
 				socklen_t error_len = sizeof(error);
 				if ( getsockopt(client_fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0 )
@@ -191,86 +417,606 @@ int main(int argc, char** argv) {
 				else
 					warn("[client %d] disconnected because of unknown socket error (failed to get error code with getsockopt(): %s)", client_fd, strerror(errno));
 				
-				disconnect_client(client_fd, client, e);
+				disconnect_client(server, client_fd, client);
+				hash_remove(server->clients, client_fd);
 				continue;
 			}
 			
-			if ( pollfds[i].revents & POLLIN ) {
-				if ( client_handler(client_fd, client, &server, CLIENT_CON_READABLE) == -1 ) {
+			// With edge-triggered events we might get an event the client isn't interested
+			// in right now. We can ignore it since the registration is modified when the client
+			// becomes interested and that reports the current readiness again.
+			if ( (events[i].events & EPOLLIN) && (client->flags & CLIENT_POLL_FOR_READ) ) {
+				if ( client_handler(client_fd, client, server, CLIENT_CON_READABLE) == -1 ) {
 					info("[client %d] disconnected via client handler", client_fd);
-					disconnect_client(client_fd, client, e);
+					disconnect_client(server, client_fd, client);
+					hash_remove(server->clients, client_fd);
+					continue;
 				}
 			}
+		}
+		
+		for(int i = 0; i < event_count; i++) {
+			int client_fd = events[i].data.fd;
+			if (client_fd == inbox_fd || client_fd == http_server_fd)
+				continue;
 			
-			if ( pollfds[i].revents & POLLOUT ) {
-				if ( client_handler(client_fd, client, &server, CLIENT_CON_WRITABLE) == -1 ) {
+			client_p client = hash_get_ptr(server->clients, client_fd);
+			if (client == NULL)
+				continue;
+			
+			// Viewers that used up their write budget continue after all the others
+			if ( (events[i].events & EPOLLOUT) && (client->flags & CLIENT_POLL_FOR_WRITE) && !(client->flags & CLIENT_WRITE_YIELDED) ) {
+				if ( client_handler(client_fd, client, server, CLIENT_CON_WRITABLE) == -1 ) {
 					info("[client %d] disconnected via client handler", client_fd);
-					disconnect_client(client_fd, client, e);
+					disconnect_client(server, client_fd, client);
+					hash_remove(server->clients, client_fd);
+					continue;
 				}
 			}
+			
+			update_client_events(server, client_fd, client);
 		}
 		
-		if (pollfds[2].revents & POLLIN) {
-			uint64_t expirations;
-			ssize_t bytes_read = read(timer, &expirations, sizeof(expirations));
+		// Clusters received by other workers unstall viewers, too
+		if (new_messages)
+			running = process_worker_messages(server, &spare_inbox);
+		
+		continue_yielded_clients(server, &spare_yielded);
+		
+		// Client handlers can change the flags of other clients (e.g. a received cluster
+		// unstalls viewers). Clients that want to write again are usually caught up viewers
+		// with empty socket buffers. They write right away instead of waiting for the next
+		// epoll_wait() round, only on EAGAIN they're left to epoll. Then update the
+		// registration of those clients, too.
+		size_t eager_writes = 0;
+		for(size_t i = 0; i < server->clients_with_changed_flags->length; i++) {
+			int client_fd = array_elem(server->clients_with_changed_flags, int, i);
+			client_p client = hash_get_ptr(server->clients, client_fd);
+			if (client == NULL)
+				continue;
 			
-			// If the read failed we just try again on the next poll iteration
-			if (bytes_read == sizeof(expirations)) {
+			bool wants_to_write = (client->flags & CLIENT_POLL_FOR_WRITE) && !(client->polled_flags & CLIENT_POLL_FOR_WRITE) && !(client->flags & CLIENT_WRITE_YIELDED);
+			if (wants_to_write && eager_writes < EPOLL_EAGER_WRITES_PER_ROUND) {
+				eager_writes++;
+				if ( client_handler(client_fd, client, server, CLIENT_CON_WRITABLE) == -1 ) {
+					info("[client %d] disconnected via client handler", client_fd);
+					disconnect_client(server, client_fd, client);
+					hash_remove(server->clients, client_fd);
+					continue;
+				}
+			}
+			
+			update_client_events(server, client_fd, client);
+		}
+		array_resize(server->clients_with_changed_flags, 0);
+		
+		// Check for new connections. The server socket is non-blocking so we can accept
+		// all pending connections at once.
+		if (new_connections) {
+			while (true) {
+				int client_fd = accept4(http_server_fd, NULL, NULL, SOCK_NONBLOCK);
+				if (client_fd == -1) {
+					if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED)
+						break;
+					perror("accept4"), exit(1);
+				}
 				
-				// Delete expired streams
-				for(dict_elem_t e = dict_start(server.streams); e != NULL; e = dict_next(server.streams, e)) {
-					stream_p stream = dict_value(e, stream_p);
-					if (stream->last_disconnect_at != 0 && stream->last_disconnect_at + server.stream_delete_timeout_sec * 1000000LL < time_now()) {
-						info("[stream %s] deleting stream, no new data arrived within timeout of %d seconds", dict_key(e), server.stream_delete_timeout_sec);
-						
-						// First disconnect all clients watching that stream. This also unrefs any remaining stream buffers.
-						for(hash_elem_t ce = hash_start(server.clients); ce != NULL; ce = hash_next(server.clients, ce)) {
-							int client_fd = hash_key(ce);
-							client_p client = hash_value_ptr(ce);
-							if (client->stream == stream) {
-								info("[client %d] disconnected because stream was deleted", client_fd);
-								disconnect_client(client_fd, client, ce);
-							}
-						}
-						
-						// Free stream stuff
-						list_destroy(stream->stream_buffers);
-						free(stream->header.ptr);
-						fclose(stream->intro_stream);
-						free(stream->intro_buffer.ptr);
-						
-						dict_remove_elem(server.streams, e);
-						free(stream);
+				accept_client(server, client_fd);
+			}
+		}
+	}
+	
+	array_destroy(spare_inbox);
+	array_destroy(spare_yielded);
+	close(server->epoll_fd);
+}
+
+
+//
+// io_uring backend
+//
+
+// Type of an io_uring request. Stored in the lowest 4 bits of the user data. The bits
+// above contain the CLIENT_POLL_FOR_* flags of a poll request (bits 4 and 5), the file
+// descriptor (bits 8 to 31) and the generation of the client (bits 32 to 63). Thanks to
+// the generation completions of requests that belong to an already disconnected client
+// are ignored even when the file descriptor was reused in the meantime.
+#define URING_POLL    1
+#define URING_ACCEPT  2
+#define URING_WRITE   3
+#define URING_IGNORE  4
+
+// Write request of a viewer that disconnected before it completed. It holds the reference
+// to the cluster the viewer had for the write and a reference to its stream, since the
+// stream might be deleted before the request completes.
+typedef struct {
+	uint32_t io_generation;
+	shared_buffer_p buffer;
+} uring_orphaned_write_t;
+
+static uint64_t uring_user_data(int type, int fd, uint32_t generation, uint32_t poll_flags) {
+	return (uint64_t)generation << 32 | (uint64_t)(fd & 0xffffff) << 8 | (poll_flags & 0xf) << 4 | type;
+}
+
+static uint32_t uring_poll_events_for(uint32_t client_flags) {
+	uint32_t events = 0;
+	if (client_flags & CLIENT_POLL_FOR_READ)
+		events |= POLLIN;
+	if (client_flags & CLIENT_POLL_FOR_WRITE)
+		events |= POLLOUT;
+	return events;
+}
+
+/**
+ * Returns false if there is no submission queue entry for the poll request (see
+ * uring_get_sqe()), errno is set then.
+ */
+static bool uring_arm_client_poll(server_p server, int client_fd, client_p client, uint32_t poll_flags) {
+	struct io_uring_sqe* sqe = uring_get_sqe(server->uring);
+	if (sqe == NULL)
+		return false;
+	
+	// Poll requests always report POLLHUP and POLLERR, even if we aren't interested in
+	// reading or writing right now.
+	uring_prep_poll_multishot(sqe, client_fd, uring_poll_events_for(poll_flags), uring_user_data(URING_POLL, client_fd, client->io_generation, poll_flags));
+	client->polled_flags = poll_flags;
+	return true;
+}
+
+/**
+ * Unlike epoll every I/O is done by the client handler, like the epoll backend. Readiness
+ * is reported by multishot poll requests, new connections by a multishot accept request.
+ * The difference is how we handle viewers unstalled by a newly received cluster: Instead
+ * of polling for writability their first write is submitted directly as io_uring request.
+ * All those writes are submitted as one batch with the next io_uring_enter() call. Cluster
+ * buffers are registered as fixed buffers by the client handler (see server->uring) so
+ * the kernel doesn't have to map them for each write. When a write completes the client
+ * handler continues with the rest, just as it would after a poll event.
+ */
+static void uring_event_loop(server_p server) {
+	int http_server_fd = server->http_server_fd, inbox_fd = server->inbox_fd;
+	array_p spare_inbox = array_of(worker_message_t), spare_yielded = array_of(int);
+	
+	uring_t ring;
+	if ( uring_init(&ring, 4096, 1024) == -1 )
+		perror("io_uring_setup"), exit(1);
+	server->uring = &ring;
+	server->next_io_generation = 1;
+	server->orphaned_writes = array_of(uring_orphaned_write_t);
+	
+	if (ring.buffer_table_size == 0)
+		warn("[server] io_uring: kernel doesn't support sparse buffer tables, using normal writes");
+	
+	bool inbox_armed = false, accept_armed = false;
+	bool running = true;
+	while (running) {
+		// Arm the multishot requests for worker messages and new connections, again after
+		// they ended. Without a submission queue entry (see uring_get_sqe()) we try again in
+		// the next round. The inbox eventfd uses the generation 0 which is never used by
+		// clients.
+		struct io_uring_sqe* arm_sqe = NULL;
+		if ( !inbox_armed && (arm_sqe = uring_get_sqe(&ring)) != NULL ) {
+			uring_prep_poll_multishot(arm_sqe, inbox_fd, POLLIN, uring_user_data(URING_POLL, inbox_fd, 0, 0));
+			inbox_armed = true;
+		}
+		if ( !accept_armed && (arm_sqe = uring_get_sqe(&ring)) != NULL ) {
+			uring_prep_accept_multishot(arm_sqe, http_server_fd, SOCK_NONBLOCK, uring_user_data(URING_ACCEPT, http_server_fd, 0, 0));
+			accept_armed = true;
+		}
+		if (!inbox_armed || !accept_armed)
+			warn("[server] io_uring: failed to poll for worker messages or new connections, retrying: %s", strerror(errno));
+		
+		// Don't block while viewers wait to continue their writes or we have to retry the
+		// requests above
+		unsigned wait_nr = (server->yielded_clients->length > 0 || !inbox_armed || !accept_armed) ? 0 : 1;
+		if ( uring_submit_and_wait(&ring, wait_nr) == -1 ) {
+			if (errno == EINTR || errno == EBUSY)
+				continue;
+			perror("io_uring_enter"), exit(1);
+		}
+		
+		for(struct io_uring_cqe* cqe = NULL; (cqe = uring_peek_cqe(&ring)) != NULL; uring_cqe_seen(&ring)) {
+			int type = cqe->user_data & 0xf;
+			uint32_t poll_flags = (cqe->user_data >> 4) & 0xf;
+			int fd = (cqe->user_data >> 8) & 0xffffff;
+			uint32_t generation = cqe->user_data >> 32;
+			bool more = (cqe->flags & IORING_CQE_F_MORE);
+			
+			if (type == URING_ACCEPT) {
+				if (cqe->res >= 0)
+					accept_client(server, cqe->res);
+				else
+					warn("[server] accept failed: %s", strerror(-cqe->res));
+				
+				if (!more)
+					accept_armed = false;
+				continue;
+			}
+			
+			if (type == URING_POLL && generation == 0) {
+				if ( !process_worker_messages(server, &spare_inbox) )
+					running = false;
+				
+				if (!more)
+					inbox_armed = false;
+				continue;
+			}
+			
+			if (type != URING_POLL && type != URING_WRITE)
+				continue;
+			
+			// Ignore completions of requests that belong to already disconnected clients. Only
+			// the clusters of their writes are released now.
+			int client_fd = fd;
+			client_p client = hash_get_ptr(server->clients, client_fd);
+			if (client == NULL || client->io_generation != generation) {
+				if (type == URING_WRITE)
+					uring_release_orphaned_write(server, generation);
+				continue;
+			}
+			
+			int handler_flags = 0;
+			if (type == URING_WRITE) {
+				client->flags &= ~CLIENT_WRITE_IN_FLIGHT;
+				shared_buffer_unref(server, client->write_buffer);
+				client->write_buffer = NULL;
+				
+				if (cqe->res >= 0) {
+					// Only viewers submit writes
+					metric_add(&client->stream->feeds[server->worker_index].fanout_bytes, cqe->res);
+					client->buffer.ptr  += cqe->res;
+					client->buffer.size -= cqe->res;
+					handler_flags = CLIENT_CON_WRITABLE;
+				} else if (cqe->res != -EAGAIN) {
+					warn("[client %d] write error: %s", client_fd, strerror(-cqe->res));
+					disconnect_client(server, client_fd, client);
+					hash_remove(server->clients, client_fd);
+					continue;
+				}
+				// On EAGAIN the client still wants to write, so we poll for writability below
+			} else {
+				// The poll request ended (e.g. because it was replaced by a poll with other
+				// flags). Arm a new one if it wasn't removed by us. Without one we wouldn't
+				// notice anything happening on the connection any more.
+				if (!more && cqe->res != -ECANCELED && poll_flags == client->polled_flags) {
+					if ( !uring_arm_client_poll(server, client_fd, client, poll_flags) ) {
+						warn("[client %d] io_uring: failed to poll connection, disconnecting: %s", client_fd, strerror(errno));
+						disconnect_client(server, client_fd, client);
+						hash_remove(server->clients, client_fd);
+						continue;
 					}
 				}
+				if (cqe->res < 0 || poll_flags != client->polled_flags)
+					continue;
+				
+				if ( cqe->res & POLLHUP ) {
+					info("[client %d]: disconnected via POLLHUP", client_fd);
+					disconnect_client(server, client_fd, client);
+					hash_remove(server->clients, client_fd);
+					continue;
+				}
+				
+				if ( cqe->res & POLLERR ) {
+					int error = 0;
+					socklen_t error_len = sizeof(error);
+					if ( getsockopt(client_fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0 )
+						warn("[client %d] disconnected because of socket error: %s", client_fd, strerror(error));
+					else
+						warn("[client %d] disconnected because of unknown socket error (failed to get error code with getsockopt(): %s)", client_fd, strerror(errno));
+					
+					disconnect_client(server, client_fd, client);
+					hash_remove(server->clients, client_fd);
+					continue;
+				}
+				
+				if ( (cqe->res & POLLIN) && (client->flags & CLIENT_POLL_FOR_READ) )
+					handler_flags |= CLIENT_CON_READABLE;
+				if ( (cqe->res & POLLOUT) && (client->flags & CLIENT_POLL_FOR_WRITE) && !(client->flags & CLIENT_WRITE_YIELDED) )
+					handler_flags |= CLIENT_CON_WRITABLE;
 			}
+			
+			if ( (handler_flags & CLIENT_CON_READABLE) && client_handler(client_fd, client, server, CLIENT_CON_READABLE) == -1 ) {
+				info("[client %d] disconnected via client handler", client_fd);
+				disconnect_client(server, client_fd, client);
+				hash_remove(server->clients, client_fd);
+				continue;
+			}
+			
+			if ( (handler_flags & CLIENT_CON_WRITABLE) && client_handler(client_fd, client, server, CLIENT_CON_WRITABLE) == -1 ) {
+				info("[client %d] disconnected via client handler", client_fd);
+				disconnect_client(server, client_fd, client);
+				hash_remove(server->clients, client_fd);
+				continue;
+			}
+			
+			update_client_events(server, client_fd, client);
 		}
 		
-		// Check for new connections
-		if (pollfds[1].revents & POLLIN) {
-			int client_fd = accept4(http_server_fd, NULL, NULL, SOCK_NONBLOCK);
-			if (client_fd == -1)
-				perror("accept4"), exit(1);
+		continue_yielded_clients(server, &spare_yielded);
+		
+		// Submit the writes for all viewers unstalled while handling the completions above.
+		// They're send along with all other requests on the next io_uring_enter() call.
+		for(size_t i = 0; i < server->clients_with_changed_flags->length; i++) {
+			int client_fd = array_elem(server->clients_with_changed_flags, int, i);
+			client_p client = hash_get_ptr(server->clients, client_fd);
+			if (client == NULL)
+				continue;
 			
-			info("[client %d] connected", client_fd);
-			client_p client = hash_put_ptr(server.clients, client_fd);
-			memset(client, 0, sizeof(client_t));
-			client_handler(client_fd, client, &server, 0);
+			bool wants_to_write = (client->flags & CLIENT_POLL_FOR_WRITE) && !(client->flags & (CLIENT_WRITE_IN_FLIGHT | CLIENT_WRITE_YIELDED));
+			stream_buffer_p stream_buffer = stream_buffer_of_viewer(server, client);
+			struct io_uring_sqe* sqe = NULL;
+			if (wants_to_write && stream_buffer && client->buffer.size > 0 && (sqe = uring_get_sqe(&ring)) == NULL)
+				warn("[client %d] io_uring: failed to submit write, polling for writability instead: %s", client_fd, strerror(errno));
+			if (sqe) {
+				uint64_t user_data = uring_user_data(URING_WRITE, client_fd, client->io_generation, 0);
+				
+				// Viewers sending the reduced variant of a cluster can't use the registered buffer
+				bool in_registered_buffer = client->buffer.ptr >= stream_buffer->ptr && client->buffer.ptr < stream_buffer->ptr + stream_buffer->size;
+				if (stream_buffer->registered_index != -1 && in_registered_buffer)
+					uring_prep_write_fixed(sqe, client_fd, client->buffer.ptr, client->buffer.size, stream_buffer->registered_index, user_data);
+				else
+					uring_prep_write(sqe, client_fd, client->buffer.ptr, client->buffer.size, user_data);
+				
+				// The kernel reads from the cluster until the request completes, even if the
+				// stream feed releases it in the meantime (ring wrap-around or eviction). The
+				// reduced variant is freed along with the cluster.
+				shared_buffer_ref(stream_buffer->shared);
+				client->write_buffer = stream_buffer->shared;
+				client->flags |= CLIENT_WRITE_IN_FLIGHT;
+			}
+			
+			update_client_events(server, client_fd, client);
 		}
+		array_resize(server->clients_with_changed_flags, 0);
 	}
 	
+	// Like the clients still connected, the clusters of the writes still in flight are
+	// left to the OS on shutdown
+	server->uring = NULL;
+	uring_destroy(&ring);
+	array_destroy(server->orphaned_writes);
+	array_destroy(spare_inbox);
+	array_destroy(spare_yielded);
+}
+
+/**
+ * Releases the cluster of a write request whose viewer disconnected before it completed.
+ */
+static void uring_release_orphaned_write(server_p server, uint32_t generation) {
+	array_p orphaned_writes = server->orphaned_writes;
+	for(size_t i = 0; i < orphaned_writes->length; i++) {
+		uring_orphaned_write_t orphan = array_elem(orphaned_writes, uring_orphaned_write_t, i);
+		if (orphan.io_generation != generation)
+			continue;
+		
+		stream_p stream = orphan.buffer->stream;
+		shared_buffer_unref(server, orphan.buffer);
+		stream_unref(stream);
+		
+		array_remove(orphaned_writes, i);
+		return;
+	}
+}
+
+
+//
+// Functions used by all backends
+//
+
+static void accept_client(server_p server, int client_fd) {
+	info("[client %d] connected", client_fd);
+	client_p client = hash_put_ptr(server->clients, client_fd);
+	memset(client, 0, sizeof(client_t));
+	client->io_generation = server->next_io_generation++;
+	client_handler(client_fd, client, server, 0);
 	
-	// Clean up time
-	info("[server] cleaning up");
+	uint32_t poll_flags = client->flags & (CLIENT_POLL_FOR_READ | CLIENT_POLL_FOR_WRITE);
+	if (server->uring) {
+		if ( !uring_arm_client_poll(server, client_fd, client, poll_flags) ) {
+			warn("[client %d] io_uring: failed to poll connection, disconnecting: %s", client_fd, strerror(errno));
+			disconnect_client(server, client_fd, client);
+			hash_remove(server->clients, client_fd);
+		}
+	} else {
+		client->polled_flags = poll_flags;
+		struct epoll_event event = { .events = epoll_events_for(poll_flags), .data.fd = client_fd };
+		if ( epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1 )
+			perror("epoll_ctl"), exit(1);
+	}
+}
+
+/**
+ * Doesn't remove the client from the clients hash. The caller has to do that since
+ * hash_remove() might resize the hash and break any running iteration.
+ */
+static void disconnect_client(server_p server, int client_fd, client_p client) {
+	if (server->uring) {
+		// A poll request we can't remove reports the closed connection with the old
+		// io_generation, that completion is ignored
+		struct io_uring_sqe* sqe = uring_get_sqe(server->uring);
+		if (sqe)
+			uring_prep_poll_remove(sqe, uring_user_data(URING_POLL, client_fd, client->io_generation, client->polled_flags), uring_user_data(URING_IGNORE, client_fd, 0, 0));
+		else
+			warn("[client %d] io_uring: failed to remove poll request: %s", client_fd, strerror(errno));
+		
+		// The completion of a write in flight releases the cluster of the write
+		if (client->write_buffer) {
+			stream_ref(client->write_buffer->stream);
+			array_append(server->orphaned_writes, uring_orphaned_write_t, ((uring_orphaned_write_t){ client->io_generation, client->write_buffer }));
+			client->write_buffer = NULL;
+		}
+	} else {
+		epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client_fd, NULL);
+	}
 	
-	hash_destroy(server.clients);
-	dict_destroy(server.streams);
+	// A write request still in flight fails after the shutdown. It holds its own reference
+	// to the socket so we can close the file descriptor right away.
+	shutdown(client_fd, SHUT_RDWR);
+	close(client_fd);
 	
-	close(http_server_fd);
-	close(timer);
-	close(signals);
-	if ( sigprocmask(SIG_UNBLOCK, &signal_mask, NULL) == -1 )
-		perror("sigprocmask"), exit(1);
+	client_handler(client_fd, client, server, CLIENT_CON_CLEANUP);
+}
+
+/**
+ * Updates the event registration of the client if its CLIENT_POLL_FOR_* flags changed
+ * since the last update.
+ */
+static void update_client_events(server_p server, int client_fd, client_p client) {
+	uint32_t poll_flags = client->flags & (CLIENT_POLL_FOR_READ | CLIENT_POLL_FOR_WRITE);
 	
-	return 0;
-}
\ No newline at end of file
+	if (server->uring) {
+		// Don't poll for writability while a write request is still in flight
+		if (client->flags & CLIENT_WRITE_IN_FLIGHT)
+			poll_flags &= ~CLIENT_POLL_FOR_WRITE;
+		if (poll_flags == client->polled_flags)
+			return;
+		
+		// Arm the new poll request before we remove the old one. Without a submission queue
+		// entry for it (see uring_get_sqe()) the old one stays and reports the shut down
+		// connection, the client is disconnected then. Completions of an old one we
+		// couldn't remove are ignored since its flags are outdated.
+		uint32_t old_poll_flags = client->polled_flags;
+		if ( !uring_arm_client_poll(server, client_fd, client, poll_flags) ) {
+			warn("[client %d] io_uring: failed to update poll request, disconnecting: %s", client_fd, strerror(errno));
+			shutdown(client_fd, SHUT_RDWR);
+			return;
+		}
+		
+		struct io_uring_sqe* sqe = uring_get_sqe(server->uring);
+		if (sqe)
+			uring_prep_poll_remove(sqe, uring_user_data(URING_POLL, client_fd, client->io_generation, old_poll_flags), uring_user_data(URING_IGNORE, client_fd, 0, 0));
+		else
+			warn("[client %d] io_uring: failed to remove old poll request: %s", client_fd, strerror(errno));
+	} else {
+		if (poll_flags == client->polled_flags)
+			return;
+		
+		struct epoll_event event = { .events = epoll_events_for(poll_flags), .data.fd = client_fd };
+		if ( epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, client_fd, &event) == -1 )
+			warn("[client %d] failed to update polled events, epoll_ctl: %s", client_fd, strerror(errno));
+		else
+			client->polled_flags = poll_flags;
+	}
+}
+
+/**
+ * Lets the viewers that used up their write budget continue, each one with a new budget.
+ * Those that use it up again are added to the (swapped) yielded_clients array and
+ * continue in the next round. Clients that disconnected in the meantime don't have
+ * CLIENT_WRITE_YIELDED set (a new connection with the same fd neither).
+ */
+static void continue_yielded_clients(server_p server, array_p* spare_yielded) {
+	array_p yielded = server->yielded_clients;
+	server->yielded_clients = *spare_yielded;
+	
+	for(size_t i = 0; i < yielded->length; i++) {
+		int client_fd = array_elem(yielded, int, i);
+		client_p client = hash_get_ptr(server->clients, client_fd);
+		if (client == NULL || !(client->flags & CLIENT_WRITE_YIELDED))
+			continue;
+		
+		// With io_uring the completion of a write request in flight continues the client
+		client->flags &= ~CLIENT_WRITE_YIELDED;
+		if (client->flags & CLIENT_WRITE_IN_FLIGHT)
+			continue;
+		if ( client_handler(client_fd, client, server, CLIENT_CON_WRITABLE) == -1 ) {
+			info("[client %d] disconnected via client handler", client_fd);
+			disconnect_client(server, client_fd, client);
+			hash_remove(server->clients, client_fd);
+			continue;
+		}
+		
+		update_client_events(server, client_fd, client);
+	}
+	
+	array_resize(yielded, 0);
+	*spare_yielded = yielded;
+}
+
+/**
+ * Processes all messages other threads sent to this worker. Returns false if the worker
+ * should leave its event loop. `spare_inbox` is an empty array that is swapped with the
+ * inbox. Afterwards it contains the emptied old inbox for the next call.
+ */
+static bool process_worker_messages(server_p server, array_p* spare_inbox) {
+	array_p messages = worker_take_messages(server, *spare_inbox);
+	bool keep_running = true;
+	
+	for(size_t i = 0; i < messages->length; i++) {
+		worker_message_p message = &array_elem(messages, worker_message_t, i);
+		switch(message->type) {
+			case WORKER_MESSAGE_CLUSTER:
+				stream_deliver_cluster(server, message->stream, message->cluster, message->cluster_seq, message->cluster_starts_with_keyframe);
+				stream_unref(message->stream);
+				break;
+			case WORKER_MESSAGE_DELETE_STREAM:
+				delete_stream(server, message->stream);
+				break;
+			case WORKER_MESSAGE_BLOCKS:
+				stream_deliver_blocks(server, message->stream);
+				stream_unref(message->stream);
+				break;
+			case WORKER_MESSAGE_RESUME_SOURCE:
+				stream_resume_source(server, message->stream);
+				stream_unref(message->stream);
+				break;
+			case WORKER_MESSAGE_STOP:
+				keep_running = false;
+				break;
+		}
+	}
+	
+	array_resize(messages, 0);
+	*spare_inbox = messages;
+	return keep_running;
+}
+
+/**
+ * Disconnects all clients of this worker watching the stream and releases the reference
+ * of the delete message. The last worker doing so frees the stream.
+ */
+static void delete_stream(server_p server, stream_p stream) {
+	// First disconnect all clients watching that stream. Each disconnected client removes
+	// itself from the viewers array. Then release the intro (the first worker gets to it)
+	// and the clusters still in the ring.
+	stream_feed_p feed = &stream->feeds[server->worker_index];
+	while (feed->viewers->length > 0) {
+		int client_fd = array_elem(feed->viewers, int, feed->viewers->length - 1);
+		info("[client %d] disconnected because stream was deleted", client_fd);
+		disconnect_client(server, client_fd, hash_get_ptr(server->clients, client_fd));
+		hash_remove(server->clients, client_fd);
+	}
+	
+	stream_release_intro(server, stream);
+	stream_release_feed(server, stream);
+	stream_unref(stream);
+}
+
+/**
+ * Called by the main thread. Removes expired streams from the streams dict and tells all
+ * workers to disconnect the viewers of those streams.
+ */
+static void delete_expired_streams(server_p workers, size_t worker_count) {
+	dict_p streams = workers[0].streams;
+	int timeout_sec = workers[0].stream_delete_timeout_sec;
+	
+	pthread_mutex_lock(workers[0].streams_lock);
+	for(dict_elem_t e = dict_start(streams); e != NULL; e = dict_next(streams, e)) {
+		stream_p stream = dict_value(e, stream_p);
+		if (stream->last_disconnect_at != 0 && stream->last_disconnect_at + timeout_sec * 1000000LL < time_now()) {
+			info("[stream %s] deleting stream, no new data arrived within timeout of %d seconds", dict_key(e), timeout_sec);
+			
+			// Each message holds a reference to the stream. The reference of the dict is
+			// released right away.
+			for(size_t i = 0; i < worker_count; i++) {
+				stream_ref(stream);
+				worker_post_message(&workers[i], (worker_message_t){ .type = WORKER_MESSAGE_DELETE_STREAM, .stream = stream });
+			}
+			
+			dict_remove_elem(streams, e);
+			stream_unref(stream);
+			streams_version++;
+		}
+	}
+	pthread_mutex_unlock(workers[0].streams_lock);
+}
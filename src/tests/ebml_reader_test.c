@@ -190,6 +190,93 @@ void test_read_int_and_uint() {
 }
 
 
+void test_parser_with_data_arriving_byte_by_byte() {
+	char* buffer_ptr = NULL;
+	size_t buffer_size = 0;
+	FILE* f = open_memstream(&buffer_ptr, &buffer_size);
+		ebml_element_start_unkown_data_size(f, MKV_Segment);
+		off_t o1 = ebml_element_start(f, MKV_Cluster);
+			ebml_element_uint(f, MKV_Timecode, 1000);
+			ebml_element_string(f, MKV_SimpleBlock, "block");
+		ebml_element_end(f, o1);
+		ebml_element_start_unkown_data_size(f, MKV_Cluster);
+			ebml_element_uint(f, MKV_Timecode, 2000);
+		ebml_element_start_unkown_data_size(f, MKV_Cluster);
+	fclose(f);
+	
+	ebml_parser_t parser;
+	ebml_parser_init(&parser);
+	ebml_event_t events[16];
+	size_t event_count = 0;
+	
+	// Hand the parser one more byte each time it needs more data
+	for(size_t filled = 0; filled <= buffer_size && event_count < 16; filled++) {
+		ebml_event_t e;
+		while ( event_count < 16 && (e = ebml_parser_next(&parser, buffer_ptr, filled)).type != EBML_NEED_MORE_DATA ) {
+			events[event_count++] = e;
+			// Enter the first cluster, skip all other known size elements
+			if (e.type == EBML_ELEMENT_BEGIN && e.id == MKV_Cluster && e.offset == 5)
+				ebml_parser_enter(&parser);
+		}
+	}
+	
+	check_int(event_count, 12);
+	check(events[0].type == EBML_ELEMENT_BEGIN    && events[0].id == MKV_Segment);
+	check(events[0].data_size == EBML_UNKNOWN_SIZE);
+	check(events[1].type == EBML_ELEMENT_BEGIN    && events[1].id == MKV_Cluster);
+	check(events[2].type == EBML_ELEMENT_BEGIN    && events[2].id == MKV_Timecode);
+	check(events[3].type == EBML_ELEMENT_COMPLETE && events[3].id == MKV_Timecode);
+	check(events[4].type == EBML_ELEMENT_BEGIN    && events[4].id == MKV_SimpleBlock);
+	check(events[5].type == EBML_ELEMENT_COMPLETE && events[5].id == MKV_SimpleBlock);
+	check(events[6].type == EBML_ELEMENT_COMPLETE && events[6].id == MKV_Cluster);
+	check_int(events[6].offset, 5);
+	check_int(events[6].header_size + events[6].data_size, 4 + 4 + 4 + 7);
+	// The unknown size cluster is entered on its own and completed by the next cluster
+	check(events[7].type == EBML_ELEMENT_BEGIN    && events[7].id == MKV_Cluster);
+	check(events[8].type == EBML_ELEMENT_BEGIN    && events[8].id == MKV_Timecode);
+	check(events[9].type == EBML_ELEMENT_COMPLETE && events[9].id == MKV_Timecode);
+	check(events[10].type == EBML_ELEMENT_COMPLETE && events[10].id == MKV_Cluster);
+	check_int(events[10].offset, 24);
+	check_int(events[10].data_size, 4);
+	check(events[11].type == EBML_ELEMENT_BEGIN   && events[11].id == MKV_Cluster);
+	
+	free(buffer_ptr);
+}
+
+void test_parser_consume() {
+	char* buffer_ptr = NULL;
+	size_t buffer_size = 0;
+	FILE* f = open_memstream(&buffer_ptr, &buffer_size);
+		ebml_element_uint(f, MKV_Timecode, 1000);
+		ebml_element_uint(f, MKV_Timecode, 2000);
+	fclose(f);
+	
+	ebml_parser_t parser;
+	ebml_parser_init(&parser);
+	
+	ebml_event_t e = ebml_parser_next(&parser, buffer_ptr, buffer_size);
+	check(e.type == EBML_ELEMENT_BEGIN);
+	e = ebml_parser_next(&parser, buffer_ptr, buffer_size);
+	check(e.type == EBML_ELEMENT_COMPLETE);
+	check_int(parser.pos, 4);
+	
+	// Remove the first element from the buffer
+	memmove(buffer_ptr, buffer_ptr + 4, buffer_size - 4);
+	buffer_size -= 4;
+	ebml_parser_consume(&parser, 4);
+	
+	e = ebml_parser_next(&parser, buffer_ptr, buffer_size);
+	check(e.type == EBML_ELEMENT_BEGIN && e.offset == 0);
+	e = ebml_parser_next(&parser, buffer_ptr, buffer_size);
+	check(e.type == EBML_ELEMENT_COMPLETE);
+	check_int(ebml_read_uint(buffer_ptr + e.header_size, e.data_size), 2000);
+	e = ebml_parser_next(&parser, buffer_ptr, buffer_size);
+	check(e.type == EBML_NEED_MORE_DATA);
+	
+	free(buffer_ptr);
+}
+
+
 static void write_test_file(const char* filename) {
 	FILE* f = fopen(filename, "wb");
 	
@@ -263,6 +350,8 @@ int main() {
 	run(test_read_data_size_unknown_sizes);
 	run(test_read_element_and_element_header);
 	run(test_read_int_and_uint);
+	run(test_parser_with_data_arriving_byte_by_byte);
+	run(test_parser_consume);
 	
 	unlink(test_file_name);
 	return show_report();
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "testing.h"
+#include "../histogram.h"
+
+
+void test_buckets() {
+	check_int(histogram_bucket_of(0), 0);
+	check_int(histogram_bucket_of(128), 0);
+	check_int(histogram_bucket_of(129), 1);
+	check_int(histogram_bucket_of(192), 1);
+	check_int(histogram_bucket_of(193), 2);
+	check_int(histogram_bucket_of(256), 2);
+	check_int(histogram_bucket_of(257), 3);
+	check_int(histogram_bucket_of(1 << 25), HISTOGRAM_BUCKETS - 2);
+	check_int(histogram_bucket_of((1 << 25) + 1), HISTOGRAM_BUCKETS - 1);
+	check_int(histogram_bucket_of(UINT64_MAX), HISTOGRAM_BUCKETS - 1);
+	
+	check_int(histogram_bucket_limit(0), 128);
+	check_int(histogram_bucket_limit(1), 192);
+	check_int(histogram_bucket_limit(2), 256);
+	check_int(histogram_bucket_limit(3), 384);
+	check_int(histogram_bucket_limit(HISTOGRAM_BUCKETS - 2), 1 << 25);
+	check(histogram_bucket_limit(HISTOGRAM_BUCKETS - 1) == UINT64_MAX);
+	
+	// Each value has to be in the first bucket whose limit isn't below it
+	for(size_t i = 1; i < HISTOGRAM_BUCKETS - 1; i++) {
+		check_int(histogram_bucket_of(histogram_bucket_limit(i)), i);
+		check_int(histogram_bucket_of(histogram_bucket_limit(i - 1) + 1), i);
+	}
+}
+
+void test_record_and_merge() {
+	histogram_t a, b;
+	memset(&a, 0, sizeof(a));
+	memset(&b, 0, sizeof(b));
+	
+	histogram_record(&a, 100);
+	histogram_record(&a, 1000);
+	histogram_record(&b, 1000);
+	histogram_record(&b, 100 * 1000 * 1000);
+	
+	histogram_merge(&a, &b);
+	check_int(a.count, 4);
+	check_int(a.sum, 100 + 1000 + 1000 + 100 * 1000 * 1000);
+	check_int(a.counts[0], 1);
+	check_int(a.counts[histogram_bucket_of(1000)], 2);
+	check_int(a.counts[HISTOGRAM_BUCKETS - 1], 1);
+	check_int(b.count, 2);
+}
+
+int main() {
+	run(test_buckets);
+	run(test_record_and_merge);
+	
+	return show_report();
+}
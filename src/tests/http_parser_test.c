@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "testing.h"
+#include "../http_parser.h"
+
+
+void test_request() {
+	char buffer[] = "GET /live.webm?low_latency HTTP/1.1\r\nUser-Agent: smoke\r\nHost:  localhost \r\n\r\nbody";
+	size_t buffer_size = strlen(buffer);
+	http_parser_t parser;
+	http_parser_init(&parser);
+	
+	http_event_t event = http_parser_next(&parser, buffer, buffer_size);
+	check_int(event.type, HTTP_REQUEST_LINE);
+	check_str(event.method.ptr, "GET");
+	check_int(event.method.size, 3);
+	check_str(event.resource.ptr, "/live.webm?low_latency");
+	check_str(event.version.ptr, "HTTP/1.1");
+	
+	event = http_parser_next(&parser, buffer, buffer_size);
+	check_int(event.type, HTTP_HEADER);
+	check_str(event.name.ptr, "User-Agent");
+	check_str(event.value.ptr, "smoke");
+	
+	event = http_parser_next(&parser, buffer, buffer_size);
+	check_int(event.type, HTTP_HEADER);
+	check_str(event.name.ptr, "Host");
+	check_str(event.value.ptr, "localhost");
+	check_int(event.value.size, 9);
+	
+	event = http_parser_next(&parser, buffer, buffer_size);
+	check_int(event.type, HTTP_HEADERS_COMPLETE);
+	check_str(buffer + parser.pos, "body");
+	
+	event = http_parser_next(&parser, buffer, buffer_size);
+	check_int(event.type, HTTP_HEADERS_COMPLETE);
+}
+
+void test_request_in_pieces() {
+	char* request = "\r\nPOST /stream HTTP/1.0\nbroken line\nX-Test:\r\n\n";
+	char buffer[128];
+	http_parser_t parser;
+	http_parser_init(&parser);
+	
+	// Feed the request one byte at a time, the events have to come at the end of each line
+	http_event_type_t types[8];
+	size_t type_count = 0;
+	for(size_t i = 0; i < strlen(request); i++) {
+		buffer[i] = request[i];
+		
+		http_event_t event;
+		while ( (event = http_parser_next(&parser, buffer, i + 1)).type != HTTP_NEED_MORE_DATA && type_count < 8 ) {
+			types[type_count++] = event.type;
+			if (event.type == HTTP_REQUEST_LINE) {
+				check_str(event.method.ptr, "POST");
+				check_str(event.resource.ptr, "/stream");
+			} else if (event.type == HTTP_HEADER) {
+				check_str(event.name.ptr, "X-Test");
+				check_int(event.value.size, 0);
+			} else if (event.type == HTTP_HEADERS_COMPLETE) {
+				check_int(parser.pos, i + 1);
+				break;
+			}
+		}
+	}
+	
+	check_int(type_count, 3);
+	check_int(types[0], HTTP_REQUEST_LINE);
+	check_int(types[1], HTTP_HEADER);
+	check_int(types[2], HTTP_HEADERS_COMPLETE);
+}
+
+void test_malformed_request_line() {
+	char buffer[] = "GET /\r\n\r\n";
+	http_parser_t parser;
+	http_parser_init(&parser);
+	
+	http_event_t event = http_parser_next(&parser, buffer, strlen(buffer));
+	check_int(event.type, HTTP_ERROR);
+}
+
+void test_params() {
+	char resource[] = "/live.webm?low_latency&max_lag=2.5&title=a%20b&";
+	char* pos = strchr(resource, '?');
+	http_slice_t name, value;
+	
+	// A bare name gets an empty value, not a missing one
+	check(http_next_param(&pos, &name, &value));
+	check_int(name.size, 11);
+	check(strncmp(name.ptr, "low_latency", name.size) == 0);
+	check(value.ptr != NULL);
+	check_int(value.size, 0);
+	
+	check(http_next_param(&pos, &name, &value));
+	check(strncmp(name.ptr, "max_lag", name.size) == 0);
+	check_int(value.size, 3);
+	check(strncmp(value.ptr, "2.5", value.size) == 0);
+	
+	check(http_next_param(&pos, &name, &value));
+	check(strncmp(name.ptr, "title", name.size) == 0);
+	check(strncmp(value.ptr, "a%20b", value.size) == 0);
+	
+	// The trailing & is an empty param
+	check(http_next_param(&pos, &name, &value));
+	check_int(name.size, 0);
+	check_int(value.size, 0);
+	
+	check(!http_next_param(&pos, &name, &value));
+	
+	char no_params[] = "";
+	pos = no_params;
+	check(!http_next_param(&pos, &name, &value));
+}
+
+int main() {
+	run(test_request);
+	run(test_request_in_pieces);
+	run(test_malformed_request_line);
+	run(test_params);
+	
+	return show_report();
+}
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "testing.h"
+#include "../pool.h"
+
+
+void test_alloc_and_free() {
+	size_t used = pool_used_bytes();
+	
+	char* a = pool_alloc(10);
+	check_not_null(a);
+	memset(a, 'a', 10);
+	check_int(pool_used_bytes() - used, 32);
+	check_int((uintptr_t)a % 16, 0);
+	
+	char* b = pool_alloc(1000);
+	check_not_null(b);
+	memset(b, 'b', 1000);
+	check_int(pool_used_bytes() - used, 32 + 1024);
+	
+	pool_free(a);
+	pool_free(b);
+	check_int(pool_used_bytes(), used);
+	pool_free(NULL);
+}
+
+void test_size_classes() {
+	size_t used = pool_used_bytes();
+	size_t sizes[][2] = {
+		{ 1, 32 }, { 32, 32 }, { 33, 40 }, { 40, 40 }, { 41, 48 }, { 64, 64 }, { 65, 80 },
+		{ 100000, 114688 }, { 64 * 1024 * 1024, 64 * 1024 * 1024 }
+	};
+	
+	for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		void* ptr = pool_alloc(sizes[i][0]);
+		check_msg(pool_used_bytes() - used == sizes[i][1], "size %zu: got block of %zu bytes, expected %zu",
+			sizes[i][0], pool_used_bytes() - used, sizes[i][1]);
+		pool_free(ptr);
+	}
+	
+	// Blocks larger than POOL_MAX_BLOCK_SIZE are not rounded up
+	void* ptr = pool_alloc(POOL_MAX_BLOCK_SIZE + 1);
+	check_int(pool_used_bytes() - used, POOL_MAX_BLOCK_SIZE + 1);
+	pool_free(ptr);
+}
+
+void test_blocks_are_recycled() {
+	void* a = pool_alloc(5000);
+	pool_free(a);
+	size_t cached = pool_cached_bytes();
+	check(cached >= 5120);
+	
+	void* b = pool_alloc(5100);
+	check(a == b);
+	check_int(pool_cached_bytes(), cached - 5120);
+	pool_free(b);
+}
+
+static void* alloc_and_free_in_thread(void* arg) {
+	void** ptrs = arg;
+	// Free the block allocated by the main thread and leave a block of our own in the
+	// thread cache
+	pool_free(ptrs[0]);
+	ptrs[1] = pool_alloc(3000);
+	pool_free(ptrs[1]);
+	return NULL;
+}
+
+void test_thread_caches() {
+	size_t used = pool_used_bytes(), cached = pool_cached_bytes();
+	void* ptrs[2] = { pool_alloc(10000), NULL };
+	check_int(pool_used_bytes() - used, 10240);
+	
+	pthread_t thread;
+	int error = pthread_create(&thread, NULL, alloc_and_free_in_thread, ptrs);
+	check_int(error, 0);
+	pthread_join(thread, NULL);
+	
+	// Both blocks moved to the shared lists when the thread exited
+	check_int(pool_used_bytes(), used);
+	check_int(pool_cached_bytes() - cached, 10240 + 3072);
+	
+	void* a = pool_alloc(3000);
+	check(a == ptrs[1]);
+	pool_free(a);
+}
+
+void test_spill_to_shared_list() {
+	// Free more blocks than a thread keeps, the rest has to go to the shared list
+	size_t count = 2 * POOL_MAX_BATCH_BLOCKS + 1;
+	void* ptrs[count];
+	for(size_t i = 0; i < count; i++)
+		ptrs[i] = pool_alloc(100);
+	size_t cached = pool_cached_bytes();
+	for(size_t i = 0; i < count; i++)
+		pool_free(ptrs[i]);
+	check_int(pool_cached_bytes() - cached, count * 112);
+	
+	for(size_t i = 0; i < count; i++)
+		ptrs[i] = pool_alloc(100);
+	check_int(pool_cached_bytes(), cached);
+	for(size_t i = 0; i < count; i++)
+		pool_free(ptrs[i]);
+}
+
+int main() {
+	run(test_alloc_and_free);
+	// Before test_size_classes(), its 64 MiB block fills up the shared lists
+	run(test_thread_caches);
+	run(test_spill_to_shared_list);
+	run(test_size_classes);
+	run(test_blocks_are_recycled);
+	
+	return show_report();
+}
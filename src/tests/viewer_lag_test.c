@@ -0,0 +1,186 @@
+// Required for open_memstream and usleep
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "testing.h"
+#include "../ebml_writer.h"
+#include "../matroska.h"
+
+// Runs the smeb binary, so it has to be started in the src directory (like `make tests`
+// does). A source sends 100 KiB clusters 40 times a second, a keyframe every 5 clusters.
+
+#define CLUSTER_COUNT  300
+#define BLOCK_SIZE     25000
+
+static int port;
+
+
+static pid_t server_start() {
+	char port_str[16];
+	snprintf(port_str, sizeof(port_str), "%d", port);
+	
+	pid_t pid = fork();
+	if (pid == 0) {
+		int null_fd = open("/dev/null", O_WRONLY);
+		dup2(null_fd, STDERR_FILENO);
+		execl("./smeb", "./smeb", "127.0.0.1", port_str, "warn", "2", NULL);
+		_exit(1);
+	}
+	
+	usleep(300 * 1000);
+	return pid;
+}
+
+static void server_stop(pid_t pid) {
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
+static int connect_and_send(const char* request, char* data, size_t size) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+	inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+	if ( connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ) {
+		close(fd);
+		return -1;
+	}
+	
+	send(fd, request, strlen(request), MSG_NOSIGNAL);
+	if (data)
+		send(fd, data, size, MSG_NOSIGNAL);
+	return fd;
+}
+
+static void write_header(FILE* f) {
+	long ebml = ebml_element_start(f, MKV_EBML);
+		ebml_element_string(f, MKV_DocType, "webm");
+	ebml_element_end(f, ebml);
+	
+	ebml_element_start_unkown_data_size(f, MKV_Segment);
+	long info = ebml_element_start(f, MKV_Info);
+		ebml_element_uint(f, MKV_TimecodeScale, 1000000);
+	ebml_element_end(f, info);
+	
+	long tracks = ebml_element_start(f, MKV_Tracks);
+		long track = ebml_element_start(f, MKV_TrackEntry);
+			ebml_element_uint(f, MKV_TrackNumber, 1);
+			ebml_element_uint(f, MKV_TrackType, MKV_TrackType_Video);
+			ebml_element_string(f, MKV_CodecID, "V_VP8");
+		ebml_element_end(f, track);
+	ebml_element_end(f, tracks);
+}
+
+static void write_cluster(FILE* f, size_t n, char* payload) {
+	long cluster = ebml_element_start(f, MKV_Cluster);
+		ebml_element_uint(f, MKV_Timecode, 1000 + n * 25);
+		for(size_t i = 0; i < 4; i++) {
+			uint8_t flags = (i == 0 && n % 5 == 0) ? 0x80 : 0x00;
+			uint8_t block_header[] = { 0x81, 0, i * 5, flags };
+			ebml_write_element_id(f, MKV_SimpleBlock);
+			ebml_write_data_size(f, sizeof(block_header) + BLOCK_SIZE, 0);
+			fwrite(block_header, sizeof(block_header), 1, f);
+			fwrite(payload, BLOCK_SIZE, 1, f);
+		}
+	ebml_element_end(f, cluster);
+}
+
+static void* source_main(void* arg) {
+	char* buffer = NULL;
+	size_t buffer_size = 0;
+	FILE* f = open_memstream(&buffer, &buffer_size);
+	write_header(f);
+	fflush(f);
+	
+	int fd = connect_and_send("POST /lag.webm?max_lag=1 HTTP/1.1\r\n\r\n", buffer, buffer_size);
+	char* payload = calloc(BLOCK_SIZE, 1);
+	for(size_t n = 0; n < CLUSTER_COUNT && fd != -1; n++) {
+		fseek(f, 0, SEEK_SET);
+		write_cluster(f, n, payload);
+		fflush(f);
+		long size = ftell(f);
+		send(fd, buffer, size, MSG_NOSIGNAL);
+		usleep(25 * 1000);
+	}
+	
+	free(payload);
+	fclose(f);
+	free(buffer);
+	if (fd != -1)
+		close(fd);
+	return NULL;
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * A viewer that stops reading in the middle of a cluster until the ring wrapped around it
+ * (with max_lag=1) has to skip ahead instead of being disconnected.
+ */
+void test_stalled_viewer_skips_ahead() {
+	pid_t server = server_start();
+	pthread_t source;
+	pthread_create(&source, NULL, source_main, NULL);
+	usleep(300 * 1000);
+	
+	int fd = connect_and_send("GET /lag.webm HTTP/1.1\r\n\r\n", NULL, 0);
+	check(fd != -1);
+	struct timeval timeout = { .tv_sec = 0, .tv_usec = 500 * 1000 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	
+	char buffer[64 * 1024];
+	size_t received = 0;
+	while (received < 300 * 1024) {
+		ssize_t bytes = recv(fd, buffer, sizeof(buffer), 0);
+		if (bytes <= 0)
+			break;
+		received += bytes;
+	}
+	check(received >= 300 * 1024);
+	
+	// 160 clusters arrive while we don't read, the ring only holds 64 of them
+	sleep(4);
+	
+	bool closed = false;
+	size_t received_after_pause = 0;
+	double end = now() + 2.5;
+	while (now() < end) {
+		ssize_t bytes = recv(fd, buffer, sizeof(buffer), 0);
+		if (bytes == 0) {
+			closed = true;
+			break;
+		}
+		if (bytes > 0)
+			received_after_pause += bytes;
+	}
+	
+	check_msg(!closed, "viewer was disconnected after it fell behind");
+	check(received_after_pause > 0);
+	
+	close(fd);
+	pthread_join(source, NULL);
+	server_stop(server);
+}
+
+int main() {
+	port = 20000 + getpid() % 20000;
+	run(test_stalled_viewer_skips_ahead);
+	
+	return show_report();
+}
@@ -0,0 +1,208 @@
+// for syscall() and MAP_POPULATE
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "uring.h"
+
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+/**
+ * Sets up a ring with `entries` submission queue entries and maps the queues into
+ * our address space. Also registers a sparse table for `buffer_table_size` fixed
+ * buffers. If the kernel doesn't support sparse buffer tables the ring works fine
+ * but uring_buffer_register() always returns -1.
+ *
+ * Returns -1 and sets errno on error.
+ */
+int uring_init(uring_p ring, unsigned entries, unsigned buffer_table_size) {
+	memset(ring, 0, sizeof(uring_t));
+	
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd == -1)
+		return -1;
+	
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	
+	// Newer kernels map both rings with one mmap() call
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	
+	ring->sq_ring_ptr = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring_ptr == MAP_FAILED)
+		goto close_ring;
+	
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring_ptr = ring->sq_ring_ptr;
+	} else {
+		ring->cq_ring_ptr = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring_ptr == MAP_FAILED)
+			goto unmap_sq_ring;
+	}
+	
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto unmap_cq_ring;
+	
+	ring->sq_head    = ring->sq_ring_ptr + params.sq_off.head;
+	ring->sq_tail    = ring->sq_ring_ptr + params.sq_off.tail;
+	ring->sq_mask    = *(unsigned*)(ring->sq_ring_ptr + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->sqe_tail   = *ring->sq_tail;
+	
+	ring->cq_head = ring->cq_ring_ptr + params.cq_off.head;
+	ring->cq_tail = ring->cq_ring_ptr + params.cq_off.tail;
+	ring->cq_mask = *(unsigned*)(ring->cq_ring_ptr + params.cq_off.ring_mask);
+	ring->cqes    = ring->cq_ring_ptr + params.cq_off.cqes;
+	
+	// We always use the submission queue entries in order, so the indirection array
+	// can map each slot to the entry with the same index once.
+	unsigned* sq_array = ring->sq_ring_ptr + params.sq_off.array;
+	for(unsigned i = 0; i < ring->sq_entries; i++)
+		sq_array[i] = i;
+	
+	// Register an empty buffer table. Entries are filled by uring_buffer_register().
+	struct io_uring_rsrc_register buffers;
+	memset(&buffers, 0, sizeof(buffers));
+	buffers.nr = buffer_table_size;
+	buffers.flags = IORING_RSRC_REGISTER_SPARSE;
+	if ( buffer_table_size > 0 && uring_register(ring->fd, IORING_REGISTER_BUFFERS2, &buffers, sizeof(buffers)) == 0 ) {
+		ring->buffer_table_size = buffer_table_size;
+		ring->free_buffers = malloc(buffer_table_size * sizeof(int));
+		for(size_t i = 0; i < buffer_table_size; i++)
+			ring->free_buffers[i] = buffer_table_size - 1 - i;
+		ring->free_buffer_count = buffer_table_size;
+	}
+	
+	return 0;
+	
+	unmap_cq_ring:
+		if (ring->cq_ring_ptr != ring->sq_ring_ptr)
+			munmap(ring->cq_ring_ptr, ring->cq_ring_size);
+	unmap_sq_ring:
+		munmap(ring->sq_ring_ptr, ring->sq_ring_size);
+	close_ring: {
+		int error = errno;
+		close(ring->fd);
+		errno = error;
+		return -1;
+	}
+}
+
+void uring_destroy(uring_p ring) {
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring_ptr != ring->sq_ring_ptr)
+		munmap(ring->cq_ring_ptr, ring->cq_ring_size);
+	munmap(ring->sq_ring_ptr, ring->sq_ring_size);
+	close(ring->fd);
+	free(ring->free_buffers);
+}
+
+
+//
+// Submission and completion
+//
+
+/**
+ * Returns a zeroed submission queue entry. If the queue is full all pending entries
+ * are submitted first. When that fails NULL is returned and errno is set, callers have
+ * to drop or retry their request then.
+ */
+struct io_uring_sqe* uring_get_sqe(uring_p ring) {
+	while (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+		if ( uring_submit_and_wait(ring, 0) == -1 && errno != EINTR && errno != EBUSY )
+			return NULL;
+	}
+	
+	struct io_uring_sqe* sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sqe_tail++;
+	return sqe;
+}
+
+/**
+ * Submits all pending entries and waits until at least `wait_nr` completions are
+ * available. Returns -1 and sets errno on error (e.g. EINTR).
+ */
+int uring_submit_and_wait(uring_p ring, unsigned wait_nr) {
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	unsigned to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	
+	return uring_enter(ring->fd, to_submit, wait_nr, (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0);
+}
+
+/**
+ * Returns the next completion or NULL if there is none. Call uring_cqe_seen() when
+ * you're done with it.
+ */
+struct io_uring_cqe* uring_peek_cqe(uring_p ring) {
+	unsigned head = *ring->cq_head;
+	if ( head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) )
+		return NULL;
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_p ring) {
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+//
+// Registered buffers
+//
+
+int uring_buffer_register(uring_p ring, void* ptr, size_t size) {
+	if (ring->free_buffer_count == 0)
+		return -1;
+	
+	int index = ring->free_buffers[ring->free_buffer_count - 1];
+	struct iovec iov = { ptr, size };
+	struct io_uring_rsrc_update2 update;
+	memset(&update, 0, sizeof(update));
+	update.offset = index;
+	update.data = (uintptr_t)&iov;
+	update.nr = 1;
+	
+	if ( uring_register(ring->fd, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) != 1 )
+		return -1;
+	
+	ring->free_buffer_count--;
+	return index;
+}
+
+/**
+ * Clears the table entry. Requests still in flight keep using the old entry, the
+ * kernel releases the pinned memory when they're done.
+ */
+void uring_buffer_unregister(uring_p ring, int index) {
+	struct iovec iov = { NULL, 0 };
+	struct io_uring_rsrc_update2 update;
+	memset(&update, 0, sizeof(update));
+	update.offset = index;
+	update.data = (uintptr_t)&iov;
+	update.nr = 1;
+	
+	uring_register(ring->fd, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update));
+	ring->free_buffers[ring->free_buffer_count++] = index;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+/**
+
+# A minimal io_uring wrapper
+
+Just enough of io_uring for the server loop. Talks to the kernel via the raw system
+calls so liburing isn't required. Use one ring per thread.
+
+
+// Creating and destroying a ring
+
+uring_t ring;
+if ( uring_init(&ring, 4096, 1024) == -1 )
+	perror("uring_init"), exit(1);
+uring_destroy(&ring);
+
+
+// Submitting requests and processing their completions. uring_get_sqe() submits
+// all queued requests on its own when the submission queue is full. It returns NULL if
+// that fails.
+
+struct io_uring_sqe* sqe = uring_get_sqe(&ring);
+uring_prep_poll_multishot(sqe, fd, POLLIN, user_data);
+
+uring_submit_and_wait(&ring, 1);
+for(struct io_uring_cqe* cqe = NULL; (cqe = uring_peek_cqe(&ring)) != NULL; uring_cqe_seen(&ring)) {
+	...
+}
+
+
+// Registered (fixed) buffers. uring_init() registers an empty table of the given size,
+// these functions fill and clear single entries. uring_buffer_register() returns -1 if
+// the table is full or the kernel refused to pin the memory.
+
+int index = uring_buffer_register(&ring, ptr, size);
+uring_prep_write_fixed(sqe, fd, ptr, size, index, user_data);
+uring_buffer_unregister(&ring, index);
+
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <linux/io_uring.h>
+
+
+typedef struct {
+	int fd;
+	
+	// Submission queue, sqe_tail counts the requests we handed out via uring_get_sqe()
+	unsigned *sq_head, *sq_tail, sq_mask, sq_entries;
+	unsigned sqe_tail;
+	struct io_uring_sqe* sqes;
+	
+	// Completion queue
+	unsigned *cq_head, *cq_tail, cq_mask;
+	struct io_uring_cqe* cqes;
+	
+	// Table of registered buffers, free entries are kept on a stack
+	int* free_buffers;
+	size_t free_buffer_count, buffer_table_size;
+	
+	void *sq_ring_ptr, *cq_ring_ptr;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+} uring_t, *uring_p;
+
+
+int                  uring_init(           uring_p ring, unsigned entries, unsigned buffer_table_size);
+void                 uring_destroy(        uring_p ring);
+
+struct io_uring_sqe* uring_get_sqe(        uring_p ring);
+int                  uring_submit_and_wait(uring_p ring, unsigned wait_nr);
+struct io_uring_cqe* uring_peek_cqe(       uring_p ring);
+void                 uring_cqe_seen(       uring_p ring);
+
+int                  uring_buffer_register(  uring_p ring, void* ptr, size_t size);
+void                 uring_buffer_unregister(uring_p ring, int index);
+
+
+static inline void uring_prep_poll_multishot(struct io_uring_sqe* sqe, int fd, uint32_t events, uint64_t user_data) {
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = user_data;
+}
+
+static inline void uring_prep_poll_remove(struct io_uring_sqe* sqe, uint64_t target_user_data, uint64_t user_data) {
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = target_user_data;
+	sqe->user_data = user_data;
+}
+
+static inline void uring_prep_accept_multishot(struct io_uring_sqe* sqe, int fd, int accept_flags, uint64_t user_data) {
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->accept_flags = accept_flags;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = user_data;
+}
+
+static inline void uring_prep_write(struct io_uring_sqe* sqe, int fd, const void* ptr, size_t size, uint64_t user_data) {
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)ptr;
+	sqe->len = size;
+	sqe->off = (uint64_t)-1;
+	sqe->user_data = user_data;
+}
+
+static inline void uring_prep_write_fixed(struct io_uring_sqe* sqe, int fd, const void* ptr, size_t size, int buffer_index, uint64_t user_data) {
+	uring_prep_write(sqe, fd, ptr, size, user_data);
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->buf_index = buffer_index;
+}
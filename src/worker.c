@@ -0,0 +1,44 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "worker.h"
+
+
+/**
+ * Appends the message to the inbox of the worker. Can be called by any thread. The
+ * eventfd of the worker is only signaled if the inbox was empty. Otherwise it hasn't
+ * taken the messages out yet and will see the new one, too.
+ */
+void worker_post_message(server_p worker, worker_message_t message) {
+	pthread_mutex_lock(&worker->inbox_lock);
+		bool inbox_was_empty = (worker->inbox->length == 0);
+		array_append(worker->inbox, worker_message_t, message);
+	pthread_mutex_unlock(&worker->inbox_lock);
+	
+	if (inbox_was_empty) {
+		uint64_t value = 1;
+		if ( write(worker->inbox_fd, &value, sizeof(value)) == -1 )
+			warn("[worker %zu] failed to signal inbox: %s", worker->worker_index, strerror(errno));
+	}
+}
+
+/**
+ * Swaps the inbox of the worker with the empty `messages` array and returns the old
+ * inbox. That way other threads can post new messages while the old ones are processed.
+ * Called by the worker itself when its eventfd becomes readable.
+ */
+array_p worker_take_messages(server_p worker, array_p messages) {
+	uint64_t value;
+	if ( read(worker->inbox_fd, &value, sizeof(value)) == -1 && errno != EAGAIN )
+		warn("[worker %zu] failed to read inbox eventfd: %s", worker->worker_index, strerror(errno));
+	
+	pthread_mutex_lock(&worker->inbox_lock);
+		array_p inbox = worker->inbox;
+		worker->inbox = messages;
+	pthread_mutex_unlock(&worker->inbox_lock);
+	
+	return inbox;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "common.h"
+
+void    worker_post_message  (server_p worker, worker_message_t message);
+array_p worker_take_messages (server_p worker, array_p messages);